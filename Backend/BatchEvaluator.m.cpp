@@ -0,0 +1,184 @@
+module;
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include "../Utilities/Exception.h"
+
+export module CalcBackend_BatchEvaluator;
+
+import CalcUtilities;
+import CalcBackend_Stack;
+import CalcBackend_CommandFactory;
+import CommandInterpreter;
+import UserInterface;
+
+using std::string;
+using std::string_view;
+using std::vector;
+using std::jthread;
+using std::mutex;
+using std::condition_variable;
+using std::unique_lock;
+using std::lock_guard;
+using std::atomic;
+
+namespace Calculator {
+
+    export struct ScriptResult {
+        vector<double> stack; // top of stack first
+        vector<string> messages;
+    };
+
+    // Evaluates independent RPN scripts on a pool of worker threads. Every worker
+    // binds its own Stack and builds a fresh CommandInterpreter (and hence
+    // CommandManager) per script, so workers share nothing but the
+    // CommandFactory, which they only read: staged and lazily loaded commands
+    // are applied by the factory's owner thread alone. Commands must be
+    // registered before Evaluate is called, and Evaluate called on the
+    // owner thread, which then changes nothing until the workers are done.
+    export class BatchEvaluator {
+    public:
+        using ResultSink = std::function<void(size_t index, ScriptResult &&result)>;
+
+        explicit BatchEvaluator(unsigned nThreads = std::thread::hardware_concurrency(),
+                                size_t chunkSize = 64);
+
+        ~BatchEvaluator() = default;
+
+        // Results are handed to sink on the calling thread, in input order, as
+        // soon as every script before them has finished.
+        void Evaluate(const vector<string> &scripts, const ResultSink &sink) const;
+
+        static ScriptResult EvaluateScript(const string &script);
+
+    private:
+        BatchEvaluator(const BatchEvaluator &) = delete;
+        BatchEvaluator(BatchEvaluator &&) = delete;
+        BatchEvaluator &operator=(const BatchEvaluator &) = delete;
+        BatchEvaluator &operator=(BatchEvaluator &&) = delete;
+
+        unsigned _nThreads;
+        size_t _chunkSize;
+    };
+
+    namespace {
+        class ScriptSink : public UserInterface {
+        public:
+            explicit ScriptSink(ScriptResult &result) : _result(result) {}
+
+        private:
+            void PostMessage(string_view message) override { _result.messages.emplace_back(message); }
+
+            void StackChanged() override {}
+
+            ScriptResult &_result;
+        };
+    }
+
+    BatchEvaluator::BatchEvaluator(unsigned nThreads, size_t chunkSize)
+            : _nThreads{std::max(nThreads, 1u)}, _chunkSize{std::max(chunkSize, size_t{1})} {}
+
+    ScriptResult BatchEvaluator::EvaluateScript(const string &script) {
+        ScriptResult result;
+        ScriptSink sink{result};
+
+        Stack::Instance().Clear();
+
+        try {
+            CommandInterpreter interpreter{sink};
+
+            for (const auto &token: Tokenizer{script})
+                interpreter.commandEntered(token);
+        }
+        catch (Exception &e) {
+            result.messages.push_back(e.What());
+        }
+
+        result.stack = Stack::Instance().GetElements(Stack::Instance().Size());
+        return result;
+    }
+
+    void BatchEvaluator::Evaluate(const vector<string> &scripts, const ResultSink &sink) const {
+        if (!CommandFactory::Instance().IsOwnerThread())
+            throw Exception{"Scripts can only be evaluated on the thread that owns the command factory"};
+
+        const size_t nChunks = (scripts.size() + _chunkSize - 1) / _chunkSize;
+        // Bounds how far workers may run ahead of the in-order emitter.
+        const size_t window = 4 * static_cast<size_t>(_nThreads);
+
+        vector<ScriptResult> results(scripts.size());
+        vector<char> done(nChunks, 0);
+        atomic<size_t> nextChunk{0};
+        size_t emitted{0};
+        mutex m;
+        condition_variable cv;
+
+        auto work = [&] {
+            StackScope scope;
+
+            for (size_t c = nextChunk++; c < nChunks; c = nextChunk++) {
+                {
+                    unique_lock lock{m};
+                    cv.wait(lock, [&] { return c < emitted + window; });
+                }
+
+                const auto last = std::min(scripts.size(), (c + 1) * _chunkSize);
+                for (auto i = c * _chunkSize; i < last; ++i)
+                    results[i] = EvaluateScript(scripts[i]);
+
+                {
+                    lock_guard lock{m};
+                    done[c] = 1;
+                }
+                cv.notify_all();
+            }
+        };
+
+        vector<jthread> workers;
+        const auto nWorkers = std::min(static_cast<size_t>(_nThreads), nChunks);
+        workers.reserve(nWorkers);
+
+        for (size_t i = 0; i < nWorkers; ++i)
+            workers.emplace_back(work);
+
+        auto emit = [&] {
+            for (size_t c = 0; c < nChunks; ++c) {
+                {
+                    unique_lock lock{m};
+                    cv.wait(lock, [&] { return done[c] != 0; });
+                }
+
+                const auto last = std::min(scripts.size(), (c + 1) * _chunkSize);
+                for (auto i = c * _chunkSize; i < last; ++i)
+                    sink(i, std::move(results[i]));
+
+                {
+                    lock_guard lock{m};
+                    ++emitted;
+                }
+                cv.notify_all();
+            }
+        };
+
+        try {
+            emit();
+        }
+        catch (...) {
+            // Release the workers so the pool can be joined while unwinding.
+            nextChunk = nChunks;
+            {
+                lock_guard lock{m};
+                emitted = nChunks;
+            }
+            cv.notify_all();
+            throw;
+        }
+    }
+}
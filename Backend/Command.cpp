@@ -1,77 +1,82 @@
 module;
 
 #include <string_view>
+#include <expected>
 #include "../Utilities/Exception.h"
 
 module CalcBackend_Command;
 
 import CalcUtilities;
-import CalcBackend_Stack;
 
 using std::string_view;
 
 namespace Calculator {
 
-    void Command::execute() {
-        checkPreconditionsImp();
-        executeImp();
+    Command::Command() {}
+
+    Command::Command(const Command &) {}
+
+    CommandResult Command::tryExecute() {
+        Probe probe{ProbeSite::Execute};
+        return tryExecuteImp();
     }
 
-    void Command::undo() {
-        undoImp();
+    CommandResult Command::tryExecuteImp() {
+        if (const char *p = checkPreconditionsImp())
+            return std::unexpected{p};
+
+        executeImp();
+        return {};
     }
 
-    Command *Command::clone() const {
-        return cloneImp();
+    void Command::execute() {
+        if (auto r = tryExecute(); !r)
+            throw Exception{r.error()};
     }
 
-    void Command::deallocate() {
-        delete this;
+    void Command::undo() {
+        Probe probe{ProbeSite::Undo};
+        undoImp();
     }
 
-    void Command::checkPreconditionsImp() const {}
+    CommandResult Command::tryCheckPreconditions() const {
+        if (const char *p = checkPreconditionsImp())
+            return std::unexpected{p};
 
-    BinaryCommand::BinaryCommand(const BinaryCommand &rhs) :
-            Command(rhs), _top(rhs._top), _next(rhs._next) {}
+        return {};
+    }
 
-    void BinaryCommand::checkPreconditionsImp() const {
-        if (Stack::Instance().Size() < 2)
-            throw Exception{"Stack must have least two elements"};
+    void Command::checkPreconditions() const {
+        if (const char *p = checkPreconditionsImp())
+            throw Exception{p};
     }
 
-    void BinaryCommand::executeImp() noexcept {
-        _top = Stack::Instance().Pop(true);
-        _next = Stack::Instance().Pop(true);
-        Stack::Instance().Push(binaryOperation(_next, _top));
+    const char *Command::helpMessage() const {
+        return helpMessageImp();
     }
 
-    void BinaryCommand::undoImp() noexcept {
-        Stack::Instance().Pop(true);
-        Stack::Instance().Push(_next, true);
-        Stack::Instance().Push(_top);
+    Command *Command::sharedInstance() const {
+        return sharedInstanceImp();
     }
 
-    UnaryCommand::UnaryCommand(const UnaryCommand &rhs) :
-            Command(rhs), _top(rhs._top) {}
+    Command *Command::sharedInstanceImp() const noexcept {
+        return nullptr;
+    }
 
-    void UnaryCommand::checkPreconditionsImp() const {
-        if (Stack::Instance().Size() < 1)
-            throw Exception{"Stack must have at least one element"};
+    Command *Command::clone() const {
+        return cloneImp();
     }
 
-    void UnaryCommand::executeImp() noexcept {
-        _top = Stack::Instance().Pop(true);
-        Stack::Instance().Push(unaryOperation(_top));
+    void Command::deallocate() {
+        delete this;
     }
 
-    void UnaryCommand::undoImp() noexcept {
-        Stack::Instance().Pop(true);
-        Stack::Instance().Push(_top);
+    const char *Command::checkPreconditionsImp() const noexcept {
+        return nullptr;
     }
 
-    void PluginCommand::checkPreconditionsImp() const {
-        if (const char *p = checkPluginPreconditions())
-            throw Exception{p};
+    const char *PluginCommand::checkPreconditionsImp() const noexcept {
+        return checkPluginPreconditions();
     }
 
     PluginCommand *PluginCommand::cloneImp() const {
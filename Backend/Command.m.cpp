@@ -3,27 +3,53 @@ module;
 #include <memory>
 #include <functional>
 #include <concepts>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <expected>
+#include "../Utilities/Exception.h"
 
 export module CalcBackend_Command;
 
+import CalcBackend_Stack;
+
 using std::string_view;
 using std::string;
 using std::unique_ptr;
 
 export namespace Calculator {
 
+    // Outcome of checking and executing a command. Precondition failures are
+    // common on bad input, so they are returned rather than thrown; the error
+    // is a static message that needs no allocation.
+    using CommandResult = std::expected<void, const char *>;
+
     class Command {
     public:
         Command *clone() const;
 
         virtual ~Command() = default;
 
+        // Executes the command if its preconditions hold.
+        CommandResult tryExecute();
+
+        // As tryExecute, but throws the failed precondition's message.
         void execute();
 
         void undo();
 
+        CommandResult tryCheckPreconditions() const;
+
+        void checkPreconditions() const;
+
         const char *helpMessage() const;
 
+        // A process-wide instance that can stand in for this command in the
+        // undo history, or nullptr. Commands whose undo is the exact inverse
+        // of their execution and that keep no state provide one, so the
+        // history holds a pointer to it instead of the executed copy.
+        Command *sharedInstance() const;
+
         virtual void deallocate();
 
     protected:
@@ -32,7 +58,13 @@ export namespace Calculator {
         Command(const Command &);
 
     private:
-        virtual void checkPreconditionsImp() const;
+        // Checks the preconditions, then executes. Commands whose
+        // preconditions can only be checked while they execute, such as a
+        // sequence of other commands, override it instead.
+        virtual CommandResult tryExecuteImp();
+
+        // Returns nullptr or a static error message.
+        virtual const char *checkPreconditionsImp() const noexcept;
 
         virtual Command *cloneImp() const = 0;
 
@@ -42,6 +74,8 @@ export namespace Calculator {
 
         virtual const char *helpMessageImp() const noexcept = 0;
 
+        virtual Command *sharedInstanceImp() const noexcept;
+
         Command(Command &&) = delete;
 
         Command &operator=(Command &) = delete;
@@ -49,12 +83,20 @@ export namespace Calculator {
         Command &operator=(Command &&) = delete;
     };
 
+    // Pops two numbers of type T and pushes binaryOperation(next, top). The
+    // default instantiation is the plain double fast path; the extended
+    // precision modes instantiate the same commands for their own number type.
+    template<typename T = double>
     class BinaryCommand : public Command {
     public:
         virtual ~BinaryCommand() = default;
 
     protected:
-        void checkPreconditionsImp() const override;
+        const char *checkPreconditionsImp() const noexcept override;
+
+        // Domain check on the operands, read once from the stack by
+        // checkPreconditionsImp. Returns nullptr or a static error message.
+        virtual const char *checkOperands(const T &next, const T &top) const noexcept;
 
         BinaryCommand() = default;
 
@@ -71,18 +113,21 @@ export namespace Calculator {
 
         void undoImp() noexcept final override;
 
-        virtual double binaryOperation(double next, double top) const noexcept = 0;
+        virtual T binaryOperation(T next, T top) const noexcept = 0;
 
-        double _next;
-        double _top;
+        T _next;
+        T _top;
     };
 
+    template<typename T = double>
     class UnaryCommand : public Command {
     public:
         virtual ~UnaryCommand() = default;
 
     protected:
-        void checkPreconditionsImp() const override;
+        const char *checkPreconditionsImp() const noexcept override;
+
+        virtual const char *checkOperand(const T &) const noexcept { return nullptr; }
 
         UnaryCommand() = default;
 
@@ -99,9 +144,9 @@ export namespace Calculator {
 
         void undoImp() noexcept final override;
 
-        virtual double unaryOperation(double top) const noexcept = 0;
+        virtual T unaryOperation(T top) const noexcept = 0;
 
-        double _top;
+        T _top;
     };
 
     class PluginCommand : public Command {
@@ -113,13 +158,28 @@ export namespace Calculator {
 
         virtual PluginCommand *clonePluginImp() const noexcept = 0;
 
-        void checkPreconditionsImp() const override final;
+        const char *checkPreconditionsImp() const noexcept override final;
 
         PluginCommand *cloneImp() const override final;
     };
 
+    // Optional bulk entry point a plugin can export for one of its commands. It
+    // is applied in place to a contiguous span of stack values instead of
+    // executing the command once per value. check may be null; like
+    // checkPluginPreconditions it returns nullptr or a static error message.
+    extern "C" {
+        typedef const char *(*PluginBatchCheck)(const double *values, size_t n);
+        typedef void (*PluginBatchApply)(double *values, size_t n);
+
+        struct PluginBatchKernel {
+            PluginBatchCheck check;
+            PluginBatchApply apply;
+        };
+    }
+
+    template<typename T = double>
     class BinaryCommandAlternative final : public Command {
-        using BinaryCommandOp = double(double, double);
+        using BinaryCommandOp = T(T, T);
 
     public:
         BinaryCommandAlternative(string_view help, std::function<BinaryCommandOp> f);
@@ -133,7 +193,7 @@ export namespace Calculator {
 
         BinaryCommandAlternative &operator=(BinaryCommandAlternative &&) = delete;
 
-        void checkPreconditionsImp() const override;
+        const char *checkPreconditionsImp() const noexcept override;
 
         const char *helpMessageImp() const noexcept override;
 
@@ -145,8 +205,8 @@ export namespace Calculator {
 
         BinaryCommandAlternative(const BinaryCommandAlternative &);
 
-        double _top;
-        double _next;
+        T _top;
+        T _next;
         string _helpMessage;
         std::function<BinaryCommandOp> _command;
     };
@@ -156,6 +216,10 @@ export namespace Calculator {
             ptr->deallocate();
     }
 
+    // Deleter for pointers to a command's shared instance, which lives for
+    // the whole process.
+    inline void SharedCommandDeleter(Command *) {}
+
     using CommandPtr = unique_ptr<Command, decltype(&CommandDeleter)>;
 
     template<typename T, typename... Args>
@@ -167,4 +231,127 @@ export namespace Calculator {
         return CommandPtr{ptr, &CommandDeleter};
     }
 
+    template<typename T>
+    BinaryCommand<T>::BinaryCommand(const BinaryCommand &rhs) :
+            Command(rhs), _next(rhs._next), _top(rhs._top) {}
+
+    // Number types whose values can fail to combine (e.g. vectors of different
+    // lengths) provide CheckOperands, found by argument-dependent lookup.
+    template<typename T>
+    const char *CheckBinaryOperands(const T &next, const T &top) noexcept {
+        if constexpr (requires { CheckOperands(next, top); })
+            return CheckOperands(next, top);
+        else
+            return nullptr;
+    }
+
+    template<typename T>
+    const char *BinaryCommand<T>::checkPreconditionsImp() const noexcept {
+        auto &stack = BasicStack<T>::Instance();
+
+        if (stack.Size() < 2)
+            return "Stack must have least two elements";
+
+        return checkOperands(stack.Peek(1), stack.Peek(0));
+    }
+
+    template<typename T>
+    const char *BinaryCommand<T>::checkOperands(const T &next, const T &top) const noexcept {
+        return CheckBinaryOperands(next, top);
+    }
+
+    template<typename T>
+    void BinaryCommand<T>::executeImp() noexcept {
+        auto &stack = BasicStack<T>::Instance();
+
+        _top = stack.Pop(true);
+        _next = stack.Pop(true);
+        stack.Push(binaryOperation(_next, _top));
+    }
+
+    template<typename T>
+    void BinaryCommand<T>::undoImp() noexcept {
+        auto &stack = BasicStack<T>::Instance();
+
+        stack.Pop(true);
+        stack.Push(_next, true);
+        stack.Push(_top);
+    }
+
+    template<typename T>
+    UnaryCommand<T>::UnaryCommand(const UnaryCommand &rhs) :
+            Command(rhs), _top(rhs._top) {}
+
+    template<typename T>
+    const char *UnaryCommand<T>::checkPreconditionsImp() const noexcept {
+        auto &stack = BasicStack<T>::Instance();
+
+        if (stack.Size() < 1)
+            return "Stack must have at least one element";
+
+        return checkOperand(stack.Peek());
+    }
+
+    template<typename T>
+    void UnaryCommand<T>::executeImp() noexcept {
+        auto &stack = BasicStack<T>::Instance();
+
+        _top = stack.Pop(true);
+        stack.Push(unaryOperation(_top));
+    }
+
+    template<typename T>
+    void UnaryCommand<T>::undoImp() noexcept {
+        auto &stack = BasicStack<T>::Instance();
+
+        stack.Pop(true);
+        stack.Push(_top);
+    }
+
+    template<typename T>
+    BinaryCommandAlternative<T>::BinaryCommandAlternative(string_view help, std::function<BinaryCommandOp> f)
+            : Command{}, _top{}, _next{}, _helpMessage{help}, _command{std::move(f)} {}
+
+    template<typename T>
+    BinaryCommandAlternative<T>::BinaryCommandAlternative(const BinaryCommandAlternative &rhs)
+            : Command{rhs}, _top{rhs._top}, _next{rhs._next}, _helpMessage{rhs._helpMessage},
+              _command{rhs._command} {}
+
+    template<typename T>
+    const char *BinaryCommandAlternative<T>::checkPreconditionsImp() const noexcept {
+        auto &stack = BasicStack<T>::Instance();
+
+        if (stack.Size() < 2)
+            return "Stack must have least two elements";
+
+        return CheckBinaryOperands(stack.Peek(1), stack.Peek(0));
+    }
+
+    template<typename T>
+    const char *BinaryCommandAlternative<T>::helpMessageImp() const noexcept {
+        return _helpMessage.c_str();
+    }
+
+    template<typename T>
+    void BinaryCommandAlternative<T>::executeImp() noexcept {
+        auto &stack = BasicStack<T>::Instance();
+
+        _top = stack.Pop(true);
+        _next = stack.Pop(true);
+        stack.Push(_command(_next, _top));
+    }
+
+    template<typename T>
+    void BinaryCommandAlternative<T>::undoImp() noexcept {
+        auto &stack = BasicStack<T>::Instance();
+
+        stack.Pop(true);
+        stack.Push(_next, true);
+        stack.Push(_top);
+    }
+
+    template<typename T>
+    BinaryCommandAlternative<T> *BinaryCommandAlternative<T>::cloneImp() const {
+        return new BinaryCommandAlternative{*this};
+    }
 }
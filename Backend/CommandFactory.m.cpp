@@ -3,33 +3,62 @@ module;
 #include <memory>
 #include <string>
 #include <set>
+#include <map>
+#include <string_view>
 #include "../Utilities/Exception.h"
 #include <format>
 #include <unordered_map>
 #include <algorithm>
 #include <ranges>
+#include <iterator>
+#include <functional>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <optional>
+#include <type_traits>
+#include <concepts>
+#include <span>
+#include <thread>
 
 export module CalcBackend_CommandFactory;
 
 import CalcUtilities;
 import CalcBackend_Command;
 import CalcBackend_CoreCommands;
+import CalcBackend_Numeric;
+import CalcBackend_MathKernels;
 
 using std::string;
+using std::string_view;
 using std::unordered_map;
 using std::set;
+using std::vector;
+using std::shared_ptr;
 
 namespace Calculator {
 
+    // One factory per NumberMode: the commands registered in each operate on
+    // that mode's stack. Plugins register with the double factory only.
+    //
+    // Only the owner thread, by default the one that first asked for the
+    // factory, changes it: staged commands and lazily resolved plugins are
+    // only applied there. Other threads, such as BatchEvaluator workers, may
+    // allocate commands while the owner is not changing the factory.
     export class CommandFactory {
     public:
-        static CommandFactory &Instance();
+        static CommandFactory &Instance(NumberMode mode = NumberMode::Double);
+
+        // Makes the calling thread the owner.
+        void SetOwnerThread() { _owner = std::this_thread::get_id(); }
+
+        bool IsOwnerThread() const { return std::this_thread::get_id() == _owner; }
 
         void RegisterCommand(const string &name, CommandPtr ptr);
 
         CommandPtr DeregisterCommand(const string &name);
 
-        size_t GetNumberCommand() const { _factory.size(); }
+        size_t GetNumberCommand() const { return _factory.size(); }
 
         CommandPtr AllocateCommand(const string &name) const;
 
@@ -39,7 +68,54 @@ namespace Calculator {
 
         string HelpMessage(const string &command) const;
 
-        void ClearAllCommands() { _factory.clear(); }
+        // "name: help" for every command, sorted by name. Rendered on first
+        // use after the registered commands change.
+        const string &HelpText() const;
+
+        // Names of the registered commands that start with prefix, sorted, at
+        // most limit of them.
+        vector<string> CommandsWithPrefix(string_view prefix, size_t limit = 64) const;
+
+        // Registered names within a small edit distance of name, nearest
+        // first, for suggestions when name is mistyped.
+        vector<string> SimilarCommands(string_view name, size_t limit = 3) const;
+
+        void ClearAllCommands();
+
+        // Consulted by AllocateCommand, on the owner thread, for names that
+        // are not registered yet. It returns true after registering the
+        // command, which lets plugins be loaded on first use instead of at
+        // startup.
+        using CommandResolver = std::function<bool(const string &)>;
+
+        void SetCommandResolver(CommandResolver resolver) { _resolver = std::move(resolver); }
+
+        // Bulk implementation of a registered command; dropped again when the
+        // command is deregistered. image keeps the code behind kernel mapped.
+        struct BatchKernel {
+            PluginBatchKernel kernel;
+            shared_ptr<const void> image;
+        };
+
+        void RegisterBatchKernel(const string &name, BatchKernel kernel);
+
+        const BatchKernel *FindBatchKernel(const string &name) const;
+
+        // Replacement prototypes prepared on another thread, e.g. by a plugin
+        // hot reload. A null command only deregisters the name. StageCommands
+        // may be called from any thread; the staged batch is swapped in as a
+        // whole by ApplyStagedCommands, which the interpreter calls between
+        // commands, so evaluation never waits on a reload. It does nothing
+        // outside the owner thread.
+        struct StagedCommand {
+            string name;
+            CommandPtr command;
+            std::optional<BatchKernel> kernel;
+        };
+
+        void StageCommands(vector<StagedCommand> commands);
+
+        void ApplyStagedCommands();
 
     private:
         CommandFactory() = default;
@@ -56,13 +132,56 @@ namespace Calculator {
 
         using Factory = unordered_map<string, CommandPtr>;
         Factory _factory;
+        // Every registered prototype by name, kept sorted for help and
+        // completion as commands come and go.
+        std::map<string, const Command *, std::less<>> _index;
+        Trie _names;
+        mutable string _helpText;
+        mutable bool _helpTextValid{false};
+        unordered_map<string, BatchKernel> _kernels;
+        CommandResolver _resolver;
+        std::thread::id _owner{std::this_thread::get_id()};
+
+        std::mutex _stagedMutex;
+        vector<StagedCommand> _staged;
+        std::atomic<bool> _hasStaged{false};
     };
 
     std::set<string> CommandFactory::GetAllCommandsNames() const {
-        set<string> temp;
+        auto names = _index | std::views::keys;
+        return {names.begin(), names.end()};
+    }
 
-        std::ranges::for_each(_factory | std::views::keys, [&temp](const auto &k) { temp.insert(k); });
-        return temp;
+    const string &CommandFactory::HelpText() const {
+        if (!_helpTextValid) {
+            _helpText.clear();
+
+            for (const auto &[name, command]: _index) {
+                _helpText += name;
+                _helpText += ": ";
+                _helpText += command->helpMessage();
+                _helpText += '\n';
+            }
+            _helpTextValid = true;
+        }
+        return _helpText;
+    }
+
+    vector<string> CommandFactory::CommandsWithPrefix(string_view prefix, size_t limit) const {
+        return _names.WithPrefix(prefix, limit);
+    }
+
+    // Short names allow one edit, so that e.g. "Sun" does not suggest "Sin"
+    // and "Dup" alike.
+    vector<string> CommandFactory::SimilarCommands(string_view name, size_t limit) const {
+        return _names.Similar(name, name.size() > 4 ? 2 : 1, limit);
+    }
+
+    void CommandFactory::ClearAllCommands() {
+        _factory.clear();
+        _index.clear();
+        _names.Clear();
+        _helpTextValid = false;
     }
 
     string CommandFactory::HelpMessage(const std::string &command) const {
@@ -80,61 +199,153 @@ namespace Calculator {
     void CommandFactory::RegisterCommand(const std::string &name, Calculator::CommandPtr ptr) {
         if (HasKey(name)) {
             auto t = std::format("Command {} already registered", name);
-            throw Exception{"t"};
+            throw Exception{t};
         }
+
+        _index.emplace(name, ptr.get());
+        _names.Insert(name);
+        _factory.emplace(name, std::move(ptr));
+        _helpTextValid = false;
     }
 
     CommandPtr CommandFactory::DeregisterCommand(const std::string& name) {
+        _kernels.erase(name);
+
         if (HasKey(name))
         {
             auto i = _factory.find(name);
             auto temp = MakeCommandPtr(i->second.release());
             _factory.erase(i);
+            _index.erase(name);
+            _names.Erase(name);
+            _helpTextValid = false;
             return temp;
         } else
             return MakeCommandPtr(nullptr);
     }
 
     CommandPtr CommandFactory::AllocateCommand(const std::string& name) const {
-        if (HasKey(name))
-        {
-            const auto& command = _factory.find(name)->second;
-            return MakeCommandPtr(command->clone());
-        } else
+        Probe probe{ProbeSite::Allocate};
+        auto it = _factory.find(name);
+
+        if (it == _factory.end() && _resolver && IsOwnerThread() && _resolver(name))
+            it = _factory.find(name);
+
+        if (it != _factory.end())
+            return MakeCommandPtr(it->second->clone());
+        else
             return MakeCommandPtr(nullptr);
     }
 
-    CommandFactory& CommandFactory::Instance() {
-        static CommandFactory instance;
-        return instance;
+    void CommandFactory::RegisterBatchKernel(const string &name, BatchKernel kernel) {
+        if (!HasKey(name)) {
+            auto t = std::format("Cannot register a batch kernel for unknown command {}", name);
+            throw Exception{t};
+        }
+
+        _kernels.insert_or_assign(name, std::move(kernel));
     }
 
-    export void RegisterCoreCommands(/*UserInterface& ui*/) {
-        auto& cr = CommandFactory::Instance();
+    const CommandFactory::BatchKernel *CommandFactory::FindBatchKernel(const string &name) const {
+        if (!HasKey(name) && _resolver && IsOwnerThread())
+            _resolver(name);
+
+        auto it = _kernels.find(name);
+        return it != _kernels.end() ? &it->second : nullptr;
+    }
+
+    void CommandFactory::StageCommands(vector<StagedCommand> commands) {
+        std::lock_guard lock{_stagedMutex};
+
+        std::ranges::move(commands, std::back_inserter(_staged));
+        _hasStaged.store(true, std::memory_order_release);
+    }
+
+    void CommandFactory::ApplyStagedCommands() {
+        if (!_hasStaged.load(std::memory_order_acquire) || !IsOwnerThread())
+            return;
+
+        vector<StagedCommand> staged;
+        {
+            std::lock_guard lock{_stagedMutex};
+            staged.swap(_staged);
+            _hasStaged.store(false, std::memory_order_relaxed);
+        }
 
+        for (auto &i: staged) {
+            DeregisterCommand(i.name);
+
+            if (!i.command)
+                continue;
+
+            RegisterCommand(i.name, std::move(i.command));
+
+            if (i.kernel)
+                RegisterBatchKernel(i.name, std::move(*i.kernel));
+        }
+    }
+
+    CommandFactory& CommandFactory::Instance(NumberMode mode) {
+        static CommandFactory instances[NumberModeCount];
+        return instances[static_cast<size_t>(mode)];
+    }
+
+    template<typename T>
+    void RegisterCoreCommands(CommandFactory &cr) {
         try {
-            cr.RegisterCommand("Swap", MakeCommandPtr<SwapTopOfStack>());
-            cr.RegisterCommand("Drop", MakeCommandPtr<DropTopOfStack>());
-            cr.RegisterCommand("Clear", MakeCommandPtr<ClearStack>());
-            cr.RegisterCommand("+", MakeCommandPtr<Add>());
-            cr.RegisterCommand("-", MakeCommandPtr<Subtract>());
-            cr.RegisterCommand("/", MakeCommandPtr<Divide>());
-            cr.RegisterCommand("Pow", MakeCommandPtr<Power>());
-            cr.RegisterCommand("Root", MakeCommandPtr<Root>());
-            cr.RegisterCommand("Sin", MakeCommandPtr<Sine>());
-            cr.RegisterCommand("Cos", MakeCommandPtr<Cosine>());
-            cr.RegisterCommand("Tan", MakeCommandPtr<Tangent>());
-            cr.RegisterCommand("ArcSin", MakeCommandPtr<Arcsine>());
-            cr.RegisterCommand("ArcCos", MakeCommandPtr<Arccosine>());
-            cr.RegisterCommand("ArcTan", MakeCommandPtr<Arctangent>());
-            cr.RegisterCommand("Neg", MakeCommandPtr<Negate>());
-            cr.RegisterCommand("Dup", MakeCommandPtr<Duplicate>());
-            cr.RegisterCommand("*", MakeCommandPtr<BinaryCommandAlternative>(
+            cr.RegisterCommand("Swap", MakeCommandPtr<SwapTopOfStack<T>>());
+            cr.RegisterCommand("Drop", MakeCommandPtr<DropTopOfStack<T>>());
+            cr.RegisterCommand("Clear", MakeCommandPtr<ClearStack<T>>());
+            cr.RegisterCommand("+", MakeCommandPtr<Add<T>>());
+            cr.RegisterCommand("-", MakeCommandPtr<Subtract<T>>());
+            cr.RegisterCommand("/", MakeCommandPtr<Divide<T>>());
+            cr.RegisterCommand("Pow", MakeCommandPtr<Power<T>>());
+            cr.RegisterCommand("Root", MakeCommandPtr<Root<T>>());
+            cr.RegisterCommand("Sin", MakeCommandPtr<Sine<T>>());
+            cr.RegisterCommand("Cos", MakeCommandPtr<Cosine<T>>());
+            cr.RegisterCommand("Tan", MakeCommandPtr<Tangent<T>>());
+            cr.RegisterCommand("ArcSin", MakeCommandPtr<Arcsine<T>>());
+            cr.RegisterCommand("ArcCos", MakeCommandPtr<Arccosine<T>>());
+            cr.RegisterCommand("ArcTan", MakeCommandPtr<Arctangent<T>>());
+            cr.RegisterCommand("Neg", MakeCommandPtr<Negate<T>>());
+            cr.RegisterCommand("Dup", MakeCommandPtr<Duplicate<T>>());
+            cr.RegisterCommand("Sum", MakeCommandPtr<Reduce<T, Reduction::Sum>>());
+            cr.RegisterCommand("Product", MakeCommandPtr<Reduce<T, Reduction::Product>>());
+            cr.RegisterCommand("Mean", MakeCommandPtr<Reduce<T, Reduction::Mean>>());
+            cr.RegisterCommand("*", MakeCommandPtr<BinaryCommandAlternative<T>>(
                     "Replace first two elements on the stack with their product",
-                    [](double x, double y) -> double { return x * y; }));
+                    [](T x, T y) -> T { return x * y; }));
+
+            // The double stack's math kernels double as batch kernels for map:.
+            if constexpr (std::same_as<T, double>) {
+                auto kernel = [&cr](const string &name, PluginBatchApply apply, PluginBatchCheck check = nullptr) {
+                    cr.RegisterBatchKernel(name, {PluginBatchKernel{check, apply}, nullptr});
+                };
+
+                kernel("Sin", [](double *v, size_t n) { Sin(std::span{v, n}); });
+                kernel("Cos", [](double *v, size_t n) { Cos(std::span{v, n}); });
+                kernel("Tan", [](double *v, size_t n) { Tan(std::span{v, n}); },
+                       CheckDomain<Domain::NotTangentPole>);
+                kernel("ArcSin", [](double *v, size_t n) { Asin(std::span{v, n}); },
+                       CheckDomain<Domain::UnitInterval>);
+                kernel("ArcCos", [](double *v, size_t n) { Acos(std::span{v, n}); },
+                       CheckDomain<Domain::UnitInterval>);
+                kernel("ArcTan", [](double *v, size_t n) { Atan(std::span{v, n}); });
+            }
 
         } catch (Exception& exep) {
             // ui.PostMessage(e.What());
         }
     }
+
+    // Registers the core commands with the factory of every NumberMode.
+    export void RegisterCoreCommands(/*UserInterface& ui*/) {
+        for (auto i = 0u; i < NumberModeCount; ++i) {
+            auto mode = static_cast<NumberMode>(i);
+
+            VisitNumberMode(mode, [mode]<typename T>(std::type_identity<T>) {
+                RegisterCoreCommands<T>(CommandFactory::Instance(mode));
+            });
+        }
+    }
 }
\ No newline at end of file
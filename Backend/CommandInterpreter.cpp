@@ -8,6 +8,14 @@ module;
 #include <string_view>
 #include <string>
 #include <set>
+#include <type_traits>
+#include <vector>
+#include <utility>
+#include <any>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <map>
 
 module CommandInterpreter;
 
@@ -17,103 +25,805 @@ import CalcBackend_CommandFactory;
 import CalcUtilities;
 import UserInterface;
 import CalcBackend_CoreCommands;
+import CalcBackend_StoredProcedure;
+import CalcBackend_Numeric;
+import CalcBackend_Value;
+import CalcBackend_MathKernels;
+import CalcBackend_Journal;
+import CalcBackend_Stack;
+import CalcBackend_Snapshot;
 
 using std::string;
 using std::unique_ptr;
 using std::pmr::set;
 using std::string_view;
+using std::vector;
+using std::shared_ptr;
+using std::unordered_map;
 
 
 namespace Calculator {
 
     class CommandInterpreter::CommandInterpreterImpl {
     public:
-        explicit CommandInterpreterImpl(UserInterface& ui);
+        CommandInterpreterImpl(UserInterface& ui, NumberMode mode);
 
         void executeCommand(const string &command);
 
+        void takeFed();
+
+        void attachJournal(Journal &journal);
+
+        void saveSnapshot(const string &path) const;
+
+        void loadSnapshot(const string &path, bool withHistory);
+
+        void forkSession(const string &name);
+
+        void switchSession(const string &name);
+
     private:
-        bool isNum(const string &, double &d);
+        bool isNum(const string &) const;
+
+        string_view probeLabel(const string &command) const;
+
+        CommandPtr enterNumber(const string &) const;
+
+        CommandPtr loadProcedure(const string &filename) const;
+
+        CommandPtr allocateCommand(const string &name) const;
+
+        CommandPtr makeCommand(const string &entered) const;
+
+        bool handleCommand(CommandPtr command, const string &entered, bool fed = false);
+
+        void addToHistory(const string &command);
+
+        void undo();
 
-        void handleCommand(CommandPtr command);
+        void redo();
+
+        void startRecording(const string &name);
+
+        void stopRecording();
 
         void printHelp() const;
 
+        void complete(string_view prefix) const;
+
+        string unknownCommand(const string &command) const;
+
+        void record(Journal::RecordKind kind, const string &command = {});
+
+        void checkpoint();
+
+        void restoreState(const vector<vector<string>> &entries);
+
+        // Commands journaled between two checkpoints, which bounds the work
+        // replayed on recovery.
+        static constexpr size_t CheckpointInterval = 4096;
+
         CommandManager _manager;
         UserInterface& _ui;
+        NumberMode _mode;
+        CommandFactory& _factory;
+        Journal *_journal;
+        size_t _sinceCheckpoint;
+        // Undo and redo depth when the last checkpoint was written. Replay
+        // starts from the checkpoint with an empty history, so undoing or
+        // redoing past these is journaled as a new checkpoint instead.
+        size_t _checkpointUndo;
+        size_t _checkpointRedo;
+        // Mirror of the command manager's history for snapshots: the commands
+        // as entered, split into undo and redo entries (most recent first),
+        // and the stack the first one was entered on.
+        PersistentStack<string> _entered;
+        PersistentStack<string> _undone;
+        shared_ptr<const vector<char>> _base;
+
+        // A branch of the session. Every part is persistent or copy-on-write,
+        // so forking and switching are O(1) whatever the size of the stack
+        // and history.
+        struct Session {
+            std::any stack;     // BasicStack<T>::Contents of the session's mode
+            CommandManager::History history;
+            PersistentStack<string> entered;
+            PersistentStack<string> undone;
+            shared_ptr<const vector<char>> base;
+        };
+
+        unordered_map<string, Session> _sessions;
+
+        // Commands executed since record:<name>, cloned before they executed
+        // so each is a prototype for the macro, and those undone since, which
+        // a redo takes back. Undo and redo stay within the recording.
+        struct Step {
+            CommandPtr prototype;
+            string entered;
+        };
+
+        struct Recording {
+            string name;
+            vector<Step> steps;
+            vector<Step> undone;
+        };
+
+        std::optional<Recording> _recording;
+
+        void defineMacro(const string &name, vector<Step> steps);
+
+        // Macros recorded by this interpreter, by name, with the commands
+        // they were recorded from as entered. Other interpreters of the same
+        // mode share the command factory, so macros stay out of it.
+        struct MacroDefinition {
+            CommandPtr macro;
+            vector<string> entered;
+        };
+
+        std::map<string, MacroDefinition> _macros;
     };
 
+    namespace {
+        // Words that are never looked up in the command factory.
+        constexpr string_view Keywords[] = {
+                "accuracy:", "complete:", "fork:", "help", "load:", "map:", "play:", "proc:",
+                "record:", "redo", "save:", "stats", "stop", "switch:", "sync", "undo"
+        };
 
-    CommandInterpreter::CommandInterpreterImpl::CommandInterpreterImpl(UserInterface &ui)
-            : _ui(ui) {
+        // Levels of accuracy:<level>.
+        constexpr std::pair<string_view, MathAccuracy> AccuracyLevels[] = {
+                {"fast", MathAccuracy::Fast}, {"balanced", MathAccuracy::Balanced}, {"precise", MathAccuracy::Precise}
+        };
+    }
+
+
+    CommandInterpreter::CommandInterpreterImpl::CommandInterpreterImpl(UserInterface &ui, NumberMode mode)
+            : _manager(CommandManager::UndoRedoStrategy::PersistentStrategy), _ui(ui), _mode(mode), _factory(CommandFactory::Instance(mode)), _journal(nullptr),
+              _sinceCheckpoint(0), _checkpointUndo(0), _checkpointRedo(0),
+              _base(std::make_shared<const vector<char>>(EncodeStack(mode))) {
     }
 
     void CommandInterpreter::CommandInterpreterImpl::executeCommand(const string &command) {
         string_view sv{command};
+        ProbeLabel label{probeLabel(command)};
+
+        // Safe point: no command is executing, so reloaded plugins can be swapped in.
+        _factory.ApplyStagedCommands();
 
-        if (double d; isNum(command, d))
-            _manager.ExecuteCommand(MakeCommandPtr<EnterNumber>(d));
-        else if (command == "undo")
-            _manager.Undo();
+        bool executed{false};
+
+        if (command == "undo")
+            undo();
         else if (command == "redo")
-            _manager.Redo();
+            redo();
         else if (command == "help")
             printHelp();
-        else if (command.size() > 6 && sv.starts_with("proc:")) {
-            string filename{sv.substr(5, command.size() - 5)};
-            handleCommand(MakeCommandPtr<StoredProcedure>(ui_, filename));
+        else if (command == "stats")
+            _ui.PostMessage(InstrumentationReport());
+        else if (command == "sync")
+            ;   // values pushed by other threads were taken in on entry
+        else if (sv.starts_with("complete:"))
+            complete(sv.substr(9));
+        else if (command.size() > 7 && sv.starts_with("record:"))
+            startRecording(string{sv.substr(7)});
+        else if (command == "stop")
+            stopRecording();
+        else if (command.size() > 5 && sv.starts_with("save:")) {
+            try {
+                saveSnapshot(string{sv.substr(5)});
+            }
+            catch (Exception &e) {
+                _ui.PostMessage(e.What());
+            }
+        } else if (command.size() > 5 && sv.starts_with("fork:"))
+            forkSession(string{sv.substr(5)});
+        else if (command.size() > 7 && sv.starts_with("switch:"))
+            switchSession(string{sv.substr(7)});
+        else if (command.size() > 5 && sv.starts_with("load:")) {
+            try {
+                loadSnapshot(string{sv.substr(5)}, true);
+            }
+            catch (Exception &e) {
+                _ui.PostMessage(e.What());
+            }
+        } else if (sv.starts_with("accuracy:")) {
+            auto level = sv.substr(9);
+            auto it = std::ranges::find(AccuracyLevels, level, [](const auto &l) { return l.first; });
+
+            if (it != std::end(AccuracyLevels)) {
+                SetMathAccuracy(it->second);
+
+                // Results depend on it, so replay must see it too.
+                record(Journal::RecordKind::Command, command);
+            } else
+                _ui.PostMessage(std::format("Unknown accuracy {}", level));
         } else {
-            if (auto c = CommandFactory::Instance().AllocateCommand(command))
-                handleCommand(std::move(c));
-            else {
-                auto t = std::format("Command {} is not a known command", command);
-                _ui.PostMessage(t);
+            try {
+                executed = handleCommand(makeCommand(command), command);
             }
+            catch (Exception &e) {
+                _ui.PostMessage(e.What());
+            }
+        }
+
+        if (executed)
+            addToHistory(command);
+    }
+
+    void CommandInterpreter::CommandInterpreterImpl::addToHistory(const string &command) {
+        _entered.Push(command);
+        _undone.Clear();
+
+        record(Journal::RecordKind::Command, command);
+    }
+
+    // Values other threads pushed since the last command enter the history
+    // as if they had been typed, so undo, the journal and snapshots account
+    // for them. Not called while replaying, which must not interleave them.
+    void CommandInterpreter::CommandInterpreterImpl::takeFed() {
+        VisitNumberMode(_mode, [this]<typename T>(std::type_identity<T>) {
+            auto feed = BasicStack<T>::Instance().FeedIfAny();
+
+            if (!feed || !feed->Ready())
+                return;
+
+            feed->Drain([this](const T &v) {
+                auto text = NumberTraits<T>::ToString(v);
+
+                if (handleCommand(MakeCommandPtr<EnterNumber<T>>(v), text, true))
+                    addToHistory(text);
+            });
+        });
+    }
+
+    // Values fed while recording keep their place among the steps, so undo
+    // stays in step with the history, but have no prototype: the macro
+    // leaves them out.
+    bool CommandInterpreter::CommandInterpreterImpl::handleCommand(CommandPtr c, const string &entered, bool fed) {
+        auto prototype = MakeCommandPtr(_recording && !fed ? c->clone() : nullptr);
+        auto r = _manager.TryExecuteCommand(std::move(c));
+
+        if (!r)
+            _ui.PostMessage(r.error());
+        else if (_recording) {
+            _recording->steps.push_back({std::move(prototype), entered});
+            _recording->undone.clear();
+        }
+
+        return r.has_value();
+    }
+
+    // Journaled like a command, so replay records the same macro again.
+    void CommandInterpreter::CommandInterpreterImpl::startRecording(const string &name) {
+        if (_recording) {
+            _ui.PostMessage(std::format("Already recording {}", _recording->name));
+            return;
+        }
+
+        if (_factory.HasKey(name) || _macros.contains(name) || isNum(name)
+            || std::ranges::find(Keywords, name) != std::end(Keywords)) {
+            _ui.PostMessage(std::format("{} cannot be the name of a macro", name));
+            return;
+        }
+
+        _recording.emplace(Recording{name});
+        record(Journal::RecordKind::Command, "record:" + name);
+    }
+
+    // Defines the recorded commands as one command, named as given to
+    // record:<name>. Executing it replays the prototypes with no parsing or
+    // lookup, and it is undone as a single entry.
+    void CommandInterpreter::CommandInterpreterImpl::stopRecording() {
+        if (!_recording) {
+            _ui.PostMessage("Not recording");
+            return;
+        }
+
+        auto recording = std::move(*_recording);
+        _recording.reset();
+        std::erase_if(recording.steps, [](const Step &step) { return !step.prototype; });
+
+        if (recording.steps.empty())
+            _ui.PostMessage(std::format("Nothing was recorded for {}", recording.name));
+        else
+            defineMacro(recording.name, std::move(recording.steps));
+
+        // After the macro is defined, so a checkpoint taken instead has it.
+        record(Journal::RecordKind::Command, "stop");
+    }
+
+    void CommandInterpreter::CommandInterpreterImpl::defineMacro(const string &name, vector<Step> steps) {
+        string help = "Macro:";
+        vector<CommandPtr> prototypes;
+        vector<string> entered;
+
+        prototypes.reserve(steps.size());
+        entered.reserve(steps.size());
+
+        for (auto &step: steps) {
+            help += ' ';
+            help += step.entered;
+            prototypes.push_back(std::move(step.prototype));
+            entered.push_back(std::move(step.entered));
+        }
+
+        _macros.insert_or_assign(name, MacroDefinition{MakeCommandPtr<Macro>(std::move(help), std::move(prototypes)),
+                                                       std::move(entered)});
+    }
+
+    void CommandInterpreter::CommandInterpreterImpl::undo() {
+        if (_manager.GetUndoSize() == 0)
+            return;
+
+        if (_recording && _recording->steps.empty()) {
+            _ui.PostMessage("Cannot undo past the start of the recording");
+            return;
+        }
+
+        const bool replayable = _manager.GetUndoSize() > _checkpointUndo;
+        _manager.Undo();
+        _undone.Push(_entered.Top());
+        _entered.Pop();
+
+        if (_recording) {
+            _recording->undone.push_back(std::move(_recording->steps.back()));
+            _recording->steps.pop_back();
         }
+
+        if (replayable)
+            record(Journal::RecordKind::Undo);
+        else if (_journal)
+            checkpoint();
+    }
+
+    void CommandInterpreter::CommandInterpreterImpl::redo() {
+        if (_manager.GetRedoSize() == 0)
+            return;
+
+        if (_recording && _recording->undone.empty()) {
+            _ui.PostMessage("Cannot redo what was undone before the recording");
+            return;
+        }
+
+        const bool replayable = _manager.GetRedoSize() > _checkpointRedo;
+        _manager.Redo();
+        _entered.Push(_undone.Top());
+        _undone.Pop();
+
+        if (_recording) {
+            _recording->steps.push_back(std::move(_recording->undone.back()));
+            _recording->undone.pop_back();
+        }
+
+        if (replayable)
+            record(Journal::RecordKind::Redo);
+        else if (_journal)
+            checkpoint();
     }
 
-    void CommandInterpreter::CommandInterpreterImpl::handleCommand(CommandPtr c) {
+    // A checkpoint captures whatever the record would have changed, so it
+    // stands in for every CheckpointInterval-th record.
+    void CommandInterpreter::CommandInterpreterImpl::record(Journal::RecordKind kind, const string &command) {
+        if (!_journal)
+            return;
+
+        // Executing a command discards the redo history; settings keep it.
+        _checkpointRedo = std::min(_checkpointRedo, _manager.GetRedoSize());
+
+        if (++_sinceCheckpoint >= CheckpointInterval) {
+            checkpoint();
+            return;
+        }
+
         try {
-            _manager.ExecuteCommand(std::move(c));
+            _journal->Append(kind, command);
         }
         catch (Exception &e) {
             _ui.PostMessage(e.What());
         }
     }
 
+    // The stack is stored encoded, so replay resumes from the exact values.
+    // Besides it, the checkpoint lists what else the records before it set
+    // up: the accuracy, the macros and a recording in progress, each by the
+    // commands it was recorded from.
+    void CommandInterpreter::CommandInterpreterImpl::checkpoint() {
+        Journal::State state{EncodeStack(_mode)};
+        auto accuracy = std::ranges::find(AccuracyLevels, GetMathAccuracy(), [](const auto &l) { return l.second; });
+
+        state.entries.push_back({"accuracy", string{accuracy->first}});
+
+        for (const auto &[name, definition]: _macros) {
+            auto &entry = state.entries.emplace_back(vector<string>{"macro", name});
+            entry.insert(entry.end(), definition.entered.begin(), definition.entered.end());
+        }
+
+        if (_recording) {
+            auto &entry = state.entries.emplace_back(vector<string>{"recording", _recording->name});
+
+            for (const auto &step: _recording->steps) {
+                if (step.prototype)
+                    entry.push_back(step.entered);
+            }
+        }
+
+        _journal->Checkpoint(state);
+        _sinceCheckpoint = 0;
+        _checkpointUndo = _manager.GetUndoSize();
+        _checkpointRedo = _manager.GetRedoSize();
+    }
+
+    // Replays onto the stack and history of this interpreter, which are
+    // expected to be empty, without journaling again.
+    void CommandInterpreter::CommandInterpreterImpl::attachJournal(Journal &journal) {
+        const auto &recovery = journal.GetRecovery();
+
+        // Restored directly rather than as EnterNumber commands: the
+        // checkpointed values cannot be undone anyway.
+        if (!recovery.checkpoint.stack.empty())
+            DecodeStack(_mode, recovery.checkpoint.stack);
+
+        restoreState(recovery.checkpoint.entries);
+        _base = std::make_shared<const vector<char>>(EncodeStack(_mode));
+
+        for (const auto &r: recovery.records) {
+            switch (r.kind) {
+                case Journal::RecordKind::Command:
+                    executeCommand(r.text);
+                    break;
+                case Journal::RecordKind::Undo:
+                    undo();
+                    break;
+                case Journal::RecordKind::Redo:
+                    redo();
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        _journal = &journal;
+        _sinceCheckpoint = recovery.records.size();
+        _checkpointUndo = 0;
+        _checkpointRedo = 0;
+    }
+
+    // The entries of a checkpoint besides the stack. A macro or recording
+    // whose commands no longer resolve is reported and left out.
+    void CommandInterpreter::CommandInterpreterImpl::restoreState(const vector<vector<string>> &entries) {
+        for (const auto &entry: entries) {
+            if (entry.size() < 2)
+                continue;
+
+            if (entry[0] == "accuracy") {
+                auto it = std::ranges::find(AccuracyLevels, entry[1], [](const auto &l) { return l.first; });
+
+                if (it != std::end(AccuracyLevels))
+                    SetMathAccuracy(it->second);
+            } else if (entry[0] == "macro" || entry[0] == "recording") {
+                vector<Step> steps;
+
+                try {
+                    for (auto i = entry.begin() + 2; i != entry.end(); ++i)
+                        steps.push_back({makeCommand(*i), *i});
+                }
+                catch (Exception &e) {
+                    _ui.PostMessage(std::format("Cannot restore {}: {}", entry[1], e.What()));
+                    continue;
+                }
+
+                if (entry[0] == "macro")
+                    defineMacro(entry[1], std::move(steps));
+                else
+                    _recording.emplace(Recording{entry[1], std::move(steps)});
+            }
+        }
+    }
+
+    void CommandInterpreter::CommandInterpreterImpl::saveSnapshot(const string &path) const {
+        // Oldest undo entry first, then the redo entries in the order they
+        // would be redone.
+        vector<string> history(_entered.Size());
+        auto oldest = history.rbegin();
+
+        _entered.ForEach([&oldest](const string &c) { *oldest++ = c; });
+        _undone.ForEach([&history](const string &c) { history.push_back(c); });
+
+        WriteSnapshot(path, {_mode, EncodeStack(_mode), *_base, std::move(history), _entered.Size()});
+    }
+
+    void CommandInterpreter::CommandInterpreterImpl::forkSession(const string &name) {
+        auto stack = VisitNumberMode(_mode, []<typename T>(std::type_identity<T>) {
+            return std::any{BasicStack<T>::Instance().Fork()};
+        });
+
+        try {
+            _sessions.insert_or_assign(name, Session{std::move(stack), _manager.Fork(), _entered, _undone, _base});
+        }
+        catch (Exception &e) {
+            _ui.PostMessage(e.What());
+        }
+    }
+
+    // The current session is dropped unless it was forked under a name.
+    void CommandInterpreter::CommandInterpreterImpl::switchSession(const string &name) {
+        if (_recording) {
+            _ui.PostMessage("Cannot switch sessions while recording");
+            return;
+        }
+
+        auto it = _sessions.find(name);
+
+        if (it == _sessions.end()) {
+            _ui.PostMessage(std::format("No session named {}", name));
+            return;
+        }
+
+        const auto &session = it->second;
+
+        VisitNumberMode(_mode, [&session]<typename T>(std::type_identity<T>) {
+            BasicStack<T>::Instance().Restore(std::any_cast<typename BasicStack<T>::Contents>(session.stack));
+        });
+
+        _manager.Restore(session.history);
+        _entered = session.entered;
+        _undone = session.undone;
+        _base = session.base;
+
+        // Replay cannot follow a switch, so the journal continues from here.
+        if (_journal)
+            checkpoint();
+    }
+
+    // The stack alone is copied straight from the file. Restoring the history
+    // executes its commands again, starting from the snapshot's base stack,
+    // and falls back to the stack alone if they end anywhere else.
+    void CommandInterpreter::CommandInterpreterImpl::loadSnapshot(const string &path, bool withHistory) {
+        const bool empty = VisitNumberMode(_mode, []<typename T>(std::type_identity<T>) {
+            return BasicStack<T>::Instance().Size() == 0;
+        });
+
+        if (!empty || !_entered.Empty() || !_undone.Empty())
+            throw Exception{"Snapshots can only be loaded into an empty session"};
+
+        if (_recording)
+            throw Exception{"Snapshots cannot be loaded while recording"};
+
+        auto snapshot = ReadSnapshot(path);
+
+        if (snapshot.mode != _mode)
+            throw Exception{std::format("Snapshot {} was saved in another number mode", path)};
+
+        if (withHistory) {
+            auto journal = std::exchange(_journal, nullptr);
+            const auto history = _manager.Fork();
+
+            DecodeStack(_mode, snapshot.base);
+            _base = std::make_shared<const vector<char>>(std::move(snapshot.base));
+
+            for (const auto &c: snapshot.history)
+                executeCommand(c);
+
+            for (auto i = snapshot.position; i < snapshot.history.size(); ++i)
+                undo();
+
+            _journal = journal;
+
+            // Commands can change between saving and loading, e.g. when a
+            // plugin is updated, so the history only stands if it leads to
+            // the saved stack again.
+            if (EncodeStack(_mode) != snapshot.stack) {
+                _manager.Restore(history);
+                _entered.Clear();
+                _undone.Clear();
+
+                VisitNumberMode(_mode, []<typename T>(std::type_identity<T>) {
+                    BasicStack<T>::Instance().Restore({});
+                });
+
+                withHistory = false;
+                _ui.PostMessage(std::format("The history in snapshot {} does not reproduce its stack, "
+                                            "so only the stack was loaded", path));
+            }
+        }
+
+        if (!withHistory) {
+            DecodeStack(_mode, snapshot.stack);
+            _base = std::make_shared<const vector<char>>(std::move(snapshot.stack));
+        }
+
+        if (_journal)
+            checkpoint();
+    }
+
     void CommandInterpreter::CommandInterpreterImpl::printHelp() const {
         string help = "\n"
                       "undo: undo last operation\n"
-                      "redo: redo last operation\n";
+                      "redo: redo last operation\n"
+                      "accuracy:<fast|balanced|precise>: trade accuracy of the math functions for speed\n"
+                      "save:<file>: save the stack and undo history\n"
+                      "load:<file>: restore a saved session into an empty one\n"
+                      "fork:<name>: keep a copy of the current session under name\n"
+                      "switch:<name>: continue from the session kept under name\n"
+                      "proc:<file>: run the commands in file, with repeat:<n>, while and if blocks closed by end\n"
+                      "sync: take in the values other threads pushed onto the stack\n"
+                      "stats: latency percentiles of every command entered so far\n"
+                      "complete:<prefix>: list the commands starting with prefix (or end a line with Tab)\n"
+                      "record:<name>: record the commands that follow as a macro called name\n"
+                      "stop: end the recording and define the macro\n"
+                      "play:<name>: execute the command or macro called name\n";
 
-        auto allCommands = CommandFactory::Instance().GetAllCommandsNames();
-        for (const auto &i: allCommands) {
-            help += CommandFactory::Instance().HelpMessage(i) + "\n";
-        }
+        help += _factory.HelpText();
+
+        for (const auto &[name, definition]: _macros)
+            help += std::format("{}: {}\n", name, definition.macro->helpMessage());
 
         _ui.PostMessage(help);
     }
 
-    bool CommandInterpreter::CommandInterpreterImpl::isNum(const string &s, double &d) {
+    void CommandInterpreter::CommandInterpreterImpl::complete(string_view prefix) const {
+        auto names = _factory.CommandsWithPrefix(prefix);
+
+        for (auto k: Keywords) {
+            if (k.starts_with(prefix))
+                names.emplace_back(k);
+        }
+
+        for (auto it = _macros.lower_bound(string{prefix}); it != _macros.end() && it->first.starts_with(prefix); ++it)
+            names.push_back(it->first);
+
+        if (names.empty()) {
+            _ui.PostMessage(std::format("No command starts with {}", prefix));
+            return;
+        }
+
+        std::ranges::sort(names);
+
+        string line;
+
+        for (const auto &n: names) {
+            if (!line.empty())
+                line += ' ';
+
+            line += n;
+        }
+        _ui.PostMessage(line);
+    }
+
+    string CommandInterpreter::CommandInterpreterImpl::unknownCommand(const string &command) const {
+        auto t = std::format("Command {} is not a known command", command);
+        auto similar = _factory.SimilarCommands(command);
+
+        for (size_t i = 0; i < similar.size(); ++i)
+            t += std::format("{}{}", i == 0 ? "; did you mean " : " or ", similar[i]);
+
+        return t;
+    }
+
+    // Commands are reported under their name, keywords under the part before
+    // the colon; numbers and unknown names would each get a label of their
+    // own, so they share one.
+    string_view CommandInterpreter::CommandInterpreterImpl::probeLabel(const string &command) const {
+        if constexpr (!InstrumentationEnabled)
+            return {};
+
+        if (_factory.HasKey(command) || _macros.contains(command) || command == "undo" || command == "redo" || command == "help" || command == "stats" || command == "stop" || command == "sync")
+            return command;
+
+        if (auto colon = command.find(':'); colon != string::npos)
+            return string_view{command}.substr(0, colon + 1);
+
+        return "(number)";
+    }
+
+    bool CommandInterpreter::CommandInterpreterImpl::isNum(const string &s) const {
+        Probe probe{ProbeSite::IsNum};
+
         if (s == "+" || s == "-") return false;
 
+        // How non-finite values are printed, so values fed to the stack can
+        // be journaled and replayed like typed ones.
+        string_view t{s};
+
+        if (t.starts_with('+') || t.starts_with('-'))
+            t.remove_prefix(1);
+
+        if (t == "inf" || t == "nan")
+            return true;
+
+        if (_mode == NumberMode::Complex && Value::IsLiteral(s))
+            return true;
+
         std::regex dpRegex("((\\+|-)?[[:digit:]]*)(\\.(([[:digit:]]+)?))?((e|E)((\\+|-)?)[[:digit:]]+)?");
-        bool isNumber{std::regex_match(s, dpRegex)};
+        return std::regex_match(s, dpRegex);
+    }
+
+    // Numbers are parsed in the session's own type, so extended precision modes
+    // keep every digit that was typed.
+    CommandPtr CommandInterpreter::CommandInterpreterImpl::enterNumber(const string &s) const {
+        return VisitNumberMode(_mode, [&s]<typename T>(std::type_identity<T>) {
+            return MakeCommandPtr<EnterNumber<T>>(NumberTraits<T>::Parse(s));
+        });
+    }
+
+    // Names in the file are resolved now, against the commands registered
+    // at this point.
+    CommandPtr CommandInterpreter::CommandInterpreterImpl::loadProcedure(const string &filename) const {
+        std::ifstream file{filename};
+
+        if (!file)
+            throw Exception{std::format("Cannot open procedure {}", filename)};
+
+        Tokenizer tokens{file};
+
+        auto resolve = [this](const string &token) {
+            return isNum(token) ? enterNumber(token) : allocateCommand(token);
+        };
+
+        return VisitNumberMode(_mode, [&]<typename T>(std::type_identity<T>) {
+            return MakeCommandPtr<StoredProcedure<T>>(filename, tokens, resolve);
+        });
+    }
+
+    // Macros first: their names cannot be taken by commands registered
+    // before the recording, only by plugins loaded after it.
+    CommandPtr CommandInterpreter::CommandInterpreterImpl::allocateCommand(const string &name) const {
+        if (auto it = _macros.find(name); it != _macros.end())
+            return MakeCommandPtr(it->second.macro->clone());
+
+        return _factory.AllocateCommand(name);
+    }
+
+    // Any of the forms executeCommand executes as a command: a number, a
+    // command or macro name, play:<name>, proc:<file> or map:<name>.
+    CommandPtr CommandInterpreter::CommandInterpreterImpl::makeCommand(const string &entered) const {
+        string_view sv{entered};
 
-        if (isNumber)
-            d = std::stod(s);
+        if (isNum(entered))
+            return enterNumber(entered);
 
-        return isNumber;
+        if (entered.size() > 5 && sv.starts_with("proc:"))
+            return loadProcedure(string{sv.substr(5)});
+
+        if (entered.size() > 4 && sv.starts_with("map:")) {
+            string name{sv.substr(4)};
+
+            if (auto k = _factory.FindBatchKernel(name))
+                return MakeCommandPtr<Map>(k->kernel, k->image);
+
+            throw Exception{std::format("Command {} has no batch kernel", name)};
+        }
+
+        string name = entered.size() > 5 && sv.starts_with("play:") ? string{sv.substr(5)} : entered;
+
+        if (auto c = allocateCommand(name))
+            return c;
+
+        throw Exception{unknownCommand(name)};
     }
 
-    CommandInterpreter::CommandInterpreter(UserInterface& ui) : pimpl_ {std::make_unique<CommandInterpreterImpl>(ui)} {
+    CommandInterpreter::CommandInterpreter(UserInterface& ui, NumberMode mode)
+            : pimpl_ {std::make_unique<CommandInterpreterImpl>(ui, mode)} {
 
     }
 
     void CommandInterpreter::commandEntered(const string &command) {
+        pimpl_->takeFed();
         pimpl_->executeCommand(command);
     }
 
+    void CommandInterpreter::AttachJournal(Journal &journal) {
+        pimpl_->attachJournal(journal);
+    }
+
+    void CommandInterpreter::SaveSnapshot(const string &path) const {
+        pimpl_->saveSnapshot(path);
+    }
+
+    void CommandInterpreter::LoadSnapshot(const string &path, bool withHistory) {
+        pimpl_->loadSnapshot(path, withHistory);
+    }
+
     CommandInterpreter::~CommandInterpreter() {
 
     }
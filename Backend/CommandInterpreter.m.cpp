@@ -7,6 +7,8 @@ export module CommandInterpreter;
 
 import CalcUtilities;
 import UserInterface;
+import CalcBackend_Numeric;
+import CalcBackend_Journal;
 
 using std::string;
 
@@ -16,10 +18,26 @@ export namespace Calculator {
         class CommandInterpreterImpl;
 
     public:
-        explicit CommandInterpreter(UserInterface&);
+        // Commands entered run on the stack and factory of the given mode.
+        explicit CommandInterpreter(UserInterface&, NumberMode mode = NumberMode::Double);
         ~CommandInterpreter();
+        // Values pushed onto the stack's feed by other threads are taken in
+        // first, each as an entered number.
         void commandEntered(const string &command);
 
+        // Replays what journal recovered, then records every command executed
+        // from now on in it. Call before any command is entered; journal must
+        // outlive this interpreter.
+        void AttachJournal(Journal &journal);
+
+        // Saves the stack and the undo/redo history to path.
+        void SaveSnapshot(const string &path) const;
+
+        // Restores a snapshot into this interpreter, whose stack and history
+        // must be empty. Without history only the stack is restored, which
+        // is a plain copy from the file.
+        void LoadSnapshot(const string &path, bool withHistory = true);
+
     private:
         CommandInterpreter(const CommandInterpreter &) = delete;
         CommandInterpreter(CommandInterpreter &&) = delete;
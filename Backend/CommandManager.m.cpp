@@ -4,12 +4,19 @@ module;
 #include <vector>
 #include <list>
 #include <memory>
+#include <cstdint>
+#include <format>
+#include <expected>
+#include <utility>
+#include "../Utilities/Exception.h"
 
 export module CalcBackend_CommandManager;
 
 import CalcBackend_Command;
+import CalcUtilities;
 
 using std::unique_ptr;
+using std::shared_ptr;
 using std::make_unique;
 using std::stack;
 using std::list;
@@ -23,10 +30,28 @@ namespace Calculator {
         class UndoRedoStackStrategy;
         class UndoRedoListStrategyVector;
         class UndoRedoListStrategy;
+        class UndoRedoPersistentStrategy;
+        class UndoRedoTreeStrategy;
 
     public:
+        // PersistentStrategy shares its history between forks; the others
+        // cannot be forked. TreeStrategy keeps every branch of the history
+        // instead of discarding the redo entries when a command is executed.
         enum class UndoRedoStrategy {
-            ListStrategy, StackStrategy, ListStrategyVector
+            ListStrategy, StackStrategy, ListStrategyVector, PersistentStrategy, TreeStrategy
+        };
+
+        // Opaque copy of a manager's undo and redo history.
+        class History {
+        public:
+            History() = default;
+
+        private:
+            explicit History(std::shared_ptr<const CommandManagerStrategy> s) : _strategy{std::move(s)} {}
+
+            std::shared_ptr<const CommandManagerStrategy> _strategy;
+
+            friend class CommandManager;
         };
 
         explicit CommandManager(UndoRedoStrategy st = UndoRedoStrategy::StackStrategy);
@@ -35,10 +60,26 @@ namespace Calculator {
 
         size_t GetUndoSize() const;
         size_t GetRedoSize() const;
+        // A command whose preconditions fail is not added to the history; its
+        // static error message is returned instead of thrown.
+        CommandResult TryExecuteCommand(CommandPtr ptr);
+        // Throws the error TryExecuteCommand would return.
         void ExecuteCommand(CommandPtr ptr);
         void Undo();
         void Redo();
 
+        // O(1) for PersistentStrategy, which is the only strategy that
+        // supports it. Restore replaces this manager's history and strategy.
+        History Fork() const;
+        void Restore(const History &history);
+
+        // TreeStrategy only. Entries are numbered in the order their commands
+        // were executed, starting at 1; entry 0 is the state before the first
+        // command. GoTo undoes and redoes along the shortest path between the
+        // current entry and the given one.
+        size_t GetCurrentEntry() const;
+        void GoTo(size_t entry);
+
     private:
         CommandManager(CommandManager &) = delete;
         CommandManager(CommandManager &&) = delete;
@@ -48,22 +89,46 @@ namespace Calculator {
         unique_ptr<CommandManagerStrategy> _strategy;
     };
 
+    // What the history keeps of an executed command: its shared instance if
+    // it has one, which costs no allocation per entry, else the command.
+    CommandPtr HistoryEntry(CommandPtr ptr) {
+        if (auto shared = ptr->sharedInstance())
+            return CommandPtr{shared, &SharedCommandDeleter};
+
+        return ptr;
+    }
+
     class CommandManager::CommandManagerStrategy {
     public:
         virtual ~CommandManagerStrategy() = default;
         virtual size_t GetRedoSize() const = 0;
         virtual size_t GetUndoSize() const = 0;
-        virtual void ExecuteCommand(CommandPtr ptr) = 0;
+        virtual CommandResult ExecuteCommand(CommandPtr ptr) = 0;
         virtual void Undo() = 0;
         virtual void Redo() = 0;
+        virtual unique_ptr<CommandManagerStrategy> Fork() const;
+        virtual size_t GetCurrentEntry() const;
+        virtual void GoTo(size_t entry);
     };
 
+    unique_ptr<CommandManager::CommandManagerStrategy> CommandManager::CommandManagerStrategy::Fork() const {
+        throw Exception{"The undo strategy of this session cannot be forked"};
+    }
+
+    size_t CommandManager::CommandManagerStrategy::GetCurrentEntry() const {
+        throw Exception{"The undo strategy of this session has no undo tree"};
+    }
+
+    void CommandManager::CommandManagerStrategy::GoTo(size_t) {
+        throw Exception{"The undo strategy of this session has no undo tree"};
+    }
+
     class CommandManager::UndoRedoStackStrategy :
             public CommandManager::CommandManagerStrategy {
     public:
         size_t GetRedoSize() const override { return _redoStack.size(); }
         size_t GetUndoSize() const override { return _undoStack.size(); }
-        void ExecuteCommand(CommandPtr ptr) override;
+        CommandResult ExecuteCommand(CommandPtr ptr) override;
         void Undo() override;
         void Redo() override;
 
@@ -74,11 +139,13 @@ namespace Calculator {
         stack<CommandPtr> _redoStack;
     };
 
-    void CommandManager::UndoRedoStackStrategy::ExecuteCommand(CommandPtr ptr) {
-        ptr->execute();
+    CommandResult CommandManager::UndoRedoStackStrategy::ExecuteCommand(CommandPtr ptr) {
+        if (auto r = ptr->tryExecute(); !r)
+            return r;
 
-        _undoStack.push(std::move(ptr));
+        _undoStack.push(HistoryEntry(std::move(ptr)));
         FlushStack(_redoStack);
+        return {};
     }
 
     void CommandManager::UndoRedoStackStrategy::Redo() {
@@ -119,7 +186,7 @@ namespace Calculator {
 
         size_t GetUndoSize() const override { return _undoSize; }
         size_t GetRedoSize() const override { return _redoSize; }
-        void ExecuteCommand(CommandPtr ptr) override;
+        CommandResult ExecuteCommand(CommandPtr ptr) override;
         void Undo() override;
         void Redo() override;
 
@@ -132,14 +199,16 @@ namespace Calculator {
         vector<CommandPtr> _undoRedoList;
     };
 
-    void CommandManager::UndoRedoListStrategyVector::ExecuteCommand(CommandPtr ptr) {
-        ptr->execute();
+    CommandResult CommandManager::UndoRedoListStrategyVector::ExecuteCommand(CommandPtr ptr) {
+        if (auto r = ptr->tryExecute(); !r)
+            return r;
 
         Flush();
-        _undoRedoList.emplace_back(std::move(ptr));
+        _undoRedoList.emplace_back(HistoryEntry(std::move(ptr)));
         _cur = _undoRedoList.size() - 1;
         ++_undoSize;
         _redoSize = 0;
+        return {};
     }
 
     void CommandManager::UndoRedoListStrategyVector::Undo() {
@@ -173,7 +242,7 @@ namespace Calculator {
 
         size_t GetRedoSize() const override;
         size_t GetUndoSize() const override;
-        void ExecuteCommand(CommandPtr ptr) override;
+        CommandResult ExecuteCommand(CommandPtr ptr) override;
         void Undo() override;
         void Redo() override;
 
@@ -186,6 +255,14 @@ namespace Calculator {
         list<CommandPtr>::iterator _cur;
     };
 
+    size_t CommandManager::UndoRedoListStrategy::GetRedoSize() const {
+        return _redoSize;
+    }
+
+    size_t CommandManager::UndoRedoListStrategy::GetUndoSize() const {
+        return _undoSize;
+    }
+
     CommandManager::UndoRedoListStrategy::UndoRedoListStrategy()
             : _undoSize{0}, _redoSize{0} {
 
@@ -193,15 +270,17 @@ namespace Calculator {
         _cur = _undoRedoList.end();
     }
 
-    void CommandManager::UndoRedoListStrategy::ExecuteCommand(CommandPtr ptr) {
-        ptr->execute();
+    CommandResult CommandManager::UndoRedoListStrategy::ExecuteCommand(CommandPtr ptr) {
+        if (auto r = ptr->tryExecute(); !r)
+            return r;
 
         Flush();
-        _undoRedoList.emplace_back(std::move(ptr));
+        _undoRedoList.emplace_back(HistoryEntry(std::move(ptr)));
         ++_undoSize;
         _redoSize = 0;
         _cur = _undoRedoList.end();
         --_cur;
+        return {};
     }
 
     void CommandManager::UndoRedoListStrategy::Undo() {
@@ -233,6 +312,232 @@ namespace Calculator {
         }
     }
 
+    // Undo and redo stacks as persistent lists, so a fork copies two list
+    // heads and shares every entry with the original. Commands keep undo
+    // state, so an entry that is still shared is cloned before it is undone
+    // or redone; the other forks keep the original.
+    class CommandManager::UndoRedoPersistentStrategy : public CommandManager::CommandManagerStrategy {
+    public:
+        size_t GetRedoSize() const override { return _redo.Size(); }
+        size_t GetUndoSize() const override { return _undo.Size(); }
+        CommandResult ExecuteCommand(CommandPtr ptr) override;
+        void Undo() override;
+        void Redo() override;
+        unique_ptr<CommandManagerStrategy> Fork() const override;
+
+    private:
+        using Entry = shared_ptr<Command>;
+
+        static Entry Unshared(Entry e);
+
+        PersistentStack<Entry> _undo;
+        PersistentStack<Entry> _redo;
+    };
+
+    CommandResult CommandManager::UndoRedoPersistentStrategy::ExecuteCommand(CommandPtr ptr) {
+        if (auto r = ptr->tryExecute(); !r)
+            return r;
+
+        auto entry = HistoryEntry(std::move(ptr));
+        auto deleter = entry.get_deleter();
+
+        _undo.Push(Entry{entry.release(), deleter});
+        _redo.Clear();
+        return {};
+    }
+
+    void CommandManager::UndoRedoPersistentStrategy::Undo() {
+        if (_undo.Empty())
+            return;
+
+        auto c = _undo.Top();
+        _undo.Pop();
+
+        c = Unshared(std::move(c));
+        c->undo();
+        _redo.Push(std::move(c));
+    }
+
+    void CommandManager::UndoRedoPersistentStrategy::Redo() {
+        if (_redo.Empty())
+            return;
+
+        auto c = _redo.Top();
+        _redo.Pop();
+
+        c = Unshared(std::move(c));
+        c->execute();
+        _undo.Push(std::move(c));
+    }
+
+    unique_ptr<CommandManager::CommandManagerStrategy> CommandManager::UndoRedoPersistentStrategy::Fork() const {
+        return make_unique<UndoRedoPersistentStrategy>(*this);
+    }
+
+    // Shared instances keep no state and may be used by every fork at once.
+    CommandManager::UndoRedoPersistentStrategy::Entry
+    CommandManager::UndoRedoPersistentStrategy::Unshared(Entry e) {
+        if (e.use_count() == 1 || e->sharedInstance() == e.get())
+            return e;
+
+        return Entry{e->clone(), &CommandDeleter};
+    }
+
+    // Every executed command becomes a node whose parent is the entry it was
+    // executed on, so executing after an undo starts a new branch and keeps
+    // the old one. Nodes live in one vector in execution order, which makes
+    // an entry's number its index and walks between entries cache friendly.
+    // Redo follows the child that was most recently executed or undone; the
+    // length of that chain is kept up to date by undo and redo, and only
+    // counted again after a GoTo has moved to another branch.
+    class CommandManager::UndoRedoTreeStrategy : public CommandManager::CommandManagerStrategy {
+    public:
+        UndoRedoTreeStrategy();
+
+        size_t GetRedoSize() const override;
+        size_t GetUndoSize() const override { return _nodes[_cur].depth; }
+        CommandResult ExecuteCommand(CommandPtr ptr) override;
+        void Undo() override;
+        void Redo() override;
+        size_t GetCurrentEntry() const override { return _cur; }
+        void GoTo(size_t entry) override;
+
+    private:
+        static constexpr std::uint32_t None = 0;    // the root is nobody's child
+
+        struct Node {
+            CommandPtr command;
+            std::uint32_t parent;
+            std::uint32_t depth;
+            std::uint32_t redo;     // child Redo moves to, or None
+        };
+
+        void Ascend();
+
+        void Descend(std::uint32_t child);
+
+        vector<Node> _nodes;
+        std::uint32_t _cur;
+        mutable size_t _redoSize;
+        mutable bool _redoSizeKnown;
+    };
+
+    CommandManager::UndoRedoTreeStrategy::UndoRedoTreeStrategy() : _cur{0}, _redoSize{0}, _redoSizeKnown{true} {
+        _nodes.push_back({MakeCommandPtr(nullptr), 0, 0, None});
+    }
+
+    size_t CommandManager::UndoRedoTreeStrategy::GetRedoSize() const {
+        if (!_redoSizeKnown) {
+            _redoSize = 0;
+
+            for (auto i = _nodes[_cur].redo; i != None; i = _nodes[i].redo)
+                ++_redoSize;
+
+            _redoSizeKnown = true;
+        }
+        return _redoSize;
+    }
+
+    CommandResult CommandManager::UndoRedoTreeStrategy::ExecuteCommand(CommandPtr ptr) {
+        if (auto r = ptr->tryExecute(); !r)
+            return r;
+
+        const auto n = static_cast<std::uint32_t>(_nodes.size());
+
+        _nodes.push_back({HistoryEntry(std::move(ptr)), _cur, _nodes[_cur].depth + 1, None});
+        _nodes[_cur].redo = n;
+        _cur = n;
+        _redoSize = 0;
+        _redoSizeKnown = true;
+        return {};
+    }
+
+    void CommandManager::UndoRedoTreeStrategy::Undo() {
+        if (_cur != 0)
+            Ascend();
+    }
+
+    void CommandManager::UndoRedoTreeStrategy::Redo() {
+        if (auto child = _nodes[_cur].redo; child != None)
+            Descend(child);
+    }
+
+    // The chain Redo follows from the parent is the current entry's plus one.
+    void CommandManager::UndoRedoTreeStrategy::Ascend() {
+        auto &node = _nodes[_cur];
+
+        node.command->undo();
+        _nodes[node.parent].redo = _cur;
+        _cur = node.parent;
+        ++_redoSize;
+    }
+
+    // Throws, leaving everything as it was, if the child's command fails.
+    void CommandManager::UndoRedoTreeStrategy::Descend(std::uint32_t child) {
+        _nodes[child].command->execute();
+
+        if (_nodes[_cur].redo == child)
+            --_redoSize;
+        else
+            _redoSizeKnown = false;
+
+        _nodes[_cur].redo = child;
+        _cur = child;
+    }
+
+    // Undoes up to the lowest common ancestor of the current entry and the
+    // target, then redoes down to the target: no entry is visited twice. If
+    // a redo fails, the redos done so far are undone and the undone entries
+    // redone, so the history is left at the entry it started from.
+    void CommandManager::UndoRedoTreeStrategy::GoTo(size_t entry) {
+        if (entry >= _nodes.size())
+            throw Exception{std::format("There is no history entry {}", entry)};
+
+        auto target = static_cast<std::uint32_t>(entry);
+        vector<std::uint32_t> path;
+        vector<std::uint32_t> climbed;
+
+        while (_nodes[target].depth > _nodes[_cur].depth) {
+            path.push_back(target);
+            target = _nodes[target].parent;
+        }
+
+        while (_nodes[_cur].depth > _nodes[target].depth) {
+            climbed.push_back(_cur);
+            Ascend();
+        }
+
+        while (_cur != target) {
+            climbed.push_back(_cur);
+            Ascend();
+            path.push_back(target);
+            target = _nodes[target].parent;
+        }
+
+        // Where each redo on the way down pointed before, to put back.
+        vector<std::pair<std::uint32_t, std::uint32_t>> redirected;
+
+        try {
+            for (auto i = path.rbegin(); i != path.rend(); ++i) {
+                redirected.emplace_back(_cur, _nodes[_cur].redo);
+                Descend(*i);
+            }
+        }
+        catch (Exception &) {
+            while (_cur != target)
+                Ascend();
+
+            for (auto [node, redo]: redirected)
+                _nodes[node].redo = redo;
+
+            for (auto i = climbed.rbegin(); i != climbed.rend(); ++i)
+                Descend(*i);
+
+            _redoSizeKnown = false;
+            throw;
+        }
+    }
+
     CommandManager::CommandManager(UndoRedoStrategy st) {
         switch (st) {
             case UndoRedoStrategy::ListStrategy:
@@ -244,6 +549,12 @@ namespace Calculator {
             case UndoRedoStrategy::ListStrategyVector:
                 _strategy = make_unique<UndoRedoListStrategyVector>();
                 break;
+            case UndoRedoStrategy::PersistentStrategy:
+                _strategy = make_unique<UndoRedoPersistentStrategy>();
+                break;
+            case UndoRedoStrategy::TreeStrategy:
+                _strategy = make_unique<UndoRedoTreeStrategy>();
+                break;
         }
     }
 
@@ -255,8 +566,13 @@ namespace Calculator {
         return _strategy->GetUndoSize();
     }
 
+    CommandResult CommandManager::TryExecuteCommand(CommandPtr ptr) {
+        return _strategy->ExecuteCommand(std::move(ptr));
+    }
+
     void CommandManager::ExecuteCommand(CommandPtr ptr) {
-        _strategy->ExecuteCommand(std::move(ptr));
+        if (auto r = _strategy->ExecuteCommand(std::move(ptr)); !r)
+            throw Exception{r.error()};
     }
 
     void CommandManager::Undo() {
@@ -266,4 +582,21 @@ namespace Calculator {
     void CommandManager::Redo() {
         _strategy->Redo();
     }
+
+    CommandManager::History CommandManager::Fork() const {
+        return History{_strategy->Fork()};
+    }
+
+    size_t CommandManager::GetCurrentEntry() const {
+        return _strategy->GetCurrentEntry();
+    }
+
+    void CommandManager::GoTo(size_t entry) {
+        _strategy->GoTo(entry);
+    }
+
+    void CommandManager::Restore(const History &history) {
+        if (history._strategy)
+            _strategy = history._strategy->Fork();
+    }
 }
@@ -1,54 +1,107 @@
 module;
 
 #include <string>
-#include <stack>
-#include <cassert>
 #include <iostream>
 #include "../Utilities/Exception.h"
 #include <vector>
 #include <cmath>
+#include <span>
+#include <memory>
+#include <algorithm>
+#include <concepts>
+#include <cstdint>
+#include <thread>
+#include <bit>
+#include <optional>
+#include <system_error>
 
 export module CalcBackend_CoreCommands;
 
 import CalcBackend_Stack;
 import CalcBackend_Command;
+import CalcBackend_Numeric;
+import CalcBackend_MathKernels;
 import CalcUtilities;
 
 
 using namespace Calculator;
 using std::vector;
 using std::string;
+using std::span;
 
 #define CLONE(X) X* cloneImp() const override { return new X { *this }; }
 #define HELP(X) const char* helpMessageImp() const noexcept override { return X; }
+#define SHARED(X) Command* sharedInstanceImp() const noexcept override { static X instance; return &instance; }
 
 export namespace Calculator {
 
     double eps = 1e-12;
 
-    bool TopOfStackIsBetween(double lb, double ub) {
-        assert(lb <= ub);
+    // Whether x is within eps of an odd multiple of pi/2.
+    template<typename T>
+    bool IsTangentPole(const T &x) {
+        using std::floor;
 
-        auto v = Stack::Instance().GetElements(1);
-        auto d = v.back();
+        const T pi = NumberTraits<T>::Pi();
+        T r{(x + pi / 2.) / pi};
+        T d{r - floor(r + .5)};
 
-        return d >= lb && d <= ub;
+        return d < eps && d > -eps;
     }
 
-    bool PassesPowerTest(double y, double x) {
-        if (y == 0 && x < 0)
-            return false;
+    // Operand domains of the commands that can fail on their values. The
+    // checks are a table indexed by Domain, so a command only names its
+    // domain and the operands are read from the stack once, by the
+    // Unary/BinaryCommand precondition that calls CheckDomain.
+    enum class Domain : std::uint8_t {
+        Unrestricted, NonZeroDivisor, NonNegative, UnitInterval, NotTangentPole
+    };
+
+    template<typename T>
+    struct DomainRule {
+        bool (*valid)(const T &next, const T &top);
+        const char *message;
+    };
+
+    template<typename T>
+    inline constexpr DomainRule<T> DomainRules[] = {
+            {[](const T &, const T &) { return true; }, nullptr},
+            {[](const T &, const T &top) { return !(top == 0.); }, "Division by zero"},
+            {[](const T &next, const T &top) { return !(next < 0. || top < 0.); }, "Invalid result"},
+            {[](const T &, const T &top) { return !(top < -1. || top > 1.); }, "Invalid result"},
+            {[](const T &, const T &top) { return !IsTangentPole(top); }, "Infinite result"},
+    };
 
-        if (double intPart; y < 0 && std::modf(x, &intPart) != 0.0)
-            return false;
+    template<typename T>
+    const char *CheckDomain(Domain d, const T &next, const T &top) noexcept {
+        const auto &rule = DomainRules<T>[static_cast<size_t>(d)];
+        return rule.valid(next, top) ? nullptr : rule.message;
+    }
 
-        return true;
+    template<typename T>
+    const char *CheckDomain(Domain d, const T &top) noexcept {
+        return CheckDomain(d, top, top);
     }
 
+    // The same check over a span of doubles, for batch kernels.
+    template<Domain D>
+    const char *CheckDomain(const double *values, size_t n) noexcept {
+        for (size_t i = 0; i < n; ++i)
+            if (const char *p = CheckDomain(D, values[i]))
+                return p;
+
+        return nullptr;
+    }
 
+    // Complex mode extends the inverse sine and cosine past [-1, 1].
+    template<typename T>
+    inline constexpr Domain InverseTrigDomain =
+            NumberTraits<T>::Mode == NumberMode::Complex ? Domain::Unrestricted : Domain::UnitInterval;
+
+    template<typename T = double>
     class EnterNumber : public Command {
     public:
-        explicit EnterNumber(double d)
+        explicit EnterNumber(T d)
                 : Command{}, _number(d) {}
 
         explicit EnterNumber(const EnterNumber &rhs)
@@ -64,20 +117,21 @@ export namespace Calculator {
         EnterNumber &operator=(EnterNumber &&) = delete;
 
         void executeImp() noexcept override {
-            Stack::Instance().Push(_number);
+            BasicStack<T>::Instance().Push(_number);
         }
 
         void undoImp() noexcept override {
-            Stack::Instance().Pop();
+            BasicStack<T>::Instance().Pop();
         }
 
         CLONE(EnterNumber);
 
         HELP("Adds a number to the stack");
 
-        double _number;
+        T _number;
     };
 
+    template<typename T = double>
     class SwapTopOfStack : public Command {
     public:
         SwapTopOfStack() = default;
@@ -94,24 +148,29 @@ export namespace Calculator {
 
         SwapTopOfStack &operator=(SwapTopOfStack &&) = delete;
 
-        void checkPreconditionsImp() const override {
-            if (Stack::Instance().Size() < 2)
-                throw Exception{"Stack must have 2 elements"};
+        const char *checkPreconditionsImp() const noexcept override {
+            if (BasicStack<T>::Instance().Size() < 2)
+                return "Stack must have 2 elements";
+
+            return nullptr;
         }
 
         void executeImp() noexcept override {
-            Stack::Instance().SwapTop();
+            BasicStack<T>::Instance().SwapTop();
         }
 
         void undoImp() noexcept override {
-            Stack::Instance().SwapTop();
+            BasicStack<T>::Instance().SwapTop();
         }
 
         CLONE(SwapTopOfStack);
 
+        SHARED(SwapTopOfStack);
+
         HELP("Swap the top two elements of the stack");
     };
 
+    template<typename T = double>
     class DropTopOfStack : public Command {
     public:
         DropTopOfStack() = default;
@@ -128,26 +187,29 @@ export namespace Calculator {
 
         DropTopOfStack &operator=(DropTopOfStack &&) = delete;
 
-        void checkPreconditionsImp() const override {
-            if (Stack::Instance().Size() < 1)
-                throw Exception{"Stack must have 1 element"};
+        const char *checkPreconditionsImp() const noexcept override {
+            if (BasicStack<T>::Instance().Size() < 1)
+                return "Stack must have 1 element";
+
+            return nullptr;
         }
 
         void executeImp() noexcept override {
-            _droppedNumber = Stack::Instance().Pop();
+            _droppedNumber = BasicStack<T>::Instance().Pop();
         }
 
         void undoImp() noexcept override {
-            Stack::Instance().Push(_droppedNumber);
+            BasicStack<T>::Instance().Push(_droppedNumber);
         }
 
         CLONE(DropTopOfStack);
 
         HELP("Drop the top element from the stack");
 
-        double _droppedNumber;
+        T _droppedNumber;
     };
 
+    template<typename T = double>
     class ClearStack : public Command {
     public:
         ClearStack() = default;
@@ -164,47 +226,229 @@ export namespace Calculator {
 
         ClearStack &operator=(ClearStack &&) = delete;
 
+        // The cleared stack is kept as a fork, which shares its elements
+        // rather than copying them.
         void executeImp() noexcept override {
-            const auto n = Stack::Instance().Size();
+            auto &stack = BasicStack<T>::Instance();
 
-            if (n == 0)
-                return;
+            _stack = stack.Fork();
+            stack.Clear();
+        }
 
-            for (auto i = 0u; i < n - 1; ++i) {
-                _stack.push(Stack::Instance().Pop(true));
-            }
+        void undoImp() noexcept override {
+            BasicStack<T>::Instance().Restore(_stack);
+        }
+
+        CLONE(ClearStack);
 
-            _stack.push(Stack::Instance().Pop(false));
+        HELP("Clear the stack");
+
+        typename BasicStack<T>::Contents _stack;
+    };
+
+    constexpr size_t PairwiseLeaf = 16;
+    constexpr size_t PairwiseParallelMinimum = size_t{1} << 15;
+
+    // op(left(), right()), folding left on another thread if parallel. If no
+    // thread can be started, both are folded here: the tree, and so the
+    // result, is the same.
+    template<typename T, typename Op, typename Left, typename Right>
+    T FoldHalves(Op op, Left left, Right right, bool parallel) {
+        if (!parallel)
+            return op(left(), right());
+
+        T l;
+        std::jthread thread;
+
+        try {
+            thread = std::jthread{[&] { l = left(); }};
+        }
+        catch (const std::system_error &) {
+            return op(left(), right());
         }
 
-        void undoImp() noexcept override {
-            const auto n = _stack.size();
+        T r = right();
+        thread.join();
+        return op(l, r);
+    }
+
+    // Folds v with op as a pairwise tree whose shape depends only on
+    // v.size(), which bounds rounding error growth by log n instead of n.
+    // Below depth levels the two halves are folded on separate threads;
+    // since the tree is the same, so is every bit of the result whatever
+    // the number of threads.
+    template<typename T, typename Op>
+    T PairwiseReduce(span<const T> v, Op op, unsigned depth = 0) {
+        if (v.size() <= PairwiseLeaf) {
+            T r = v[0];
+
+            for (size_t i = 1; i < v.size(); ++i)
+                r = op(r, v[i]);
+
+            return r;
+        }
 
-            if (n == 0)
-                return;
+        const auto half = v.size() / 2;
+        const auto below = depth > 0 ? depth - 1 : 0;
+
+        return FoldHalves<T>(op,
+                             [=] { return PairwiseReduce(v.first(half), op, below); },
+                             [=] { return PairwiseReduce(v.subspan(half), op, below); },
+                             depth > 0 && v.size() >= PairwiseParallelMinimum);
+    }
+
+    // The same tree over the n elements of runs, stored one run after the
+    // other from skip elements into the first, as BasicStack::Runs gives
+    // them. Subtrees within one run are folded by the span version; only
+    // the few that straddle runs come through here.
+    template<typename T, typename Op>
+    T PairwiseReduce(span<const span<const T>> runs, size_t skip, size_t n, Op op, unsigned depth = 0) {
+        while (skip >= runs[0].size()) {
+            skip -= runs[0].size();
+            runs = runs.subspan(1);
+        }
 
-            for (auto i = 0u; i < n - 1; ++i) {
-                Stack::Instance().Push(_stack.top(), true);
+        if (runs[0].size() - skip >= n)
+            return PairwiseReduce(runs[0].subspan(skip, n), op, depth);
+
+        if (n <= PairwiseLeaf) {
+            T r = runs[0][skip];
+
+            for (size_t i = 1, k = 0, j = skip + 1; i < n; ++i, ++j) {
+                while (j == runs[k].size()) {
+                    ++k;
+                    j = 0;
+                }
+                r = op(r, runs[k][j]);
+            }
+            return r;
+        }
+
+        const auto half = n / 2;
+        const auto below = depth > 0 ? depth - 1 : 0;
+
+        return FoldHalves<T>(op,
+                             [=] { return PairwiseReduce(runs, skip, half, op, below); },
+                             [=] { return PairwiseReduce(runs, skip + half, n - half, op, below); },
+                             depth > 0 && n >= PairwiseParallelMinimum);
+    }
+
+    enum class Reduction {
+        Sum, Product, Mean
+    };
+
+    // Replaces the whole stack with its sum, product or mean, computed by
+    // PairwiseReduce over as many threads as the hardware has.
+    template<typename T, Reduction R>
+    class Reduce : public Command {
+    public:
+        Reduce() = default;
+
+        ~Reduce() = default;
+
+        explicit Reduce(const Reduce &rhs)
+                : Command{rhs}, _stack(rhs._stack) {}
+
+    private:
+        Reduce(Reduce &&) = delete;
+
+        Reduce &operator=(const Reduce &) = delete;
+
+        Reduce &operator=(Reduce &&) = delete;
+
+        // Any two elements can meet in the tree, so every pair must combine.
+        // Checking each Value against the first vector and the first complex
+        // value covers all of them.
+        const char *checkPreconditionsImp() const noexcept override {
+            const auto &stack = BasicStack<T>::Instance();
+
+            if (stack.Size() < 1)
+                return "Stack must have 1 element";
+
+            if constexpr (std::same_as<T, Value>) {
+                std::optional<Value> firstVector, firstComplex;
+
+                for (size_t i = 0; i < stack.Size(); ++i) {
+                    auto v = stack.Peek(i);
+
+                    for (const auto *seen: {&firstVector, &firstComplex}) {
+                        if (*seen) {
+                            if (const char *p = CheckOperands(**seen, v))
+                                return p;
+                        }
+                    }
+
+                    if (v.IsVector() && !firstVector)
+                        firstVector = std::move(v);
+                    else if (v.IsComplex() && !firstComplex)
+                        firstComplex = std::move(v);
+                }
+            }
+            return nullptr;
+        }
+
+        // The reduced stack is kept as a fork, as by ClearStack. The elements
+        // are read in place, so a stack shared with forks stays shared.
+        void executeImp() noexcept override {
+            auto &stack = BasicStack<T>::Instance();
+            const auto n = stack.Size();
+            const auto depth = static_cast<unsigned>(std::bit_width(std::max(std::thread::hardware_concurrency(), 1u))) - 1;
+
+            auto reduce = [depth, n](span<const span<const T>> runs) {
+                if constexpr (R == Reduction::Product)
+                    return PairwiseReduce(runs, 0, n, [](const T &a, const T &b) { return a * b; }, depth);
+                else
+                    return PairwiseReduce(runs, 0, n, [](const T &a, const T &b) { return a + b; }, depth);
+            };
+
+            T r;
+
+            if constexpr (std::same_as<T, Value>) {
+                auto values = stack.GetElements(n);
+                span<const T> all{values};
+                r = reduce({&all, 1});
+            } else {
+                auto runs = stack.Runs();
+                r = reduce(runs);
             }
 
-            Stack::Instance().Push(_stack.top(), false);
+            if constexpr (R == Reduction::Mean)
+                r = r / static_cast<double>(n);
+
+            _stack = stack.Fork();
+            stack.Clear();
+            stack.Push(r);
         }
 
-        CLONE(ClearStack);
+        void undoImp() noexcept override {
+            BasicStack<T>::Instance().Restore(_stack);
+        }
 
-        HELP("Clear the stack");
+        CLONE(Reduce);
+
+        const char *helpMessageImp() const noexcept override {
+            switch (R) {
+                case Reduction::Sum:
+                    return "Replace the stack with the sum of its elements";
+                case Reduction::Product:
+                    return "Replace the stack with the product of its elements";
+                default:
+                    return "Replace the stack with the mean of its elements";
+            }
+        }
 
-        std::stack<double> _stack;
+        typename BasicStack<T>::Contents _stack;
     };
 
-    class Add : public BinaryCommand {
+    template<typename T = double>
+    class Add : public BinaryCommand<T> {
     public:
         Add() = default;
 
         ~Add() = default;
 
         explicit Add(const Add &rhs)
-                : BinaryCommand{rhs} {}
+                : BinaryCommand<T>{rhs} {}
 
     private:
         Add(Add &&) = delete;
@@ -213,7 +457,7 @@ export namespace Calculator {
 
         Add &operator=(Add &&) = delete;
 
-        double binaryOperation(double next, double top)
+        T binaryOperation(T next, T top)
         const noexcept override {
             return next + top;
         }
@@ -223,14 +467,15 @@ export namespace Calculator {
         HELP("Replace first two elements of the stack with their sum");
     };
 
-    class Subtract : public BinaryCommand {
+    template<typename T = double>
+    class Subtract : public BinaryCommand<T> {
     public:
         Subtract() = default;
 
         ~Subtract() = default;
 
         explicit Subtract(const Subtract &rhs)
-                : BinaryCommand{rhs} {}
+                : BinaryCommand<T>{rhs} {}
 
     private:
         Subtract(Subtract &&) = delete;
@@ -239,7 +484,7 @@ export namespace Calculator {
 
         Subtract &operator=(Subtract &&) = delete;
 
-        double binaryOperation(double next, double top)
+        T binaryOperation(T next, T top)
         const noexcept override {
             return next - top;
         }
@@ -249,14 +494,15 @@ export namespace Calculator {
         HELP("Replace first two elements of the stack with their difference");
     };
 
-    class Divide : public BinaryCommand {
+    template<typename T = double>
+    class Divide : public BinaryCommand<T> {
     public:
         Divide() = default;
 
         ~Divide() = default;
 
         explicit Divide(const Divide &rhs)
-                : BinaryCommand{rhs} {}
+                : BinaryCommand<T>{rhs} {}
 
     private:
         Divide(Divide &&) = delete;
@@ -265,14 +511,14 @@ export namespace Calculator {
 
         Divide &operator=(Divide &&) = delete;
 
-        void checkPreconditionsImp() const override {
-            BinaryCommand::checkPreconditionsImp();
+        const char *checkOperands(const T &next, const T &top) const noexcept override {
+            if (const char *p = BinaryCommand<T>::checkOperands(next, top))
+                return p;
 
-            if (auto v = Stack::Instance().GetElements(1); v.front() == 0. || v.front() == -0.)
-                throw Exception{"Division by zero"};
+            return CheckDomain(Domain::NonZeroDivisor, next, top);
         }
 
-        double binaryOperation(double next, double top)
+        T binaryOperation(T next, T top)
         const noexcept override {
             return next / top;
         }
@@ -282,14 +528,15 @@ export namespace Calculator {
         HELP("Replace first two elements of the stack with their quotient";)
     };
 
-    class Power : public BinaryCommand {
+    template<typename T = double>
+    class Power : public BinaryCommand<T> {
     public:
         Power() = default;
 
         ~Power() = default;
 
         explicit Power(const Power &rhs)
-                : BinaryCommand{rhs} {}
+                : BinaryCommand<T>{rhs} {}
 
     private:
         Power(Power &&) = delete;
@@ -298,16 +545,21 @@ export namespace Calculator {
 
         Power &operator=(const Power &) = delete;
 
-        void checkPreconditionsImp() const override {
-            BinaryCommand::checkPreconditionsImp();
+        const char *checkOperands(const T &next, const T &top) const noexcept override {
+            if (const char *p = BinaryCommand<T>::checkOperands(next, top))
+                return p;
 
-            if (auto v = Stack::Instance().GetElements(2); v[0] < 0 || v[1] < 0)
-                throw Exception{"Invalid result"};
+            return CheckDomain(Domain::NonNegative, next, top);
         }
 
-        double binaryOperation(double next, double top)
+        T binaryOperation(T next, T top)
         const noexcept override {
-            return std::pow(next, top);
+            if constexpr (std::same_as<T, double>)
+                return Pow(next, top);
+            else {
+                using std::pow;
+                return pow(next, top);
+            }
         }
 
         CLONE(Power);
@@ -315,14 +567,15 @@ export namespace Calculator {
         HELP("Replace first two elements of the stack, y, x, with y^x. Note, x is top of stack");
     };
 
-    class Root : public BinaryCommand {
+    template<typename T = double>
+    class Root : public BinaryCommand<T> {
     public:
         Root() = default;
 
         ~Root() = default;
 
         explicit Root(const Root &rhs)
-                : BinaryCommand{rhs} {}
+                : BinaryCommand<T>{rhs} {}
 
     private:
         Root(Root &&) = delete;
@@ -331,16 +584,21 @@ export namespace Calculator {
 
         Root &operator=(Root &&) = delete;
 
-        void checkPreconditionsImp() const override {
-            BinaryCommand::checkPreconditionsImp();
+        const char *checkOperands(const T &next, const T &top) const noexcept override {
+            if (const char *p = BinaryCommand<T>::checkOperands(next, top))
+                return p;
 
-            if (auto v = Stack::Instance().GetElements(2); v[0] < 0 || v[1] < 0)
-                throw Exception{"Invalid result"};
+            return CheckDomain(Domain::NonNegative, next, top);
         }
 
-        double binaryOperation(double next, double top)
+        T binaryOperation(T next, T top)
         const noexcept override {
-            return std::pow(next, 1. / top);
+            if constexpr (std::same_as<T, double>)
+                return Pow(next, 1. / top);
+            else {
+                using std::pow;
+                return pow(next, T{1.} / top);
+            }
         }
 
         CLONE(Root);
@@ -348,14 +606,15 @@ export namespace Calculator {
         HELP("Replace first two elements of the stack, y, x, with x root of y. Note, x is top of stack")
     };
 
-    class Sine : public UnaryCommand {
+    template<typename T = double>
+    class Sine : public UnaryCommand<T> {
     public:
         Sine() = default;
 
         ~Sine() = default;
 
         explicit Sine(const Sine &rhs)
-                : UnaryCommand{rhs} {}
+                : UnaryCommand<T>{rhs} {}
 
     private:
         Sine(Sine &&) = delete;
@@ -364,9 +623,14 @@ export namespace Calculator {
 
         Sine &operator=(Sine &&) = delete;
 
-        double unaryOperation(double top)
+        T unaryOperation(T top)
         const noexcept override {
-            return std::sin(top);
+            if constexpr (std::same_as<T, double>)
+                return Sin(top);
+            else {
+                using std::sin;
+                return sin(top);
+            }
         }
 
         CLONE(Sine);
@@ -374,14 +638,15 @@ export namespace Calculator {
         HELP("Replace the first element x, on the stack with sin(x). x must be in radians");
     };
 
-    class Cosine : public UnaryCommand {
+    template<typename T = double>
+    class Cosine : public UnaryCommand<T> {
     public:
         Cosine() = default;
 
         ~Cosine() = default;
 
         explicit Cosine(const Cosine &rhs)
-                : UnaryCommand{rhs} {}
+                : UnaryCommand<T>{rhs} {}
 
     private:
         Cosine(Cosine &&) = delete;
@@ -390,9 +655,14 @@ export namespace Calculator {
 
         Cosine &operator=(Cosine &&) = delete;
 
-        double unaryOperation(double top)
+        T unaryOperation(T top)
         const noexcept override {
-            return std::cos(top);
+            if constexpr (std::same_as<T, double>)
+                return Cos(top);
+            else {
+                using std::cos;
+                return cos(top);
+            }
         }
 
         CLONE(Cosine);
@@ -400,14 +670,15 @@ export namespace Calculator {
         HELP("Replace the first element, x, on the stack with cos(x). x must be in radians");
     };
 
-    class Tangent : public UnaryCommand {
+    template<typename T = double>
+    class Tangent : public UnaryCommand<T> {
     public:
         Tangent() = default;
 
         ~Tangent() = default;
 
         explicit Tangent(const Tangent &rhs)
-                : UnaryCommand{rhs} {}
+                : UnaryCommand<T>{rhs} {}
 
     private:
         Tangent(Tangent &&) = delete;
@@ -416,23 +687,18 @@ export namespace Calculator {
 
         Tangent &operator=(Tangent &&) = delete;
 
-        void checkPreconditionsImp() const override {
-            UnaryCommand::checkPreconditionsImp();
-
-            auto v = Stack::Instance().GetElements(1);
-            double d{v.back() + M_PI / 2.};
-            double r{std::fabs(d) / std::fabs(M_PI)};
-            int w{static_cast<int>(std::floor(r + eps))};
-
-            r = r - w;
-
-            if (r < eps && r > -eps)
-                throw Exception{"Infinite result"};
+        const char *checkOperand(const T &top) const noexcept override {
+            return CheckDomain(Domain::NotTangentPole, top);
         }
 
-        double unaryOperation(double top)
+        T unaryOperation(T top)
         const noexcept override {
-            return std::tan(top);
+            if constexpr (std::same_as<T, double>)
+                return Tan(top);
+            else {
+                using std::tan;
+                return tan(top);
+            }
         }
 
         CLONE(Tangent);
@@ -440,14 +706,15 @@ export namespace Calculator {
         HELP("Replace the first element, x, on the stack with tan(x). x must be in radians");
     };
 
-    class Arcsine : public UnaryCommand {
+    template<typename T = double>
+    class Arcsine : public UnaryCommand<T> {
     public:
         Arcsine() = default;
 
         ~Arcsine() = default;
 
         explicit Arcsine(const Arcsine &rhs)
-                : UnaryCommand{rhs} {}
+                : UnaryCommand<T>{rhs} {}
 
     private:
         Arcsine(Arcsine &&) = delete;
@@ -456,13 +723,17 @@ export namespace Calculator {
 
         Arcsine &operator=(Arcsine &&) = delete;
 
-        void checkPreconditionsImp() const override {
-            UnaryCommand::checkPreconditionsImp();
-            // Need add a little bit changes;
+        const char *checkOperand(const T &top) const noexcept override {
+            return CheckDomain(InverseTrigDomain<T>, top);
         }
 
-        double unaryOperation(double top) const noexcept override {
-            return std::asin(top);
+        T unaryOperation(T top) const noexcept override {
+            if constexpr (std::same_as<T, double>)
+                return Asin(top);
+            else {
+                using std::asin;
+                return asin(top);
+            }
         }
 
         CLONE(Arcsine);
@@ -470,14 +741,15 @@ export namespace Calculator {
         HELP("Replace the first element, x, on the stack with arcsin(x). Returns result in radians");
     };
 
-    class Arccosine : public UnaryCommand {
+    template<typename T = double>
+    class Arccosine : public UnaryCommand<T> {
     public:
         Arccosine() = default;
 
         ~Arccosine() = default;
 
         explicit Arccosine(const Arccosine &rhs)
-                : UnaryCommand{rhs} {}
+                : UnaryCommand<T>{rhs} {}
 
     private:
         Arccosine(Arccosine &&) = delete;
@@ -486,12 +758,17 @@ export namespace Calculator {
 
         Arccosine &operator=(Arccosine &&) = delete;
 
-        void checkPreconditionsImp() const override {
-            UnaryCommand::checkPreconditionsImp();
+        const char *checkOperand(const T &top) const noexcept override {
+            return CheckDomain(InverseTrigDomain<T>, top);
         }
 
-        double unaryOperation(double top) const noexcept override {
-            return std::acos(top);
+        T unaryOperation(T top) const noexcept override {
+            if constexpr (std::same_as<T, double>)
+                return Acos(top);
+            else {
+                using std::acos;
+                return acos(top);
+            }
         }
 
         CLONE(Arccosine);
@@ -499,14 +776,15 @@ export namespace Calculator {
         HELP("Replace the first element, x, on the stack with arccos(x). Returns result in radians");
     };
 
-    class Arctangent : public UnaryCommand {
+    template<typename T = double>
+    class Arctangent : public UnaryCommand<T> {
     public:
         Arctangent() = default;
 
         ~Arctangent() = default;
 
         explicit Arctangent(const Arctangent &rhs)
-                : UnaryCommand{rhs} {}
+                : UnaryCommand<T>{rhs} {}
 
     private:
         Arctangent(Arctangent &&) = delete;
@@ -515,8 +793,13 @@ export namespace Calculator {
 
         Arctangent &operator=(Arctangent &&) = delete;
 
-        double unaryOperation(double top) const noexcept override {
-            return std::atan(top);
+        T unaryOperation(T top) const noexcept override {
+            if constexpr (std::same_as<T, double>)
+                return Atan(top);
+            else {
+                using std::atan;
+                return atan(top);
+            }
         }
 
         CLONE(Arctangent);
@@ -524,14 +807,17 @@ export namespace Calculator {
         HELP("Replace the first element, x, on the stack with arctan(x). Returns result in radians");
     };
 
-    class Negate : public UnaryCommand {
+    // Negation is its own exact inverse, so unlike the other unary commands
+    // Negate keeps no copy of its operand.
+    template<typename T = double>
+    class Negate : public Command {
     public:
         Negate() = default;
 
         ~Negate() = default;
 
         explicit Negate(const Negate &rhs)
-                : UnaryCommand{rhs} {}
+                : Command{rhs} {}
 
     private:
         Negate(Negate &&) = delete;
@@ -540,15 +826,30 @@ export namespace Calculator {
 
         Negate &operator=(Negate &&) = delete;
 
-        double unaryOperation(double top) const noexcept override {
-            return -top;
+        const char *checkPreconditionsImp() const noexcept override {
+            if (BasicStack<T>::Instance().Size() < 1)
+                return "Stack must have at least one element";
+
+            return nullptr;
+        }
+
+        void executeImp() noexcept override {
+            auto &stack = BasicStack<T>::Instance();
+            stack.Push(-stack.Pop(true));
+        }
+
+        void undoImp() noexcept override {
+            executeImp();
         }
 
         CLONE(Negate);
 
+        SHARED(Negate);
+
         HELP("Negates the top number on the stack");
     };
 
+    template<typename T = double>
     class Duplicate : public Command {
     public:
         Duplicate() = default;
@@ -565,23 +866,150 @@ export namespace Calculator {
 
         Duplicate &operator=(Duplicate &&) = delete;
 
-        void checkPreconditionsImp() const override {
-            if (Stack::Instance().Size() < 1)
-                throw Exception{"Stack must have 1 element"};
+        const char *checkPreconditionsImp() const noexcept override {
+            if (BasicStack<T>::Instance().Size() < 1)
+                return "Stack must have 1 element";
+
+            return nullptr;
         }
 
         void executeImp() noexcept override {
-            auto v = Stack::Instance().GetElements(1);
-            Stack::Instance().Push(v.back());
+            auto &stack = BasicStack<T>::Instance();
+            stack.Push(stack.Peek());
         }
 
         void undoImp() noexcept override {
-            Stack::Instance().Pop();
+            BasicStack<T>::Instance().Pop();
         }
 
         CLONE(Duplicate);
 
+        SHARED(Duplicate);
+
         HELP("Duplicates the top number on the stack");
     };
 
+    // Applies a command's batch kernel to every element of the stack in one
+    // call, instead of executing the command once per element. image keeps
+    // the kernel's code mapped for as long as the command is in the history.
+    class Map : public Command {
+    public:
+        Map(const PluginBatchKernel &kernel, std::shared_ptr<const void> image)
+                : Command{}, _kernel(kernel), _image(std::move(image)) {}
+
+        explicit Map(const Map &rhs)
+                : Command{rhs}, _kernel(rhs._kernel), _image(rhs._image), _saved(rhs._saved) {}
+
+        ~Map() = default;
+
+    private:
+        Map(Map &&) = delete;
+
+        Map &operator=(const Map &) = delete;
+
+        Map &operator=(Map &&) = delete;
+
+        const char *checkPreconditionsImp() const noexcept override {
+            if (Stack::Instance().Size() < 1)
+                return "Stack must have 1 element";
+
+            if (_kernel.check) {
+                auto values = Stack::Instance().Top(Stack::Instance().Size());
+                return _kernel.check(values.data(), values.size());
+            }
+            return nullptr;
+        }
+
+        void executeImp() noexcept override {
+            auto values = Stack::Instance().Top(Stack::Instance().Size());
+            _saved.assign(values.begin(), values.end());
+
+            Stack::Instance().Transform(_saved.size(), [this](std::span<double> v) {
+                _kernel.apply(v.data(), v.size());
+            });
+        }
+
+        void undoImp() noexcept override {
+            Stack::Instance().Transform(_saved.size(), [this](std::span<double> v) {
+                std::ranges::copy(_saved, v.begin());
+            });
+        }
+
+        CLONE(Map);
+
+        HELP("Apply a command to every element of the stack");
+
+        PluginBatchKernel _kernel;
+        std::shared_ptr<const void> _image;
+        vector<double> _saved;
+    };
+
+    // A recorded sequence of commands that executes and undoes as one. The
+    // steps are kept as prototypes resolved when they were recorded, so a
+    // replay clones them without parsing or looking up any name. If a step
+    // fails, the steps before it are undone and its error is returned.
+    class Macro : public Command {
+    public:
+        Macro(string help, vector<CommandPtr> steps)
+                : Command{}, _recording{std::make_shared<const Recording>(std::move(help), std::move(steps))} {}
+
+        // The executed steps carry the undo state, so a clone taken to undo
+        // an executed macro needs copies of them.
+        explicit Macro(const Macro &rhs) : Command{rhs}, _recording(rhs._recording) {
+            _executed.reserve(rhs._executed.size());
+
+            for (const auto &step: rhs._executed)
+                _executed.push_back(MakeCommandPtr(step->clone()));
+        }
+
+        ~Macro() = default;
+
+    private:
+        struct Recording {
+            string help;
+            vector<CommandPtr> steps;
+        };
+
+        Macro(Macro &&) = delete;
+
+        Macro &operator=(const Macro &) = delete;
+
+        Macro &operator=(Macro &&) = delete;
+
+        // A redo executes the same step objects again.
+        CommandResult tryExecuteImp() override {
+            if (_executed.empty()) {
+                _executed.reserve(_recording->steps.size());
+
+                for (const auto &step: _recording->steps)
+                    _executed.push_back(MakeCommandPtr(step->clone()));
+            }
+
+            for (size_t i = 0; i < _executed.size(); ++i) {
+                if (auto result = _executed[i]->tryExecute(); !result) {
+                    while (i > 0)
+                        _executed[--i]->undo();
+
+                    return result;
+                }
+            }
+            return {};
+        }
+
+        // Only reached through tryExecuteImp.
+        void executeImp() noexcept override {}
+
+        void undoImp() noexcept override {
+            for (auto i = _executed.size(); i > 0; --i)
+                _executed[i - 1]->undo();
+        }
+
+        CLONE(Macro);
+
+        const char *helpMessageImp() const noexcept override { return _recording->help.c_str(); }
+
+        std::shared_ptr<const Recording> _recording;
+        vector<CommandPtr> _executed;
+    };
+
 }
\ No newline at end of file
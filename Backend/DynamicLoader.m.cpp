@@ -4,22 +4,40 @@ module;
 
 export module DynamicLoader;
 
+import CalcBackend_Command;
+import CalcBackend_Plugin;
+
 using std::string;
 
 namespace Calculator {
+    export extern "C" {
+        struct PluginBatchKernels {
+            int nKernels;
+            const char* const* commandNames;
+            const PluginBatchKernel* kernels;
+        };
+    }
+
     export class DynamicLoader {
     public:
         virtual ~DynamicLoader() = default;
 
-        virtual class Plugin* AllocatePlugin(const string &pluginName) = 0;
+        virtual Plugin* AllocatePlugin(const string &pluginName) = 0;
 
-        virtual void deallocatePlugin(class Plugin*) = 0;
+        virtual void deallocatePlugin(Plugin*) = 0;
+
+        // Batch kernels exported by an allocated plugin, or nullptr if it only
+        // offers the classic Command interface.
+        virtual const PluginBatchKernels* GetBatchKernels(const Plugin*) const { return nullptr; }
 
         static string GetPluginAllocateName() { return "AllocPlugin"; }
 
         static string GetPluginDeallocateName() { return "DeallocPlugin"; }
+
+        static string GetPluginBatchKernelsName() { return "GetBatchKernels"; }
     };
 
     export extern "C" { typedef void* (*PluginAllocator)(void); }
     export extern "C" { typedef void (*PluginDeallocator)(void*); }
+    export extern "C" { typedef const PluginBatchKernels* (*PluginBatchKernelsGetter)(void); }
 }
\ No newline at end of file
@@ -0,0 +1,413 @@
+module;
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <format>
+#include <mutex>
+#include <thread>
+#include <stop_token>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <filesystem>
+#include "../Utilities/Exception.h"
+
+#ifdef POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+export module CalcBackend_Journal;
+
+import CalcBackend_Numeric;
+
+using std::string;
+using std::string_view;
+using std::vector;
+using std::jthread;
+
+namespace fs = std::filesystem;
+
+namespace Calculator {
+
+    // Append-only binary log of a session. Records are framed as
+    //
+    //     kind (1 byte) | payload length (4 bytes) | payload | checksum (4 bytes)
+    //
+    // in native byte order after a header naming the number mode, so a record
+    // torn by a crash is recognised and dropped. Appends go to an in-memory
+    // batch that a background thread writes with one O_APPEND write and one
+    // fdatasync every GroupCommitInterval, or sooner once GroupCommitBytes are
+    // pending: a crash loses at most the last interval of commands.
+    //
+    // Opening an existing journal recovers it: everything before its last
+    // checkpoint is dropped, the file is rewritten as that checkpoint plus the
+    // records after it, and both are made available through GetRecovery.
+    export class Journal {
+    public:
+        enum class RecordKind : std::uint8_t {
+            Command = 1, Undo, Redo, Checkpoint
+        };
+
+        struct Record {
+            RecordKind kind;
+            string text;    // the command as entered; empty for Undo and Redo
+        };
+
+        // What a checkpoint stands in for: the stack, and whatever else the
+        // records before it set up, as entries of words that the journal
+        // keeps without interpreting them.
+        struct State {
+            vector<char> stack;             // encoded by EncodeStack
+            vector<vector<string>> entries;
+        };
+
+        struct Recovery {
+            State checkpoint;               // as of the last checkpoint
+            vector<Record> records;         // recorded after that checkpoint
+        };
+
+        Journal(const string &path, NumberMode mode);
+
+        // Commits whatever is still pending.
+        ~Journal();
+
+        const Recovery &GetRecovery() const { return _recovery; }
+
+        void Append(RecordKind kind, string_view text = {});
+
+        // Recovery starts from the latest checkpoint.
+        void Checkpoint(const State &state);
+
+        // Writes and syncs everything appended so far before returning.
+        void Commit();
+
+    private:
+        Journal(const Journal &) = delete;
+        Journal(Journal &&) = delete;
+        Journal &operator=(const Journal &) = delete;
+        Journal &operator=(Journal &&) = delete;
+
+        void Recover(NumberMode mode);
+
+        void Run(std::stop_token st);
+
+        void Write(const vector<char> &batch);
+
+        static constexpr size_t GroupCommitBytes = 64 * 1024;
+        static constexpr auto GroupCommitInterval = std::chrono::milliseconds{5};
+
+        string _path;
+        Recovery _recovery;
+
+#ifdef POSIX
+        int _fd;
+#else
+        std::FILE *_file;
+#endif
+
+        std::mutex _mutex;
+        std::condition_variable_any _pendingReady;
+        vector<char> _pending;
+        std::mutex _writeMutex;
+        std::atomic<bool> _failed{false};
+        jthread _thread;
+    };
+
+    namespace {
+        constexpr char Magic[] = {'R', 'P', 'N', 'J'};
+        constexpr std::uint8_t Version = 2;
+
+        // FNV-1a.
+        std::uint32_t Checksum(const char *data, size_t n) {
+            std::uint32_t h{2166136261u};
+
+            for (size_t i = 0; i < n; ++i)
+                h = (h ^ static_cast<unsigned char>(data[i])) * 16777619u;
+
+            return h;
+        }
+
+        template<typename U>
+        void Put(vector<char> &out, U u) {
+            char bytes[sizeof u];
+            std::memcpy(bytes, &u, sizeof u);
+            out.insert(out.end(), bytes, bytes + sizeof u);
+        }
+
+        template<typename U>
+        bool Get(const vector<char> &in, size_t &pos, U &u) {
+            if (in.size() - pos < sizeof u)
+                return false;
+
+            std::memcpy(&u, in.data() + pos, sizeof u);
+            pos += sizeof u;
+            return true;
+        }
+
+        void PutFrame(vector<char> &out, Journal::RecordKind kind, const vector<char> &payload) {
+            const auto begin = out.size();
+
+            Put(out, static_cast<std::uint8_t>(kind));
+            Put(out, static_cast<std::uint32_t>(payload.size()));
+            out.insert(out.end(), payload.begin(), payload.end());
+            Put(out, Checksum(out.data() + begin, out.size() - begin));
+        }
+
+        void PutBytes(vector<char> &out, string_view bytes) {
+            Put(out, static_cast<std::uint32_t>(bytes.size()));
+            out.insert(out.end(), bytes.begin(), bytes.end());
+        }
+
+        bool GetBytes(const vector<char> &in, size_t &pos, string &bytes) {
+            std::uint32_t n{0};
+
+            if (!Get(in, pos, n) || in.size() - pos < n)
+                return false;
+
+            bytes.assign(in.data() + pos, n);
+            pos += n;
+            return true;
+        }
+
+        // Checkpoint payload: the encoded stack as length and bytes, so the
+        // numbers keep every bit, then the entry count and each entry as its
+        // word count followed by the words as length and bytes.
+        vector<char> EncodeCheckpoint(const Journal::State &state) {
+            vector<char> payload;
+
+            PutBytes(payload, {state.stack.data(), state.stack.size()});
+            Put(payload, static_cast<std::uint32_t>(state.entries.size()));
+
+            for (const auto &entry: state.entries) {
+                Put(payload, static_cast<std::uint32_t>(entry.size()));
+
+                for (const auto &word: entry)
+                    PutBytes(payload, word);
+            }
+            return payload;
+        }
+
+        bool DecodeCheckpoint(const vector<char> &payload, Journal::State &state) {
+            size_t pos{0};
+            string stack;
+            std::uint32_t count{0};
+
+            if (!GetBytes(payload, pos, stack) || !Get(payload, pos, count))
+                return false;
+
+            state.stack.assign(stack.begin(), stack.end());
+            state.entries.clear();
+
+            for (std::uint32_t i = 0; i < count; ++i) {
+                std::uint32_t words{0};
+
+                if (!Get(payload, pos, words))
+                    return false;
+
+                auto &entry = state.entries.emplace_back();
+
+                for (std::uint32_t j = 0; j < words; ++j) {
+                    if (!GetBytes(payload, pos, entry.emplace_back()))
+                        return false;
+                }
+            }
+            return pos == payload.size();
+        }
+
+        vector<char> Header(NumberMode mode) {
+            vector<char> header(std::begin(Magic), std::end(Magic));
+
+            Put(header, Version);
+            Put(header, static_cast<std::uint8_t>(mode));
+            return header;
+        }
+    }
+
+    Journal::Journal(const string &path, NumberMode mode) : _path{path} {
+        Recover(mode);
+
+#ifdef POSIX
+        _fd = open(_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+        if (_fd < 0)
+            throw Exception{std::format("Cannot open journal {}", _path)};
+#else
+        _file = std::fopen(_path.c_str(), "ab");
+
+        if (!_file)
+            throw Exception{std::format("Cannot open journal {}", _path)};
+
+        std::setvbuf(_file, nullptr, _IONBF, 0);
+#endif
+
+        _thread = jthread{[this](std::stop_token st) { Run(st); }};
+    }
+
+    Journal::~Journal() {
+        _thread.request_stop();
+        _thread.join();
+        Commit();
+
+#ifdef POSIX
+        close(_fd);
+#else
+        std::fclose(_file);
+#endif
+    }
+
+    void Journal::Recover(NumberMode mode) {
+        const auto header = Header(mode);
+        vector<char> in;
+
+        if (std::ifstream file{_path, std::ios::binary})
+            in.assign(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+
+        if (!in.empty()) {
+            if (in.size() < header.size() || std::memcmp(in.data(), Magic, sizeof Magic) != 0)
+                throw Exception{std::format("{} is not a journal", _path)};
+
+            if (!std::equal(header.begin(), header.end(), in.begin()))
+                throw Exception{std::format("Journal {} was written by another version or number mode", _path)};
+        }
+
+        // Frames after the last checkpoint, copied verbatim into the compacted file.
+        vector<char> tail;
+        size_t pos = header.size();
+
+        while (pos < in.size()) {
+            const auto begin = pos;
+            std::uint8_t kind{0};
+            std::uint32_t length{0}, checksum{0};
+
+            if (!Get(in, pos, kind) || !Get(in, pos, length) || in.size() - pos < length)
+                break;
+
+            vector<char> payload(in.begin() + static_cast<std::ptrdiff_t>(pos),
+                                 in.begin() + static_cast<std::ptrdiff_t>(pos + length));
+            pos += length;
+
+            if (!Get(in, pos, checksum) || checksum != Checksum(in.data() + begin, pos - begin - sizeof checksum))
+                break;
+
+            if (static_cast<RecordKind>(kind) == RecordKind::Checkpoint) {
+                if (!DecodeCheckpoint(payload, _recovery.checkpoint))
+                    break;
+
+                _recovery.records.clear();
+                tail.assign(in.begin() + static_cast<std::ptrdiff_t>(begin),
+                            in.begin() + static_cast<std::ptrdiff_t>(pos));
+                continue;
+            }
+
+            _recovery.records.push_back({static_cast<RecordKind>(kind), string{payload.begin(), payload.end()}});
+            tail.insert(tail.end(), in.begin() + static_cast<std::ptrdiff_t>(begin),
+                        in.begin() + static_cast<std::ptrdiff_t>(pos));
+        }
+
+        // Rewriting also cuts off a torn final record, which would otherwise
+        // hide every record appended after it.
+        auto compacted = header;
+        compacted.insert(compacted.end(), tail.begin(), tail.end());
+
+        if (compacted == in)
+            return;
+
+        const auto temp = _path + ".tmp";
+        {
+            std::ofstream out{temp, std::ios::binary | std::ios::trunc};
+            out.write(compacted.data(), static_cast<std::streamsize>(compacted.size()));
+
+            if (!out.flush())
+                throw Exception{std::format("Cannot write journal {}", temp)};
+        }
+
+#ifdef POSIX
+        if (int fd = open(temp.c_str(), O_RDONLY | O_CLOEXEC); fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+#endif
+
+        fs::rename(temp, _path);
+    }
+
+    void Journal::Append(RecordKind kind, string_view text) {
+        if (_failed.load(std::memory_order_relaxed))
+            throw Exception{std::format("Cannot write journal {}", _path)};
+
+        vector<char> payload{text.begin(), text.end()};
+        bool full;
+        {
+            std::lock_guard lock{_mutex};
+            PutFrame(_pending, kind, payload);
+            full = _pending.size() >= GroupCommitBytes;
+        }
+
+        if (full)
+            _pendingReady.notify_one();
+    }
+
+    void Journal::Checkpoint(const State &state) {
+        {
+            std::lock_guard lock{_mutex};
+            PutFrame(_pending, RecordKind::Checkpoint, EncodeCheckpoint(state));
+        }
+        _pendingReady.notify_one();
+    }
+
+    void Journal::Commit() {
+        vector<char> batch;
+
+        // Holding _writeMutex across the swap keeps batches in append order
+        // when Commit races the background thread.
+        std::lock_guard write{_writeMutex};
+        {
+            std::lock_guard lock{_mutex};
+            batch.swap(_pending);
+        }
+
+        if (!batch.empty())
+            Write(batch);
+    }
+
+    void Journal::Run(std::stop_token st) {
+        while (!st.stop_requested()) {
+            {
+                std::unique_lock lock{_mutex};
+                _pendingReady.wait_for(lock, st, GroupCommitInterval, [this] {
+                    return _pending.size() >= GroupCommitBytes;
+                });
+            }
+
+            Commit();
+        }
+    }
+
+    void Journal::Write(const vector<char> &batch) {
+#ifdef POSIX
+        for (size_t done = 0; done < batch.size();) {
+            auto n = write(_fd, batch.data() + done, batch.size() - done);
+
+            if (n < 0) {
+                _failed.store(true, std::memory_order_relaxed);
+                return;
+            }
+            done += static_cast<size_t>(n);
+        }
+
+        if (fdatasync(_fd) != 0)
+            _failed.store(true, std::memory_order_relaxed);
+#else
+        if (std::fwrite(batch.data(), 1, batch.size(), _file) != batch.size() || std::fflush(_file) != 0)
+            _failed.store(true, std::memory_order_relaxed);
+#endif
+    }
+}
@@ -0,0 +1,401 @@
+module;
+
+#include <cmath>
+#include <span>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <limits>
+
+export module CalcBackend_MathKernels;
+
+using std::span;
+
+namespace Calculator {
+
+    // How closely the double precision transcendental functions track the exact
+    // result. Fast and Balanced evaluate the polynomial kernels below, written
+    // as straight-line code so the bulk loops compile to SIMD; Precise, the
+    // default, calls the C library for every element. Worst errors seen against
+    // an extended precision reference (Benchmarks/MathKernelsAccuracy.cpp):
+    //
+    //     Fast       sin, cos, atan < 2 ULP; tan, asin, acos < 3.5 ULP;
+    //                pow loses about log2|y ln x| bits
+    //     Balanced   sin, cos, atan < 1 ULP; tan, asin, acos < 2.5 ULP;
+    //                pow is the C library's
+    //     Precise    the C library's (glibc: < 1 ULP)
+    //
+    // Only Precise is faithfully rounded for every function.
+    //
+    // Arguments the kernels do not cover (|x| > 1e5 for the trigonometric
+    // functions, NaN, infinities) always go to the C library.
+    export enum class MathAccuracy {
+        Fast, Balanced, Precise
+    };
+
+    namespace {
+        std::atomic<MathAccuracy> accuracy{MathAccuracy::Precise};
+    }
+
+    export void SetMathAccuracy(MathAccuracy a) {
+        accuracy.store(a, std::memory_order_relaxed);
+    }
+
+    export MathAccuracy GetMathAccuracy() {
+        return accuracy.load(std::memory_order_relaxed);
+    }
+
+    namespace {
+        // Cody-Waite split of pi/2: Pio2_1 and Pio2_2 have 33 significant bits,
+        // so n * Pio2_1 and n * Pio2_2 are exact for the |n| < 2^20 we reduce.
+        constexpr double InvPio2 = 6.36619772367581382433e-01;
+        constexpr double Pio2_1 = 1.57079632673412561417e+00;
+        constexpr double Pio2_1t = 6.07710050650619224932e-11;
+        constexpr double Pio2_2 = 6.07710050630396597660e-11;
+        constexpr double Pio2_2t = 2.02226624879595063154e-21;
+        constexpr double ReductionLimit = 1e5;
+
+        // Adding and subtracting 1.5 * 2^52 rounds to the nearest integer in the
+        // current rounding mode without a library call.
+        constexpr double RoundShift = 6755399441055744.0;
+
+        // Minimax polynomials from FreeBSD's msun (k_sin.c, k_cos.c, s_atan.c,
+        // e_log.c, e_exp.c).
+        constexpr double S1 = -1.66666666666666324348e-01;
+        constexpr double S2 = 8.33333333332248946124e-03;
+        constexpr double S3 = -1.98412698298579493134e-04;
+        constexpr double S4 = 2.75573137070700676789e-06;
+        constexpr double S5 = -2.50507602534068634195e-08;
+        constexpr double S6 = 1.58969099521155010221e-10;
+
+        constexpr double C1 = 4.16666666666666019037e-02;
+        constexpr double C2 = -1.38888888888741095749e-03;
+        constexpr double C3 = 2.48015872894767294178e-05;
+        constexpr double C4 = -2.75573143513906633035e-07;
+        constexpr double C5 = 2.08757232129817482790e-09;
+        constexpr double C6 = -1.13596475577881948265e-11;
+
+        constexpr double AT[] = {
+                3.33333333333329318027e-01, -1.99999999998764832476e-01,
+                1.42857142725034663711e-01, -1.11111104054623557880e-01,
+                9.09088713343650656196e-02, -7.69187620504482999495e-02,
+                6.66107313738753120669e-02, -5.83357013379057348645e-02,
+                4.97687799461593236017e-02, -3.65315727442169155270e-02,
+                1.62858201153657823623e-02
+        };
+
+        // atan(1/2), atan(1), atan(3/2) and atan(inf), split into hi + lo.
+        constexpr double AtanHi[] = {
+                4.63647609000806093515e-01, 7.85398163397448278999e-01,
+                9.82793723247329054082e-01, 1.57079632679489655800e+00
+        };
+
+        constexpr double AtanLo[] = {
+                2.26987774529616870924e-17, 3.06161699786838301793e-17,
+                1.39033110312309984516e-17, 6.12323399573676603587e-17
+        };
+
+        constexpr double Lg1 = 6.666666666666735130e-01;
+        constexpr double Lg2 = 3.999999999940941908e-01;
+        constexpr double Lg3 = 2.857142874366239149e-01;
+        constexpr double Lg4 = 2.222219843214978396e-01;
+        constexpr double Lg5 = 1.818357216161805012e-01;
+        constexpr double Lg6 = 1.531383769920937332e-01;
+        constexpr double Lg7 = 1.479819860511658591e-01;
+
+        constexpr double P1 = 1.66666666666666019037e-01;
+        constexpr double P2 = -2.77777777770155933842e-03;
+        constexpr double P3 = 6.61375632143793436117e-05;
+        constexpr double P4 = -1.65339022054652515390e-06;
+        constexpr double P5 = 4.13813679705723846039e-08;
+
+        constexpr double Ln2Hi = 6.93147180369123816490e-01;
+        constexpr double Ln2Lo = 1.90821492927058770002e-10;
+        constexpr double InvLn2 = 1.44269504088896338700e+00;
+        constexpr double ExpLimit = 708.;
+
+        // x reduced to r + rr, |r| <= pi/4, in quadrant q (mod 4).
+        struct Reduced {
+            double r;
+            double rr;
+            int q;
+        };
+
+        template<MathAccuracy A>
+        Reduced ReduceHalfPi(double x) {
+            const double n = (x * InvPio2 + RoundShift) - RoundShift;
+            const int q = static_cast<int>(n);
+
+            if constexpr (A == MathAccuracy::Fast) {
+                return {(x - n * Pio2_1) - n * Pio2_1t, 0., q};
+            } else {
+                const double t = x - n * Pio2_1;
+                const double w = n * Pio2_2;
+                const double y = t - w;
+                const double lo = ((t - y) - w) - n * Pio2_2t;
+                const double r = y + lo;
+
+                return {r, (y - r) + lo, q};
+            }
+        }
+
+        template<MathAccuracy A>
+        double SinPoly(double x, double y) {
+            const double z = x * x;
+            const double w = z * z;
+            const double r = S2 + z * (S3 + z * S4) + z * w * (S5 + z * S6);
+            const double v = z * x;
+
+            if constexpr (A == MathAccuracy::Fast)
+                return x + v * (S1 + z * r);
+            else
+                return x - ((z * (0.5 * y - v * r) - y) - v * S1);
+        }
+
+        template<MathAccuracy A>
+        double CosPoly(double x, double y) {
+            const double z = x * x;
+            const double w = z * z;
+            const double r = z * (C1 + z * (C2 + z * C3)) + w * w * (C4 + z * (C5 + z * C6));
+            const double hz = 0.5 * z;
+            const double h = 1. - hz;
+
+            if constexpr (A == MathAccuracy::Fast)
+                return h + z * r;
+            else
+                return h + (((1. - h) - hz) + (z * r - x * y));
+        }
+
+        // x * (s1 + s2), the correction to atan(x) ~ x.
+        double AtanPoly(double x) {
+            const double z = x * x;
+            const double w = z * z;
+            const double s1 = z * (AT[0] + w * (AT[2] + w * (AT[4] + w * (AT[6] + w * (AT[8] + w * AT[10])))));
+            const double s2 = w * (AT[1] + w * (AT[3] + w * (AT[5] + w * (AT[7] + w * AT[9]))));
+
+            return x * (s1 + s2);
+        }
+
+        // Each kernel is evaluated branch-free (the conditionals become selects),
+        // for |x| <= Limit.
+        struct SinKernel {
+            static constexpr double Limit = ReductionLimit;
+
+            template<MathAccuracy A>
+            static double Eval(double x) {
+                const auto [r, rr, q] = ReduceHalfPi<A>(x);
+                const double s = SinPoly<A>(r, rr);
+                const double c = CosPoly<A>(r, rr);
+                const double v = (q & 1) ? c : s;
+                const double sin = (q & 2) ? -v : v;
+
+                // The reduction and polynomial sums turn -0 into +0.
+                return x == 0. ? x : sin;
+            }
+
+            static double Libm(double x) { return std::sin(x); }
+        };
+
+        struct CosKernel {
+            static constexpr double Limit = ReductionLimit;
+
+            template<MathAccuracy A>
+            static double Eval(double x) {
+                const auto [r, rr, q] = ReduceHalfPi<A>(x);
+                const double s = SinPoly<A>(r, rr);
+                const double c = CosPoly<A>(r, rr);
+                const double v = (q & 1) ? s : c;
+
+                return ((q + 1) & 2) ? -v : v;
+            }
+
+            static double Libm(double x) { return std::cos(x); }
+        };
+
+        struct TanKernel {
+            static constexpr double Limit = ReductionLimit;
+
+            template<MathAccuracy A>
+            static double Eval(double x) {
+                const auto [r, rr, q] = ReduceHalfPi<A>(x);
+                const double s = SinPoly<A>(r, rr);
+                const double c = CosPoly<A>(r, rr);
+                const double tan = (q & 1) ? -c / s : s / c;
+
+                return x == 0. ? x : tan;
+            }
+
+            static double Libm(double x) { return std::tan(x); }
+        };
+
+        // atan(|x|) = atan(c) + atan((|x| - c) / (1 + c|x|)) for c = 0, 1/2, 1,
+        // 3/2 and (as c -> inf) pi/2 + atan(-1/|x|), choosing c by |x| so the
+        // polynomial argument stays below 7/16.
+        struct AtanKernel {
+            static constexpr double Limit = std::numeric_limits<double>::max();
+
+            template<MathAccuracy A>
+            static double Eval(double x) {
+                const double a = std::fabs(x);
+                const bool b1 = a >= 0.4375, b2 = a >= 0.6875, b3 = a >= 1.1875, b4 = a >= 2.4375;
+                const double c = b3 ? 1.5 : b2 ? 1. : b1 ? 0.5 : 0.;
+                const double hi = b4 ? AtanHi[3] : b3 ? AtanHi[2] : b2 ? AtanHi[1] : b1 ? AtanHi[0] : 0.;
+                const double lo = b4 ? AtanLo[3] : b3 ? AtanLo[2] : b2 ? AtanLo[1] : b1 ? AtanLo[0] : 0.;
+                const double u = b4 ? -1. / a : (a - c) / (1. + c * a);
+                const double p = AtanPoly(u);
+                double r;
+
+                if constexpr (A == MathAccuracy::Fast)
+                    r = hi + (u - p);
+                else
+                    r = hi - ((p - lo) - u);
+
+                return std::copysign(r, x);
+            }
+
+            static double Libm(double x) { return std::atan(x); }
+        };
+
+        struct AsinKernel {
+            static constexpr double Limit = 1.;
+
+            template<MathAccuracy A>
+            static double Eval(double x) {
+                return AtanKernel::Eval<A>(x / std::sqrt((1. - x) * (1. + x)));
+            }
+
+            static double Libm(double x) { return std::asin(x); }
+        };
+
+        struct AcosKernel {
+            static constexpr double Limit = 1.;
+
+            template<MathAccuracy A>
+            static double Eval(double x) {
+                return 2. * AtanKernel::Eval<A>(std::sqrt((1. - x) / (1. + x)));
+            }
+
+            static double Libm(double x) { return std::acos(x); }
+        };
+
+        // Natural log of a positive normal x.
+        double LogKernel(double x) {
+            const auto bits = std::bit_cast<std::uint64_t>(x);
+            int k = static_cast<int>(bits >> 52) - 1023;
+            double m = std::bit_cast<double>((bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+
+            if (m > 1.41421356237309504880) {
+                m *= 0.5;
+                ++k;
+            }
+
+            const double f = m - 1.;
+            const double hfsq = 0.5 * f * f;
+            const double s = f / (2. + f);
+            const double z = s * s;
+            const double w = z * z;
+            const double t1 = w * (Lg2 + w * (Lg4 + w * Lg6));
+            const double t2 = z * (Lg1 + w * (Lg3 + w * (Lg5 + w * Lg7)));
+            const double dk = k;
+
+            return dk * Ln2Hi - ((hfsq - (s * (hfsq + t2 + t1) + dk * Ln2Lo)) - f);
+        }
+
+        // e^x for |x| <= ExpLimit.
+        double ExpKernel(double x) {
+            const double n = (x * InvLn2 + RoundShift) - RoundShift;
+            const double hi = x - n * Ln2Hi;
+            const double lo = n * Ln2Lo;
+            const double r = hi - lo;
+            const double t = r * r;
+            const double c = r - t * (P1 + t * (P2 + t * (P3 + t * (P4 + t * P5))));
+            const double y = 1. - ((lo - (r * c) / (2. - c)) - hi);
+            const auto scale = static_cast<std::uint64_t>(static_cast<int>(n) + 1023) << 52;
+
+            return y * std::bit_cast<double>(scale);
+        }
+
+        template<typename K>
+        double Evaluate(double x) {
+            // Written so NaN fails the test and goes to the library.
+            if (!(std::fabs(x) <= K::Limit))
+                return K::Libm(x);
+
+            switch (GetMathAccuracy()) {
+                case MathAccuracy::Fast:
+                    return K::template Eval<MathAccuracy::Fast>(x);
+                case MathAccuracy::Balanced:
+                    return K::template Eval<MathAccuracy::Balanced>(x);
+                default:
+                    return K::Libm(x);
+            }
+        }
+
+        template<typename K, MathAccuracy A>
+        void EvaluateAll(span<double> v) {
+            bool inRange = true;
+
+            for (double x: v)
+                inRange &= std::fabs(x) <= K::Limit;
+
+            if (inRange) {
+                for (double &x: v)
+                    x = K::template Eval<A>(x);
+            } else {
+                for (double &x: v)
+                    x = std::fabs(x) <= K::Limit ? K::template Eval<A>(x) : K::Libm(x);
+            }
+        }
+
+        template<typename K>
+        void EvaluateAll(span<double> v) {
+            switch (GetMathAccuracy()) {
+                case MathAccuracy::Fast:
+                    EvaluateAll<K, MathAccuracy::Fast>(v);
+                    break;
+                case MathAccuracy::Balanced:
+                    EvaluateAll<K, MathAccuracy::Balanced>(v);
+                    break;
+                default:
+                    for (double &x: v)
+                        x = K::Libm(x);
+            }
+        }
+    }
+
+    export double Sin(double x) { return Evaluate<SinKernel>(x); }
+
+    export double Cos(double x) { return Evaluate<CosKernel>(x); }
+
+    export double Tan(double x) { return Evaluate<TanKernel>(x); }
+
+    export double Asin(double x) { return Evaluate<AsinKernel>(x); }
+
+    export double Acos(double x) { return Evaluate<AcosKernel>(x); }
+
+    export double Atan(double x) { return Evaluate<AtanKernel>(x); }
+
+    // In place over a whole span, reading the accuracy once.
+    export void Sin(span<double> v) { EvaluateAll<SinKernel>(v); }
+
+    export void Cos(span<double> v) { EvaluateAll<CosKernel>(v); }
+
+    export void Tan(span<double> v) { EvaluateAll<TanKernel>(v); }
+
+    export void Asin(span<double> v) { EvaluateAll<AsinKernel>(v); }
+
+    export void Acos(span<double> v) { EvaluateAll<AcosKernel>(v); }
+
+    export void Atan(span<double> v) { EvaluateAll<AtanKernel>(v); }
+
+    export double Pow(double x, double y) {
+        if (GetMathAccuracy() != MathAccuracy::Fast)
+            return std::pow(x, y);
+
+        if (!(x > 0.) || x < std::numeric_limits<double>::min() || !std::isfinite(x) || !std::isfinite(y))
+            return std::pow(x, y);
+
+        const double t = y * LogKernel(x);
+        return std::fabs(t) <= ExpLimit ? ExpKernel(t) : std::pow(x, y);
+    }
+}
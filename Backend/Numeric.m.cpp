@@ -0,0 +1,659 @@
+module;
+
+#include <cmath>
+#include <string>
+#include <format>
+#include <compare>
+#include <cstdlib>
+#include <limits>
+#include <algorithm>
+#include <utility>
+#include <type_traits>
+#include <charconv>
+#include <concepts>
+#include <cstdint>
+#include <system_error>
+#include "../Utilities/Exception.h"
+
+export module CalcBackend_Numeric;
+
+import CalcBackend_Value;
+
+using std::string;
+
+namespace Calculator {
+
+    // Number representation a calculator session runs in. Double is the
+    // default and the fast path; LongDouble and DoubleDouble trade speed for
+    // precision, and Complex stacks hold real, complex and vector Values.
+    export enum class NumberMode {
+        Double, LongDouble, DoubleDouble, Complex
+    };
+
+    export inline constexpr size_t NumberModeCount = 4;
+
+    // Unevaluated sum of two doubles, giving about 106 bits (32 decimal digits)
+    // of significand with plain double hardware arithmetic. The algorithms
+    // follow Hida, Li and Bailey's QD library.
+    export class DoubleDouble {
+    public:
+        constexpr DoubleDouble() : _hi{0.}, _lo{0.} {}
+
+        constexpr DoubleDouble(double d) : _hi{d}, _lo{0.} {}
+
+        constexpr DoubleDouble(double hi, double lo) : _hi{hi}, _lo{lo} {}
+
+        explicit constexpr operator double() const { return _hi; }
+
+        constexpr double Hi() const { return _hi; }
+
+        constexpr double Lo() const { return _lo; }
+
+        friend DoubleDouble operator+(DoubleDouble a, DoubleDouble b);
+
+        friend DoubleDouble operator*(DoubleDouble a, DoubleDouble b);
+
+        friend DoubleDouble operator/(DoubleDouble a, DoubleDouble b);
+
+        friend constexpr DoubleDouble operator-(DoubleDouble a) { return {-a._hi, -a._lo}; }
+
+        friend DoubleDouble operator-(DoubleDouble a, DoubleDouble b) { return a + -b; }
+
+        DoubleDouble &operator+=(DoubleDouble b) { return *this = *this + b; }
+
+        DoubleDouble &operator-=(DoubleDouble b) { return *this = *this - b; }
+
+        DoubleDouble &operator*=(DoubleDouble b) { return *this = *this * b; }
+
+        DoubleDouble &operator/=(DoubleDouble b) { return *this = *this / b; }
+
+        friend constexpr bool operator==(DoubleDouble a, DoubleDouble b) { return a._hi == b._hi && a._lo == b._lo; }
+
+        friend constexpr std::partial_ordering operator<=>(DoubleDouble a, DoubleDouble b) {
+            auto c = a._hi <=> b._hi;
+            return c != 0 ? c : a._lo <=> b._lo;
+        }
+
+        static DoubleDouble Parse(const string &s);
+
+        string ToString() const;
+
+    private:
+        double _hi;
+        double _lo;
+    };
+
+    export inline constexpr DoubleDouble DdPi{3.141592653589793116e+00, 1.224646799147353207e-16};
+    export inline constexpr DoubleDouble DdHalfPi{1.570796326794896558e+00, 6.123233995736766036e-17};
+    export inline constexpr DoubleDouble DdTwoPi{6.283185307179586232e+00, 2.449293598294706414e-16};
+    export inline constexpr DoubleDouble DdLn2{6.931471805599452862e-01, 2.319046813846299558e-17};
+
+    namespace {
+        constexpr double DdEps = 4.93038065763132e-32; // 2^-104
+
+        DoubleDouble QuickTwoSum(double a, double b) {
+            double s = a + b;
+            return {s, b - (s - a)};
+        }
+
+        DoubleDouble TwoSum(double a, double b) {
+            double s = a + b;
+            double bb = s - a;
+            return {s, (a - (s - bb)) + (b - bb)};
+        }
+
+        DoubleDouble TwoProd(double a, double b) {
+            double p = a * b;
+            return {p, std::fma(a, b, -p)};
+        }
+
+        DoubleDouble Ldexp(DoubleDouble a, int e) {
+            return {std::ldexp(a.Hi(), e), std::ldexp(a.Lo(), e)};
+        }
+
+        DoubleDouble Round(DoubleDouble a);
+    }
+
+    DoubleDouble operator+(DoubleDouble a, DoubleDouble b) {
+        auto s = TwoSum(a._hi, b._hi);
+        auto t = TwoSum(a._lo, b._lo);
+        s = QuickTwoSum(s._hi, s._lo + t._hi);
+        return QuickTwoSum(s._hi, s._lo + t._lo);
+    }
+
+    DoubleDouble operator*(DoubleDouble a, DoubleDouble b) {
+        auto p = TwoProd(a._hi, b._hi);
+        return QuickTwoSum(p._hi, p._lo + (a._hi * b._lo + a._lo * b._hi));
+    }
+
+    DoubleDouble operator/(DoubleDouble a, DoubleDouble b) {
+        double q1 = a._hi / b._hi;
+        auto r = a - b * q1;
+        double q2 = r._hi / b._hi;
+        r -= b * q2;
+        double q3 = r._hi / b._hi;
+        return QuickTwoSum(q1, q2) + q3;
+    }
+
+    export DoubleDouble fabs(DoubleDouble a) {
+        return a.Hi() < 0. ? -a : a;
+    }
+
+    export DoubleDouble floor(DoubleDouble a) {
+        double hi = std::floor(a.Hi());
+        double lo = 0.;
+
+        if (hi == a.Hi())
+            lo = std::floor(a.Lo());
+
+        return QuickTwoSum(hi, lo);
+    }
+
+    export DoubleDouble sqrt(DoubleDouble a) {
+        if (a.Hi() <= 0.)
+            return a.Hi() == 0. ? DoubleDouble{} : DoubleDouble{std::nan("")};
+
+        // One Newton step from the double estimate doubles its precision.
+        double x = 1. / std::sqrt(a.Hi());
+        double ax = a.Hi() * x;
+        return TwoSum(ax, (a - TwoProd(ax, ax)).Hi() * (x * 0.5));
+    }
+
+    export DoubleDouble exp(DoubleDouble a) {
+        if (a.Hi() > 709.)
+            return std::numeric_limits<double>::infinity();
+
+        if (a.Hi() < -745.)
+            return 0.;
+
+        // a = k ln2 + r with |r| <= ln2 / 2; the Taylor series runs on r / 512
+        // and the result is squared back up.
+        double k = std::floor(a.Hi() / DdLn2.Hi() + 0.5);
+        auto r = Ldexp(a - DdLn2 * k, -9);
+
+        DoubleDouble sum = r;
+        DoubleDouble term = r;
+
+        for (int n = 2; std::fabs(term.Hi()) > DdEps * std::fabs(sum.Hi()); ++n) {
+            term = term * r / static_cast<double>(n);
+            sum += term;
+        }
+
+        // exp(r) - 1 is squared as (s^2 + 2s) to keep the small terms.
+        for (int i = 0; i < 9; ++i)
+            sum = sum * sum + Ldexp(sum, 1);
+
+        return Ldexp(sum + 1., static_cast<int>(k));
+    }
+
+    export DoubleDouble log(DoubleDouble a) {
+        if (a.Hi() <= 0.)
+            return a.Hi() == 0. ? -std::numeric_limits<double>::infinity() : std::nan("");
+
+        // Newton iteration x' = x + a exp(-x) - 1 from the double estimate.
+        DoubleDouble x = std::log(a.Hi());
+        return x + a * exp(-x) - 1.;
+    }
+
+    namespace {
+        DoubleDouble Round(DoubleDouble a) {
+            return floor(a + 0.5);
+        }
+
+        // Taylor series for |t| <= pi/4.
+        DoubleDouble SinTaylor(DoubleDouble t) {
+            auto t2 = -(t * t);
+            DoubleDouble sum = t;
+            DoubleDouble term = t;
+
+            for (int n = 3; std::fabs(term.Hi()) > DdEps * std::fabs(sum.Hi()) && term.Hi() != 0.; n += 2) {
+                term = term * t2 / static_cast<double>((n - 1) * n);
+                sum += term;
+            }
+            return sum;
+        }
+
+        DoubleDouble CosTaylor(DoubleDouble t) {
+            auto t2 = -(t * t);
+            DoubleDouble sum = 1.;
+            DoubleDouble term = 1.;
+
+            for (int n = 2; std::fabs(term.Hi()) > DdEps; n += 2) {
+                term = term * t2 / static_cast<double>((n - 1) * n);
+                sum += term;
+            }
+            return sum;
+        }
+
+        // Reduces a to t in [-pi/4, pi/4] and the quadrant j in [0, 3].
+        std::pair<DoubleDouble, int> ReduceHalfPi(DoubleDouble a) {
+            auto r = a - DdTwoPi * Round(a / DdTwoPi);
+            auto q = Round(r / DdHalfPi);
+            auto t = r - DdHalfPi * q;
+            int j = static_cast<int>(q.Hi());
+
+            return {t, (j % 4 + 4) % 4};
+        }
+
+        std::pair<DoubleDouble, DoubleDouble> SinCos(DoubleDouble a) {
+            auto [t, j] = ReduceHalfPi(a);
+            auto s = SinTaylor(t);
+            auto c = CosTaylor(t);
+
+            switch (j) {
+                case 0:
+                    return {s, c};
+                case 1:
+                    return {c, -s};
+                case 2:
+                    return {-s, -c};
+                default:
+                    return {-c, s};
+            }
+        }
+
+        DoubleDouble Atan2(DoubleDouble y, DoubleDouble x) {
+            if (x.Hi() == 0. && y.Hi() == 0.)
+                return 0.;
+
+            // One Newton step on the double estimate z, using the normalised
+            // point (xx, yy) on the unit circle.
+            auto r = sqrt(x * x + y * y);
+            auto xx = x / r;
+            auto yy = y / r;
+            DoubleDouble z = std::atan2(y.Hi(), x.Hi());
+            auto [s, c] = SinCos(z);
+
+            if (std::fabs(xx.Hi()) > std::fabs(yy.Hi()))
+                return z + (yy - s) / c;
+            else
+                return z - (xx - c) / s;
+        }
+    }
+
+    export DoubleDouble sin(DoubleDouble a) {
+        return SinCos(a).first;
+    }
+
+    export DoubleDouble cos(DoubleDouble a) {
+        return SinCos(a).second;
+    }
+
+    export DoubleDouble tan(DoubleDouble a) {
+        auto [s, c] = SinCos(a);
+        return s / c;
+    }
+
+    export DoubleDouble atan(DoubleDouble a) {
+        return Atan2(a, 1.);
+    }
+
+    export DoubleDouble asin(DoubleDouble a) {
+        if (fabs(a) > 1.)
+            return std::nan("");
+
+        return Atan2(a, sqrt(1. - a * a));
+    }
+
+    export DoubleDouble acos(DoubleDouble a) {
+        if (fabs(a) > 1.)
+            return std::nan("");
+
+        return Atan2(sqrt(1. - a * a), a);
+    }
+
+    export DoubleDouble pow(DoubleDouble a, DoubleDouble b) {
+        if (b == 0.)
+            return 1.;
+
+        if (a == 0.)
+            return b.Hi() > 0. ? 0. : std::numeric_limits<double>::infinity();
+
+        return exp(b * log(a));
+    }
+
+    namespace {
+        // Largest power of ten a conversion scales by in one step, well
+        // inside the range of double.
+        constexpr int MaxScale = 300;
+
+        // Beyond this, every mantissa a double can hold scales to zero or
+        // infinity, so larger exponents are capped to it.
+        constexpr int MaxExponent = 1000;
+
+        // 10^e for 0 <= e <= MaxScale by squaring, a few multiplications
+        // whatever e is.
+        DoubleDouble PowerOfTen(int e) {
+            DoubleDouble p = 1.;
+            DoubleDouble base = 10.;
+
+            for (;;) {
+                if (e & 1)
+                    p *= base;
+
+                if ((e >>= 1) == 0)
+                    return p;
+
+                base *= base;
+            }
+        }
+
+        // r * 10^e in steps of at most 10^MaxScale, so no power of ten on
+        // the way overflows even when r is subnormal or the result is. A
+        // product past the range of double comes out of the error term as
+        // NaN, so it is made the infinity it is.
+        DoubleDouble ScaleByPowerOfTen(DoubleDouble r, int e) {
+            const double sign = r.Hi();
+
+            for (; e > MaxScale; e -= MaxScale)
+                r *= PowerOfTen(MaxScale);
+
+            for (; e < -MaxScale; e += MaxScale)
+                r /= PowerOfTen(MaxScale);
+
+            r = e < 0 ? r / PowerOfTen(-e) : r * PowerOfTen(e);
+
+            if (std::isnan(r.Hi()) && !std::isnan(sign))
+                return std::copysign(std::numeric_limits<double>::infinity(), sign);
+
+            return r;
+        }
+    }
+
+    DoubleDouble DoubleDouble::Parse(const string &s) {
+        DoubleDouble r;
+        int exponent{0};
+        bool negative{false};
+        bool fraction{false};
+        size_t i{0};
+
+        if (i < s.size() && (s[i] == '+' || s[i] == '-'))
+            negative = s[i++] == '-';
+
+        // As ToString prints non-finite values.
+        if (s.compare(i, string::npos, "inf") == 0)
+            return negative ? -std::numeric_limits<double>::infinity() : std::numeric_limits<double>::infinity();
+
+        if (s.compare(i, string::npos, "nan") == 0)
+            return std::nan("");
+
+        for (; i < s.size(); ++i) {
+            if (s[i] >= '0' && s[i] <= '9') {
+                r = r * 10. + static_cast<double>(s[i] - '0');
+
+                if (fraction)
+                    --exponent;
+            } else if (s[i] == '.' && !fraction)
+                fraction = true;
+            else if (s[i] == 'e' || s[i] == 'E') {
+                auto first = s.data() + i + 1;
+                const auto last = s.data() + s.size();
+                long e{0};
+
+                if (first != last && *first == '+')
+                    ++first;
+
+                auto [end, ec] = std::from_chars(first, last, e);
+
+                if (ec == std::errc::result_out_of_range)
+                    e = *first == '-' ? -MaxExponent : MaxExponent;
+                else if (ec != std::errc{} || end != last)
+                    throw Exception{std::format("{} is not a number", s)};
+
+                e = std::clamp(e, long{-MaxExponent}, long{MaxExponent});
+                exponent = static_cast<int>(std::clamp(exponent + e, long{-MaxExponent}, long{MaxExponent}));
+                break;
+            } else
+                throw Exception{std::format("{} is not a number", s)};
+        }
+
+        r = ScaleByPowerOfTen(r, exponent);
+        return negative ? -r : r;
+    }
+
+    string DoubleDouble::ToString() const {
+        constexpr int Digits = 32;
+
+        if (!std::isfinite(_hi))
+            return std::format("{}", _hi);
+
+        if (_hi == 0.)
+            return "0";
+
+        auto r = fabs(*this);
+        int exponent = static_cast<int>(std::floor(std::log10(r.Hi())));
+
+        r = ScaleByPowerOfTen(r, -exponent);
+
+        // log10 of the leading double can be off by one near powers of ten.
+        if (r.Hi() >= 10.) {
+            r /= 10.;
+            ++exponent;
+        } else if (r.Hi() < 1.) {
+            r *= 10.;
+            --exponent;
+        }
+
+        string digits;
+        for (int i = 0; i < Digits; ++i) {
+            const auto d = static_cast<int>(std::clamp(r.Hi(), 0., 9.));
+            digits += static_cast<char>('0' + d);
+            r = (r - static_cast<double>(d)) * 10.;
+        }
+
+        // Round on the last digit and trim trailing zeros.
+        if (r.Hi() >= 5.) {
+            int i = Digits - 1;
+            for (; i >= 0 && digits[i] == '9'; --i)
+                digits[i] = '0';
+
+            if (i >= 0)
+                ++digits[i];
+            else {
+                digits.insert(digits.begin(), '1');
+                digits.pop_back();
+                ++exponent;
+            }
+        }
+
+        while (digits.size() > 1 && digits.back() == '0')
+            digits.pop_back();
+
+        string s = _hi < 0. ? "-" : "";
+
+        if (exponent >= 0 && exponent < Digits) {
+            if (digits.size() <= static_cast<size_t>(exponent))
+                digits.append(exponent + 1 - digits.size(), '0');
+
+            s += digits.substr(0, exponent + 1);
+
+            if (digits.size() > static_cast<size_t>(exponent + 1))
+                s += "." + digits.substr(exponent + 1);
+        } else if (exponent < 0 && exponent >= -5) {
+            s += "0." + string(-exponent - 1, '0') + digits;
+        } else {
+            s += digits.substr(0, 1);
+
+            if (digits.size() > 1)
+                s += "." + digits.substr(1);
+
+            s += std::format("e{}", exponent);
+        }
+
+        return s;
+    }
+
+    // How numbers are displayed. Shortest is the shortest text that reads
+    // back as the same number; Fixed, Scientific and General take a precision
+    // as printf's %f, %e and %g do.
+    export struct NumberFormat {
+        enum class Notation : std::uint8_t {
+            Shortest, Fixed, Scientific, General
+        };
+
+        Notation notation{Notation::Shortest};
+        int precision{6};
+    };
+
+    // Appends v to out with std::to_chars, growing out until the text fits.
+    export template<std::floating_point F>
+    void AppendNumber(string &out, F v, NumberFormat format) {
+        const auto begin = out.size();
+        const auto precision = std::max(format.precision, 0);
+
+        for (size_t room = 32;; room *= 4) {
+            out.resize(begin + room);
+
+            auto first = out.data() + begin, last = out.data() + out.size();
+            std::to_chars_result r;
+
+            switch (format.notation) {
+                case NumberFormat::Notation::Fixed:
+                    r = std::to_chars(first, last, v, std::chars_format::fixed, precision);
+                    break;
+                case NumberFormat::Notation::Scientific:
+                    r = std::to_chars(first, last, v, std::chars_format::scientific, precision);
+                    break;
+                case NumberFormat::Notation::General:
+                    r = std::to_chars(first, last, v, std::chars_format::general, precision);
+                    break;
+                default:
+                    r = std::to_chars(first, last, v);
+                    break;
+            }
+
+            if (r.ec == std::errc{}) {
+                out.resize(static_cast<size_t>(r.ptr - out.data()));
+                return;
+            }
+        }
+    }
+
+    // Same value and same sign of zero, so both display alike; NaNs never
+    // compare identical.
+    template<std::floating_point F>
+    bool IdenticalNumbers(F a, F b) {
+        return a == b && std::signbit(a) == std::signbit(b);
+    }
+
+    // Per-type constants, parsing and display used by the templated stack and
+    // commands. Format appends a number's display text to a string; Identical
+    // tells whether two numbers display alike, without formatting them.
+    export template<typename T>
+    struct NumberTraits;
+
+    export template<>
+    struct NumberTraits<double> {
+        static constexpr NumberMode Mode = NumberMode::Double;
+
+        static double Pi() { return M_PI; }
+
+        static double Parse(const string &s) { return std::stod(s); }
+
+        static string ToString(double d) { return std::format("{}", d); }
+
+        static void Format(string &out, double d, NumberFormat format) { AppendNumber(out, d, format); }
+
+        static bool Identical(double a, double b) { return IdenticalNumbers(a, b); }
+    };
+
+    export template<>
+    struct NumberTraits<long double> {
+        static constexpr NumberMode Mode = NumberMode::LongDouble;
+
+        static long double Pi() { return 3.141592653589793238462643383279502884L; }
+
+        static long double Parse(const string &s) { return std::stold(s); }
+
+        static string ToString(long double d) { return std::format("{}", d); }
+
+        static void Format(string &out, long double d, NumberFormat format) { AppendNumber(out, d, format); }
+
+        static bool Identical(long double a, long double b) { return IdenticalNumbers(a, b); }
+    };
+
+    // Always displayed with all 32 significant digits; format is not used.
+    export template<>
+    struct NumberTraits<DoubleDouble> {
+        static constexpr NumberMode Mode = NumberMode::DoubleDouble;
+
+        static DoubleDouble Pi() { return DdPi; }
+
+        static DoubleDouble Parse(const string &s) { return DoubleDouble::Parse(s); }
+
+        static string ToString(DoubleDouble d) { return d.ToString(); }
+
+        static void Format(string &out, DoubleDouble d, NumberFormat) { out += d.ToString(); }
+
+        static bool Identical(DoubleDouble a, DoubleDouble b) {
+            return IdenticalNumbers(a.Hi(), b.Hi()) && IdenticalNumbers(a.Lo(), b.Lo());
+        }
+    };
+
+    // Formats every part of the value as Value::ToString does, with format
+    // applied to each.
+    export template<>
+    struct NumberTraits<Value> {
+        static constexpr NumberMode Mode = NumberMode::Complex;
+
+        static Value Pi() { return M_PI; }
+
+        static Value Parse(const string &s) { return Value::Parse(s); }
+
+        static string ToString(const Value &v) { return v.ToString(); }
+
+        static void Format(string &out, const Value &v, NumberFormat format) {
+            switch (v.GetKind()) {
+                case Value::Kind::Complex:
+                    out += '(';
+                    AppendNumber(out, v.Complex().real(), format);
+                    out += ',';
+                    AppendNumber(out, v.Complex().imag(), format);
+                    out += ')';
+                    break;
+                case Value::Kind::Vector:
+                    out += '[';
+
+                    for (size_t i = 0; i < v.Components().size(); ++i) {
+                        if (i > 0)
+                            out += ',';
+
+                        AppendNumber(out, v.Components()[i], format);
+                    }
+                    out += ']';
+                    break;
+                default:
+                    AppendNumber(out, v.Real(), format);
+                    break;
+            }
+        }
+
+        static bool Identical(const Value &a, const Value &b) {
+            if (a.GetKind() != b.GetKind())
+                return false;
+
+            if (a.IsVector())
+                return std::ranges::equal(a.Components(), b.Components(), IdenticalNumbers<double>);
+
+            return IdenticalNumbers(a.Complex().real(), b.Complex().real())
+                   && IdenticalNumbers(a.Complex().imag(), b.Complex().imag());
+        }
+    };
+
+    // Calls f with std::type_identity<T> for the number type of mode, so code
+    // that only knows the mode at run time can reach the templated engine.
+    export template<typename F>
+    decltype(auto) VisitNumberMode(NumberMode mode, F &&f) {
+        switch (mode) {
+            case NumberMode::LongDouble:
+                return f(std::type_identity<long double>{});
+            case NumberMode::DoubleDouble:
+                return f(std::type_identity<DoubleDouble>{});
+            case NumberMode::Complex:
+                return f(std::type_identity<Value>{});
+            case NumberMode::Double:
+            default:
+                return f(std::type_identity<double>{});
+        }
+    }
+}
@@ -4,13 +4,15 @@ module;
 
 export module PlatformFactory;
 
+import DynamicLoader;
+
 namespace Calculator {
 
     export class PlatformFactory {
     public:
         static PlatformFactory& Instance();
         virtual ~PlatformFactory();
-        virtual std::unique_ptr<class DynamicLoader> CreatedDynamicLoader() = 0;
+        virtual std::unique_ptr<DynamicLoader> CreatedDynamicLoader() = 0;
 
     protected:
         PlatformFactory();
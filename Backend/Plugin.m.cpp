@@ -0,0 +1,44 @@
+module;
+
+export module CalcBackend_Plugin;
+
+import CalcBackend_Command;
+
+export namespace Calculator {
+
+    // Interface every plugin library implements. The library exports the C
+    // entry points named by DynamicLoader::GetPluginAllocateName() and
+    // DynamicLoader::GetPluginDeallocateName() to create and destroy it.
+    class Plugin {
+    public:
+        struct PluginDescriptor {
+            int nCommands;
+            char **commandNames;
+            Command **commands;
+        };
+
+        struct ApiVersion {
+            int major;
+            int minor;
+        };
+
+        static constexpr ApiVersion CurrentApiVersion{1, 0};
+
+        Plugin() = default;
+
+        virtual ~Plugin() = default;
+
+        virtual const PluginDescriptor &GetPluginDescriptor() const = 0;
+
+        virtual ApiVersion GetApiVersion() const = 0;
+
+    private:
+        Plugin(const Plugin &) = delete;
+
+        Plugin(Plugin &&) = delete;
+
+        Plugin &operator=(const Plugin &) = delete;
+
+        Plugin &operator=(Plugin &&) = delete;
+    };
+}
@@ -0,0 +1,329 @@
+module;
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <format>
+#include <algorithm>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <filesystem>
+#include "../Utilities/Exception.h"
+
+export module CalcBackend_PluginLoader;
+
+import CalcUtilities;
+import CalcBackend_Command;
+import CalcBackend_CommandFactory;
+import CalcBackend_Plugin;
+import DynamicLoader;
+import PlatformFactory;
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+using std::unordered_map;
+
+namespace fs = std::filesystem;
+
+namespace Calculator {
+
+    // Loads plugin libraries and registers their commands with the
+    // CommandFactory. Each line of a plugin file names a library, optionally
+    // followed by the commands it provides:
+    //
+    //     libhyperbolic.so sinh cosh tanh
+    //     libstats.so
+    //
+    // Libraries that list their commands are mapped lazily, the first time one
+    // of those names is allocated; the others are loaded immediately. Lazy
+    // loading mutates the factory, so load eagerly before sharing the factory
+    // across threads (e.g. with BatchEvaluator).
+    //
+    // Every registered prototype holds a reference to the image it came from,
+    // and so does every clone of it in a CommandManager history. ReloadPlugin
+    // maps a new build next to the running one and stages its prototypes; the
+    // old image is unloaded once nothing references it any more.
+    export class PluginLoader {
+    public:
+        PluginLoader();
+
+        ~PluginLoader();
+
+        void LoadPlugins(const string &pluginFile);
+
+        void LoadPlugin(const string &library);
+
+        void LoadAll();
+
+        // May be called from any thread. Libraries that are not loaded yet are
+        // ignored: they pick up the new build when they are first used. Commands
+        // a new build adds are registered on the next start.
+        void ReloadPlugin(const string &library);
+
+        vector<const Plugin *> GetPlugins() const;
+
+    private:
+        PluginLoader(const PluginLoader &) = delete;
+        PluginLoader(PluginLoader &&) = delete;
+        PluginLoader &operator=(const PluginLoader &) = delete;
+        PluginLoader &operator=(PluginLoader &&) = delete;
+
+        using Image = shared_ptr<const Plugin>;
+
+        struct LoadedPlugin {
+            string library;
+            Image image;
+            vector<string> commands;
+        };
+
+        bool Resolve(const string &command);
+
+        Image MapImage(const string &path);
+
+        static vector<CommandFactory::StagedCommand> Prototypes(const Image &image, const DynamicLoader &loader);
+
+        shared_ptr<DynamicLoader> _loader;
+        mutable std::mutex _mutex;
+        vector<LoadedPlugin> _plugins;
+        unordered_map<string, string> _pending; // command name -> library not mapped yet
+        std::atomic<unsigned> _generation;
+    };
+
+    // Pins the image a plugin prototype (and every clone of it) came from.
+    class PluginImageCommand final : public Command {
+    public:
+        PluginImageCommand(CommandPtr command, shared_ptr<const Plugin> image)
+                : Command{}, _image{std::move(image)}, _command{std::move(command)} {}
+
+        ~PluginImageCommand() = default;
+
+    private:
+        PluginImageCommand(const PluginImageCommand &rhs)
+                : Command{rhs}, _image{rhs._image}, _command{MakeCommandPtr(rhs._command->clone())} {}
+
+        PluginImageCommand(PluginImageCommand &&) = delete;
+
+        PluginImageCommand &operator=(const PluginImageCommand &) = delete;
+
+        PluginImageCommand &operator=(PluginImageCommand &&) = delete;
+
+        const char *checkPreconditionsImp() const noexcept override {
+            auto r = _command->tryCheckPreconditions();
+            return r ? nullptr : r.error();
+        }
+
+        void executeImp() noexcept override { _command->tryExecute(); }
+
+        void undoImp() noexcept override { _command->undo(); }
+
+        PluginImageCommand *cloneImp() const override { return new PluginImageCommand{*this}; }
+
+        const char *helpMessageImp() const noexcept override { return _command->helpMessage(); }
+
+        // Declared first so the plugin's command is destroyed before its image.
+        shared_ptr<const Plugin> _image;
+        CommandPtr _command;
+    };
+
+    PluginLoader::PluginLoader()
+            : _loader{PlatformFactory::Instance().CreatedDynamicLoader()}, _generation{0} {
+        if (!_loader)
+            throw Exception{"Dynamic loading is not supported on this platform"};
+
+        CommandFactory::Instance().SetCommandResolver([this](const string &name) { return Resolve(name); });
+    }
+
+    PluginLoader::~PluginLoader() {
+        auto &cf = CommandFactory::Instance();
+        cf.SetCommandResolver(nullptr);
+
+        for (const auto &p: _plugins) {
+            for (const auto &name: p.commands)
+                cf.DeregisterCommand(name);
+        }
+    }
+
+    void PluginLoader::LoadPlugins(const string &pluginFile) {
+        std::ifstream ifs{pluginFile};
+
+        if (!ifs)
+            throw Exception{std::format("Could not open plugin file {}", pluginFile)};
+
+        for (string line; std::getline(ifs, line);) {
+            Tokenizer tokenizer{line};
+
+            if (tokenizer.NumberTokens() == 0)
+                continue;
+
+            const auto &library = tokenizer[0];
+
+            if (tokenizer.NumberTokens() == 1)
+                LoadPlugin(library);
+            else {
+                std::lock_guard lock{_mutex};
+
+                for (auto i = 1u; i < tokenizer.NumberTokens(); ++i)
+                    _pending.emplace(tokenizer[i], library);
+            }
+        }
+    }
+
+    void PluginLoader::LoadPlugin(const string &library) {
+        {
+            std::lock_guard lock{_mutex};
+            std::erase_if(_pending, [&](const auto &i) { return i.second == library; });
+
+            if (std::ranges::any_of(_plugins, [&](const auto &p) { return p.library == library; }))
+                return;
+        }
+
+        auto image = MapImage(library);
+        auto prototypes = Prototypes(image, *_loader);
+        auto &cf = CommandFactory::Instance();
+        LoadedPlugin loaded{library, image, {}};
+
+        for (auto &p: prototypes) {
+            if (cf.HasKey(p.name))
+                continue;
+
+            cf.RegisterCommand(p.name, std::move(p.command));
+
+            if (p.kernel)
+                cf.RegisterBatchKernel(p.name, std::move(*p.kernel));
+
+            loaded.commands.push_back(std::move(p.name));
+        }
+
+        std::lock_guard lock{_mutex};
+        _plugins.push_back(std::move(loaded));
+    }
+
+    void PluginLoader::LoadAll() {
+        while (true) {
+            string library;
+            {
+                std::lock_guard lock{_mutex};
+
+                if (_pending.empty())
+                    return;
+
+                library = _pending.begin()->second;
+            }
+            LoadPlugin(library);
+        }
+    }
+
+    void PluginLoader::ReloadPlugin(const string &library) {
+        {
+            std::lock_guard lock{_mutex};
+
+            if (std::ranges::none_of(_plugins, [&](const auto &p) { return p.library == library; }))
+                return;
+        }
+
+        // The dynamic linker hands back the already mapped image for a path it
+        // has seen, so the new build is mapped from a private copy.
+        auto copy = fs::temp_directory_path() /
+                    std::format("{}.{}", fs::path{library}.filename().string(), ++_generation);
+        fs::copy_file(library, copy, fs::copy_options::overwrite_existing);
+
+        Image image;
+        try {
+            image = MapImage(copy.string());
+        }
+        catch (...) {
+            fs::remove(copy);
+            throw;
+        }
+        fs::remove(copy);
+
+        auto prototypes = Prototypes(image, *_loader);
+        {
+            std::lock_guard lock{_mutex};
+            auto it = std::ranges::find_if(_plugins, [&](const auto &p) { return p.library == library; });
+            auto &owned = it->commands;
+
+            // Only the names this plugin registered are swapped; commands the
+            // new build no longer provides are deregistered.
+            std::erase_if(prototypes, [&](const auto &p) { return std::ranges::find(owned, p.name) == owned.end(); });
+
+            for (const auto &name: owned) {
+                if (std::ranges::none_of(prototypes, [&](const auto &p) { return p.name == name; }))
+                    prototypes.push_back({name, MakeCommandPtr(nullptr), {}});
+            }
+
+            std::erase_if(owned, [&](const auto &name) {
+                return std::ranges::any_of(prototypes, [&](const auto &p) { return p.name == name && !p.command; });
+            });
+
+            it->image = image;
+        }
+
+        CommandFactory::Instance().StageCommands(std::move(prototypes));
+    }
+
+    vector<const Plugin *> PluginLoader::GetPlugins() const {
+        std::lock_guard lock{_mutex};
+        vector<const Plugin *> plugins;
+
+        for (const auto &p: _plugins)
+            plugins.push_back(p.image.get());
+
+        return plugins;
+    }
+
+    bool PluginLoader::Resolve(const string &command) {
+        string library;
+        {
+            std::lock_guard lock{_mutex};
+            auto it = _pending.find(command);
+
+            if (it == _pending.end())
+                return false;
+
+            library = it->second;
+        }
+
+        LoadPlugin(library);
+        return CommandFactory::Instance().HasKey(command);
+    }
+
+    PluginLoader::Image PluginLoader::MapImage(const string &path) {
+        auto plugin = _loader->AllocatePlugin(path);
+
+        // The deleter holds the loader, so an image can outlive the
+        // PluginLoader in a CommandManager history.
+        Image image{plugin, [loader = _loader](const Plugin *p) {
+            loader->deallocatePlugin(const_cast<Plugin *>(p));
+        }};
+
+        if (plugin->GetApiVersion().major != Plugin::CurrentApiVersion.major)
+            throw Exception{std::format("Plugin {} was built against an incompatible API", path)};
+
+        return image;
+    }
+
+    vector<CommandFactory::StagedCommand> PluginLoader::Prototypes(const Image &image, const DynamicLoader &loader) {
+        const auto &descriptor = image->GetPluginDescriptor();
+        const auto kernels = loader.GetBatchKernels(image.get());
+        vector<CommandFactory::StagedCommand> prototypes;
+
+        for (auto i = 0; i < descriptor.nCommands; ++i) {
+            auto command = MakeCommandPtr<PluginImageCommand>(MakeCommandPtr(descriptor.commands[i]->clone()), image);
+            prototypes.push_back({descriptor.commandNames[i], std::move(command), {}});
+        }
+
+        for (auto i = 0; kernels && i < kernels->nKernels; ++i) {
+            auto it = std::ranges::find_if(prototypes, [&](const auto &c) { return c.name == kernels->commandNames[i]; });
+
+            if (it != prototypes.end())
+                it->kernel = CommandFactory::BatchKernel{kernels->kernels[i], image};
+        }
+
+        return prototypes;
+    }
+}
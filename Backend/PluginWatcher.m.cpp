@@ -0,0 +1,132 @@
+module;
+
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string>
+#include <format>
+#include <mutex>
+#include <thread>
+#include <stop_token>
+#include <filesystem>
+#include <unordered_map>
+#include "../Utilities/Exception.h"
+
+export module CalcBackend_PluginWatcher;
+
+import CalcUtilities;
+import CalcBackend_PluginLoader;
+
+using std::string;
+using std::unordered_map;
+using std::jthread;
+
+namespace fs = std::filesystem;
+
+namespace Calculator {
+
+    // Watches plugin libraries with inotify and hands every new build to
+    // PluginLoader::ReloadPlugin from its own thread. Directories rather than
+    // files are watched, so builds that replace the library by renaming a new
+    // file over it are picked up as well as ones that rewrite it in place.
+    export class PluginWatcher {
+    public:
+        explicit PluginWatcher(PluginLoader &loader);
+
+        ~PluginWatcher();
+
+        void Watch(const string &library);
+
+    private:
+        PluginWatcher(const PluginWatcher &) = delete;
+        PluginWatcher(PluginWatcher &&) = delete;
+        PluginWatcher &operator=(const PluginWatcher &) = delete;
+        PluginWatcher &operator=(PluginWatcher &&) = delete;
+
+        void Run(std::stop_token st);
+
+        void Changed(int wd, const char *name);
+
+        static constexpr int PollIntervalMs = 200;
+
+        PluginLoader &_loader;
+        int _fd;
+        std::mutex _mutex;
+        unordered_map<int, fs::path> _directories;  // watch descriptor -> directory
+        unordered_map<string, string> _libraries;   // watched path -> library as loaded
+        jthread _thread;
+    };
+
+    PluginWatcher::PluginWatcher(PluginLoader &loader)
+            : _loader{loader}, _fd{inotify_init1(IN_NONBLOCK | IN_CLOEXEC)} {
+        if (_fd < 0)
+            throw Exception{"Could not initialise inotify"};
+
+        _thread = jthread{[this](std::stop_token st) { Run(st); }};
+    }
+
+    PluginWatcher::~PluginWatcher() {
+        _thread.request_stop();
+        _thread.join();
+        close(_fd);
+    }
+
+    void PluginWatcher::Watch(const string &library) {
+        auto path = fs::absolute(library);
+        int wd = inotify_add_watch(_fd, path.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+
+        if (wd < 0)
+            throw Exception{std::format("Cannot watch plugin {}", library)};
+
+        std::lock_guard lock{_mutex};
+        _directories.emplace(wd, path.parent_path());
+        _libraries.insert_or_assign(path.string(), library);
+    }
+
+    void PluginWatcher::Run(std::stop_token st) {
+        alignas(inotify_event) char buffer[4096];
+        pollfd pfd{_fd, POLLIN, 0};
+
+        while (!st.stop_requested()) {
+            if (poll(&pfd, 1, PollIntervalMs) <= 0)
+                continue;
+
+            for (auto n = read(_fd, buffer, sizeof buffer); n > 0; n = read(_fd, buffer, sizeof buffer)) {
+                for (auto p = buffer; p < buffer + n;) {
+                    const auto *event = reinterpret_cast<const inotify_event *>(p);
+
+                    if (event->len > 0)
+                        Changed(event->wd, event->name);
+
+                    p += sizeof(inotify_event) + event->len;
+                }
+            }
+        }
+    }
+
+    void PluginWatcher::Changed(int wd, const char *name) {
+        string library;
+        {
+            std::lock_guard lock{_mutex};
+            auto dir = _directories.find(wd);
+
+            if (dir == _directories.end())
+                return;
+
+            auto lib = _libraries.find((dir->second / name).string());
+
+            if (lib == _libraries.end())
+                return;
+
+            library = lib->second;
+        }
+
+        try {
+            _loader.ReloadPlugin(library);
+        }
+        catch (...) {
+            // A build that cannot be loaded leaves the running version in
+            // place; the next write to the library triggers another attempt.
+        }
+    }
+}
@@ -0,0 +1,113 @@
+module;
+
+#include <dlfcn.h>
+#include <string>
+#include <format>
+#include <unordered_map>
+#include <mutex>
+#include "../Utilities/Exception.h"
+
+export module PosixDynamicLoader;
+
+import CalcUtilities;
+import CalcBackend_Command;
+import CalcBackend_Plugin;
+import DynamicLoader;
+
+using std::string;
+using std::unordered_map;
+
+namespace Calculator {
+
+    export class PosixDynamicLoader : public DynamicLoader {
+    public:
+        PosixDynamicLoader() = default;
+
+        ~PosixDynamicLoader() override;
+
+        Plugin *AllocatePlugin(const string &pluginName) override;
+
+        void deallocatePlugin(Plugin *plugin) override;
+
+        const PluginBatchKernels *GetBatchKernels(const Plugin *plugin) const override;
+
+    private:
+        PosixDynamicLoader(const PosixDynamicLoader &) = delete;
+        PosixDynamicLoader(PosixDynamicLoader &&) = delete;
+        PosixDynamicLoader &operator=(const PosixDynamicLoader &) = delete;
+        PosixDynamicLoader &operator=(PosixDynamicLoader &&) = delete;
+
+        // Entry points are resolved once, when the image is mapped. Images may be
+        // mapped by a hot reload thread while the engine releases old ones.
+        struct Image {
+            void *handle;
+            PluginDeallocator deallocate;
+            const PluginBatchKernels *kernels;
+        };
+
+        mutable std::mutex _mutex;
+        unordered_map<const Plugin *, Image> _images;
+    };
+
+    PosixDynamicLoader::~PosixDynamicLoader() {
+        for (auto &[plugin, image]: _images) {
+            image.deallocate(const_cast<Plugin *>(plugin));
+            dlclose(image.handle);
+        }
+    }
+
+    Plugin *PosixDynamicLoader::AllocatePlugin(const string &pluginName) {
+        void *handle = dlopen(pluginName.c_str(), RTLD_NOW | RTLD_LOCAL);
+
+        if (!handle)
+            throw Exception{std::format("Cannot load plugin {}: {}", pluginName, dlerror())};
+
+        auto allocate = reinterpret_cast<PluginAllocator>(dlsym(handle, GetPluginAllocateName().c_str()));
+        auto deallocate = reinterpret_cast<PluginDeallocator>(dlsym(handle, GetPluginDeallocateName().c_str()));
+
+        if (!allocate || !deallocate) {
+            dlclose(handle);
+            throw Exception{std::format("Plugin {} does not export the plugin entry points", pluginName)};
+        }
+
+        auto plugin = static_cast<Plugin *>(allocate());
+
+        if (!plugin) {
+            dlclose(handle);
+            throw Exception{std::format("Plugin {} failed to allocate", pluginName)};
+        }
+
+        // The batch kernel table is optional: classic plugins don't export it.
+        auto getKernels = reinterpret_cast<PluginBatchKernelsGetter>(
+                dlsym(handle, GetPluginBatchKernelsName().c_str()));
+
+        Image image{handle, deallocate, getKernels ? getKernels() : nullptr};
+        std::lock_guard lock{_mutex};
+
+        _images.emplace(plugin, image);
+        return plugin;
+    }
+
+    void PosixDynamicLoader::deallocatePlugin(Plugin *plugin) {
+        Image image;
+        {
+            std::lock_guard lock{_mutex};
+            auto it = _images.find(plugin);
+
+            if (it == _images.end())
+                return;
+
+            image = it->second;
+            _images.erase(it);
+        }
+
+        image.deallocate(plugin);
+        dlclose(image.handle);
+    }
+
+    const PluginBatchKernels *PosixDynamicLoader::GetBatchKernels(const Plugin *plugin) const {
+        std::lock_guard lock{_mutex};
+        auto it = _images.find(plugin);
+        return it != _images.end() ? it->second.kernels : nullptr;
+    }
+}
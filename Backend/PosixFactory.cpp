@@ -0,0 +1,19 @@
+module;
+
+#include <memory>
+
+module PosixFactory;
+
+import DynamicLoader;
+import PosixDynamicLoader;
+
+namespace Calculator {
+
+    PosixFactory::PosixFactory() {
+
+    }
+
+    std::unique_ptr<DynamicLoader> PosixFactory::CreatedDynamicLoader() {
+        return std::make_unique<PosixDynamicLoader>();
+    }
+}
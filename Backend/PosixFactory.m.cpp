@@ -5,10 +5,11 @@ module;
 export module PosixFactory;
 
 import PlatformFactory;
+import DynamicLoader;
 
 namespace Calculator {
 
-    class PosixFactory : public PlatformFactory {
+    export class PosixFactory : public PlatformFactory {
     public:
         PosixFactory();
 
@@ -0,0 +1,231 @@
+module;
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <span>
+#include <atomic>
+#include <any>
+#include <new>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <algorithm>
+#include <type_traits>
+#include "../Utilities/Exception.h"
+
+export module CalcBackend_SharedStack;
+
+import CalcUtilities;
+import CalcBackend_Stack;
+
+using std::string;
+using std::span;
+
+namespace Calculator {
+
+    // Start of a shared stack segment, followed by the capacity topmost
+    // elements, top first. sequence is odd while the writer updates the
+    // segment; a reader that sees the same even sequence before and after
+    // its copy has read a consistent state.
+    struct alignas(64) SharedStackHeader {
+        char magic[4];
+        std::uint16_t elementSize;
+        std::uint16_t reserved;
+        std::uint64_t capacity;
+        std::atomic<std::uint64_t> sequence;
+        std::uint64_t version;      // number of changes published
+        std::uint64_t size;         // elements on the stack, mirrored or not
+    };
+
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+
+    // Not TU-local: the exported templates below use these.
+    inline constexpr char Magic[] = {'R', 'P', 'N', 'M'};
+
+    // Names of POSIX shared memory objects start with a slash.
+    inline string ObjectName(const string &name) {
+        return name.starts_with('/') ? name : '/' + name;
+    }
+
+    // A shared memory object, created and sized by the writer, mapped
+    // read-only by readers.
+    class Mapping {
+    public:
+        Mapping(const string &name, size_t size, bool writer) : _size{size} {
+            const auto object = ObjectName(name);
+            int fd = writer ? shm_open(object.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)
+                            : shm_open(object.c_str(), O_RDONLY, 0);
+
+            if (fd < 0)
+                throw Exception{std::format("Cannot open shared stack {}", name)};
+
+            struct stat st{};
+
+            if (writer ? ftruncate(fd, static_cast<off_t>(size)) != 0
+                       : fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SharedStackHeader)) {
+                close(fd);
+                throw Exception{std::format("Cannot size shared stack {}", name)};
+            }
+
+            if (!writer)
+                _size = static_cast<size_t>(st.st_size);
+
+            _data = mmap(nullptr, _size, writer ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+
+            if (_data == MAP_FAILED)
+                throw Exception{std::format("Cannot map shared stack {}", name)};
+        }
+
+        ~Mapping() { munmap(_data, _size); }
+
+        void *Data() const { return _data; }
+
+        size_t Size() const { return _size; }
+
+    private:
+        Mapping(const Mapping &) = delete;
+        Mapping &operator=(const Mapping &) = delete;
+
+        void *_data;
+        size_t _size;
+    };
+
+    // Mirrors the top of a stack into a POSIX shared memory object on every
+    // change, for processes on the same host that read results without
+    // parsing text. Owned by the stack it observes; the object is removed
+    // when it is detached or the stack goes away.
+    export template<typename T> requires std::is_trivially_copyable_v<T>
+    class SharedStackWriter : public Observer {
+    public:
+        SharedStackWriter(BasicStack<T> &stack, const string &name, size_t capacity);
+
+        ~SharedStackWriter() override;
+
+        static string ObserverName(const string &name) { return "SharedStack:" + name; }
+
+    private:
+        SharedStackWriter(const SharedStackWriter &) = delete;
+        SharedStackWriter &operator=(const SharedStackWriter &) = delete;
+
+        void NotifyImpl(const std::any &) override { Publish(); }
+
+        void Publish();
+
+        BasicStack<T> &_stack;
+        string _name;
+        std::unique_ptr<Mapping> _mapping;
+        SharedStackHeader *_header;
+        T *_elements;
+    };
+
+    // Snapshots of a shared stack, taken without locks: a read that overlaps
+    // a change is retried.
+    export template<typename T> requires std::is_trivially_copyable_v<T>
+    class SharedStackReader {
+    public:
+        struct View {
+            std::uint64_t version;
+            std::uint64_t size;     // elements on the stack
+            size_t count;           // elements copied into top
+        };
+
+        explicit SharedStackReader(const string &name);
+
+        ~SharedStackReader() = default;
+
+        // Copies up to top.size() of the topmost elements, top first.
+        View Read(span<T> top) const;
+
+        size_t Capacity() const { return _header->capacity; }
+
+    private:
+        SharedStackReader(const SharedStackReader &) = delete;
+        SharedStackReader &operator=(const SharedStackReader &) = delete;
+
+        std::unique_ptr<Mapping> _mapping;
+        const SharedStackHeader *_header;
+        const T *_elements;
+    };
+
+    // Attaches a SharedStackWriter for name to the calling thread's stack.
+    export template<typename T> requires std::is_trivially_copyable_v<T>
+    void ShareStack(const string &name, size_t capacity = 64) {
+        auto &stack = BasicStack<T>::Instance();
+        stack.Attach(BasicStack<T>::StackChanged(), std::make_unique<SharedStackWriter<T>>(stack, name, capacity));
+    }
+
+    export template<typename T> requires std::is_trivially_copyable_v<T>
+    void StopSharingStack(const string &name) {
+        BasicStack<T>::Instance().Detach(BasicStack<T>::StackChanged(), SharedStackWriter<T>::ObserverName(name));
+    }
+
+    template<typename T> requires std::is_trivially_copyable_v<T>
+    SharedStackWriter<T>::SharedStackWriter(BasicStack<T> &stack, const string &name, size_t capacity)
+            : Observer{ObserverName(name)}, _stack{stack}, _name{name},
+              _mapping{std::make_unique<Mapping>(name, sizeof(SharedStackHeader) + capacity * sizeof(T), true)},
+              _header{new(_mapping->Data()) SharedStackHeader{}},
+              _elements{reinterpret_cast<T *>(_header + 1)} {
+        std::memcpy(_header->magic, Magic, sizeof Magic);
+        _header->elementSize = sizeof(T);
+        _header->capacity = capacity;
+
+        Publish();
+    }
+
+    template<typename T> requires std::is_trivially_copyable_v<T>
+    SharedStackWriter<T>::~SharedStackWriter() {
+        shm_unlink(ObjectName(_name).c_str());
+    }
+
+    // The only writer, so the sequence needs no read-modify-write.
+    template<typename T> requires std::is_trivially_copyable_v<T>
+    void SharedStackWriter<T>::Publish() {
+        const auto s = _header->sequence.load(std::memory_order_relaxed);
+        const auto n = std::min<size_t>(_stack.Size(), _header->capacity);
+
+        _header->sequence.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (size_t i = 0; i < n; ++i)
+            _elements[i] = _stack.Peek(i);
+
+        ++_header->version;
+        _header->size = _stack.Size();
+
+        _header->sequence.store(s + 2, std::memory_order_release);
+    }
+
+    template<typename T> requires std::is_trivially_copyable_v<T>
+    SharedStackReader<T>::SharedStackReader(const string &name)
+            : _mapping{std::make_unique<Mapping>(name, 0, false)},
+              _header{static_cast<const SharedStackHeader *>(_mapping->Data())},
+              _elements{reinterpret_cast<const T *>(_header + 1)} {
+        if (std::memcmp(_header->magic, Magic, sizeof Magic) != 0 || _header->elementSize != sizeof(T)
+            || _mapping->Size() < sizeof(SharedStackHeader) + _header->capacity * sizeof(T))
+            throw Exception{std::format("{} is not a shared stack of this number type", name)};
+    }
+
+    template<typename T> requires std::is_trivially_copyable_v<T>
+    typename SharedStackReader<T>::View SharedStackReader<T>::Read(span<T> top) const {
+        for (;;) {
+            const auto s = _header->sequence.load(std::memory_order_acquire);
+
+            if (s & 1)
+                continue;
+
+            View view{_header->version, _header->size, 0};
+            view.count = std::min({top.size(), static_cast<size_t>(view.size), static_cast<size_t>(_header->capacity)});
+            std::memcpy(top.data(), _elements, view.count * sizeof(T));
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (_header->sequence.load(std::memory_order_relaxed) == s)
+                return view;
+        }
+    }
+}
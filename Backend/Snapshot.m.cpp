@@ -0,0 +1,340 @@
+module;
+
+#include <string>
+#include <vector>
+#include <span>
+#include <format>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <complex>
+#include <type_traits>
+#include <utility>
+#include "../Utilities/Exception.h"
+
+#ifdef POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+export module CalcBackend_Snapshot;
+
+import CalcBackend_Stack;
+import CalcBackend_Numeric;
+import CalcBackend_Value;
+
+using std::string;
+using std::vector;
+using std::span;
+
+namespace Calculator {
+
+    // A whole session: the stack, plus the history as the commands entered
+    // since the session began and the stack they were entered on. Command
+    // objects carry their own undo state, so history is restored by executing
+    // the commands again from base and undoing back to position.
+    export struct Snapshot {
+        NumberMode mode;
+        vector<char> stack;         // encoded by EncodeStack
+        vector<char> base;          // stack before history[0], encoded likewise
+        vector<string> history;     // undo entries followed by redo entries
+        size_t position;            // number of undo entries
+    };
+
+    // File layout, native byte order:
+    //
+    //     "RPNS" | version (1) | mode (1) | sizeof number (2) | reserved (8)
+    //     stack section | base section | history count (8) | position (8)
+    //     each history entry as length (4) and bytes
+    //
+    // A section is its byte length (8) followed by the encoded stack, padded
+    // to a multiple of 8 bytes, so the numbers of a mapped file are aligned. Stacks of double, long double and
+    // DoubleDouble are stored as the raw array of numbers, so a mapped file
+    // is copied onto the stack without any per-element decoding.
+    export void WriteSnapshot(const string &path, const Snapshot &snapshot);
+
+    export Snapshot ReadSnapshot(const string &path);
+
+    // The calling thread's stack of the given mode, bottom first.
+    export vector<char> EncodeStack(NumberMode mode);
+
+    // Pushes an encoded stack onto the calling thread's stack of the given
+    // mode, raising a single change event.
+    export void DecodeStack(NumberMode mode, span<const char> bytes);
+
+    namespace {
+        constexpr char Magic[] = {'R', 'P', 'N', 'S'};
+        constexpr std::uint8_t Version = 1;
+
+        template<typename U>
+        void Put(vector<char> &out, U u) {
+            char bytes[sizeof u];
+            std::memcpy(bytes, &u, sizeof u);
+            out.insert(out.end(), bytes, bytes + sizeof u);
+        }
+
+        // Reads from a snapshot that has not been validated yet, so every
+        // read is bounds checked.
+        class Reader {
+        public:
+            Reader(span<const char> bytes, string path) : _bytes{bytes}, _path{std::move(path)} {}
+
+            span<const char> Take(size_t n) {
+                if (_bytes.size() - _pos < n)
+                    throw Exception{std::format("Snapshot {} is truncated", _path)};
+
+                auto s = _bytes.subspan(_pos, n);
+                _pos += n;
+                return s;
+            }
+
+            template<typename U>
+            U Get() {
+                U u;
+                std::memcpy(&u, Take(sizeof u).data(), sizeof u);
+                return u;
+            }
+
+            // A count of items of at least size bytes each, checked against
+            // the bytes left before anything is allocated for them.
+            size_t Count(size_t size) {
+                const auto n = Get<std::uint64_t>();
+
+                if (n > (_bytes.size() - _pos) / size)
+                    throw Exception{std::format("Snapshot {} is truncated", _path)};
+
+                return static_cast<size_t>(n);
+            }
+
+        private:
+            span<const char> _bytes;
+            string _path;
+            size_t _pos{0};
+        };
+
+        size_t NumberSize(NumberMode mode) {
+            return VisitNumberMode(mode, []<typename T>(std::type_identity<T>) { return sizeof(T); });
+        }
+
+        void PutSection(vector<char> &out, const vector<char> &section) {
+            Put(out, static_cast<std::uint64_t>(section.size()));
+            out.insert(out.end(), section.begin(), section.end());
+            out.resize(out.size() + (8 - section.size() % 8) % 8);
+        }
+
+        span<const char> GetSection(Reader &in) {
+            const auto n = in.Get<std::uint64_t>();
+            auto section = in.Take(n);
+
+            in.Take((8 - n % 8) % 8);
+            return section;
+        }
+
+        // Complex-mode values: kind (1), real and imaginary part (8 each),
+        // component count (8) and the components.
+        void EncodeValue(vector<char> &out, const Value &v) {
+            Put(out, static_cast<std::uint8_t>(v.GetKind()));
+            Put(out, v.Complex().real());
+            Put(out, v.Complex().imag());
+            Put(out, static_cast<std::uint64_t>(v.Components().size()));
+
+            for (auto c: v.Components())
+                Put(out, c);
+        }
+
+        Value DecodeValue(Reader &in) {
+            const auto kind = static_cast<Value::Kind>(in.Get<std::uint8_t>());
+            const auto re = in.Get<double>();
+            const auto im = in.Get<double>();
+            vector<double> components(in.Count(sizeof(double)));
+
+            for (auto &c: components)
+                c = in.Get<double>();
+
+            switch (kind) {
+                case Value::Kind::Complex:
+                    return std::complex<double>{re, im};
+                case Value::Kind::Vector:
+                    return Value{std::move(components)};
+                default:
+                    return re;
+            }
+        }
+
+        // The snapshot file's bytes, mapped where the platform allows it.
+        class MappedFile {
+        public:
+            explicit MappedFile(const string &path) {
+#ifdef POSIX
+                int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                struct stat st{};
+
+                if (fd < 0 || fstat(fd, &st) != 0) {
+                    if (fd >= 0)
+                        close(fd);
+
+                    throw Exception{std::format("Cannot open snapshot {}", path)};
+                }
+
+                _size = static_cast<size_t>(st.st_size);
+
+                if (_size > 0) {
+                    _data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+                    if (_data == MAP_FAILED) {
+                        close(fd);
+                        throw Exception{std::format("Cannot map snapshot {}", path)};
+                    }
+                }
+                close(fd);
+#else
+                std::ifstream file{path, std::ios::binary};
+
+                if (!file)
+                    throw Exception{std::format("Cannot open snapshot {}", path)};
+
+                _buffer.assign(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+#endif
+            }
+
+            ~MappedFile() {
+#ifdef POSIX
+                if (_data)
+                    munmap(_data, _size);
+#endif
+            }
+
+            span<const char> Bytes() const {
+#ifdef POSIX
+                return {static_cast<const char *>(_data), _size};
+#else
+                return _buffer;
+#endif
+            }
+
+        private:
+            MappedFile(const MappedFile &) = delete;
+            MappedFile &operator=(const MappedFile &) = delete;
+
+#ifdef POSIX
+            void *_data{nullptr};
+            size_t _size{0};
+#else
+            vector<char> _buffer;
+#endif
+        };
+    }
+
+    vector<char> EncodeStack(NumberMode mode) {
+        return VisitNumberMode(mode, []<typename T>(std::type_identity<T>) {
+            auto &stack = BasicStack<T>::Instance();
+            vector<char> out;
+
+            Put(out, static_cast<std::uint64_t>(stack.Size()));
+
+            if constexpr (std::is_trivially_copyable_v<T>) {
+                auto values = stack.Top(stack.Size());
+                auto bytes = std::as_bytes(values);
+                out.insert(out.end(), reinterpret_cast<const char *>(bytes.data()),
+                           reinterpret_cast<const char *>(bytes.data()) + bytes.size());
+            } else {
+                for (auto i = stack.Size(); i > 0; --i)
+                    EncodeValue(out, stack.Peek(i - 1));
+            }
+            return out;
+        });
+    }
+
+    void DecodeStack(NumberMode mode, span<const char> bytes) {
+        VisitNumberMode(mode, [bytes]<typename T>(std::type_identity<T>) {
+            Reader in{bytes, "stack"};
+            auto &stack = BasicStack<T>::Instance();
+
+            if constexpr (std::is_trivially_copyable_v<T>) {
+                const auto n = in.Count(sizeof(T));
+                const auto numbers = in.Take(n * sizeof(T));
+                vector<T> values(n);
+                std::memcpy(values.data(), numbers.data(), numbers.size());
+
+                for (size_t i = 0; i < n; ++i)
+                    stack.Push(values[i], i + 1 < n);
+            } else {
+                const auto n = in.Get<std::uint64_t>();
+
+                for (size_t i = 0; i < n; ++i)
+                    stack.Push(DecodeValue(in), i + 1 < n);
+            }
+        });
+    }
+
+    void WriteSnapshot(const string &path, const Snapshot &snapshot) {
+        vector<char> out{std::begin(Magic), std::end(Magic)};
+
+        Put(out, Version);
+        Put(out, static_cast<std::uint8_t>(snapshot.mode));
+        Put(out, static_cast<std::uint16_t>(NumberSize(snapshot.mode)));
+        Put(out, std::uint64_t{0});
+
+        PutSection(out, snapshot.stack);
+        PutSection(out, snapshot.base);
+        Put(out, static_cast<std::uint64_t>(snapshot.history.size()));
+        Put(out, static_cast<std::uint64_t>(snapshot.position));
+
+        for (const auto &h: snapshot.history) {
+            Put(out, static_cast<std::uint32_t>(h.size()));
+            out.insert(out.end(), h.begin(), h.end());
+        }
+
+        std::ofstream file{path, std::ios::binary | std::ios::trunc};
+        file.write(out.data(), static_cast<std::streamsize>(out.size()));
+
+        if (!file.flush())
+            throw Exception{std::format("Cannot write snapshot {}", path)};
+    }
+
+    Snapshot ReadSnapshot(const string &path) {
+        MappedFile file{path};
+        Reader in{file.Bytes(), path};
+
+        if (std::memcmp(in.Take(sizeof Magic).data(), Magic, sizeof Magic) != 0)
+            throw Exception{std::format("{} is not a snapshot", path)};
+
+        if (in.Get<std::uint8_t>() != Version)
+            throw Exception{std::format("Snapshot {} was written by another version", path)};
+
+        Snapshot snapshot{};
+        const auto mode = in.Get<std::uint8_t>();
+
+        if (mode >= NumberModeCount)
+            throw Exception{std::format("Snapshot {} has an unknown number mode", path)};
+
+        snapshot.mode = static_cast<NumberMode>(mode);
+
+        if (in.Get<std::uint16_t>() != NumberSize(snapshot.mode))
+            throw Exception{std::format("Snapshot {} was written on another platform", path)};
+
+        in.Get<std::uint64_t>();
+
+        auto stack = GetSection(in);
+        auto base = GetSection(in);
+        snapshot.stack.assign(stack.begin(), stack.end());
+        snapshot.base.assign(base.begin(), base.end());
+
+        const auto count = in.Count(sizeof(std::uint32_t));
+        snapshot.position = in.Get<std::uint64_t>();
+
+        if (snapshot.position > count)
+            throw Exception{std::format("Snapshot {} is corrupt", path)};
+
+        snapshot.history.reserve(count);
+
+        for (std::uint64_t i = 0; i < count; ++i) {
+            auto text = in.Take(in.Get<std::uint32_t>());
+            snapshot.history.emplace_back(text.begin(), text.end());
+        }
+        return snapshot;
+    }
+}
@@ -2,16 +2,21 @@ module;
 
 #include <vector>
 #include <string>
-#include <deque>
+#include <span>
+#include <algorithm>
+#include <memory>
+#include <utility>
 #include "../Utilities/Exception.h"
 
 export module CalcBackend_Stack;
 
 import CalcUtilities;
+import CalcBackend_Value;
 
 using std::string;
 using std::vector;
-using std::deque;
+using std::span;
+using std::shared_ptr;
 
 namespace Calculator {
 
@@ -33,38 +38,255 @@ namespace Calculator {
         ErrorConditions _err;
     };
 
-    export class Stack : private Publisher {
+    export template<typename T>
+    class BasicStackScope;
+
+    // Copy-on-write stack container. Elements below the most recent fork live
+    // in immutable segments shared with every other fork of the stack; only
+    // the ones pushed since are owned. Forking moves the owned elements into a
+    // new segment, so it is O(1) however deep the stack is, and popping into a
+    // segment only shortens this stack's view of it. Contiguous access to the
+    // top copies the shared elements it covers into the owned part first.
+    template<typename T, typename Container = vector<T>>
+    class CowStorage {
+    public:
+        size_t size() const { return _frozenSize + _own.size(); }
+
+        bool empty() const { return size() == 0; }
+
+        void clear();
+
+        void push_back(const T &v) { _own.push_back(v); }
+
+        void pop_back();
+
+        T back() const { return (*this)[size() - 1]; }
+
+        T operator[](size_t i) const { return i < _frozenSize ? frozenAt(i) : _own[i - _frozenSize]; }
+
+        // The n topmost elements, owned and contiguous.
+        span<T> top(size_t n);
+
+        // Every element, as the runs it is stored in, bottom to top. Shared
+        // elements are read where they are.
+        vector<span<const T>> runs() const;
+
+        CowStorage fork();
+
+        // Whether this is the very storage fork returned, not just storage
+        // holding the same elements.
+        bool holds(const CowStorage &fork) const {
+            return _own.empty() && fork._own.empty() && _frozen == fork._frozen && _frozenSize == fork._frozenSize;
+        }
+
+    private:
+        struct Segment {
+            shared_ptr<const Segment> below;
+            size_t base;    // elements of below that this segment sits on
+            Container items;
+        };
+
+        T frozenAt(size_t i) const;
+
+        void dropHidden();
+
+        shared_ptr<const Segment> _frozen;
+        size_t _frozenSize{0};
+        Container _own;
+    };
+
+    template<typename T, typename Container>
+    void CowStorage<T, Container>::clear() {
+        _frozen.reset();
+        _frozenSize = 0;
+        _own.clear();
+    }
+
+    template<typename T, typename Container>
+    void CowStorage<T, Container>::pop_back() {
+        if (!_own.empty()) {
+            _own.pop_back();
+            return;
+        }
+
+        --_frozenSize;
+        dropHidden();
+    }
+
+    template<typename T, typename Container>
+    span<T> CowStorage<T, Container>::top(size_t n) {
+        n = std::min(n, size());
+
+        if (n > _own.size()) {
+            const auto k = n - _own.size();
+            Container owned;
+
+            owned.reserve(n);
+
+            for (auto i = _frozenSize - k; i < _frozenSize; ++i)
+                owned.push_back(frozenAt(i));
+
+            owned.insert(owned.end(), _own.begin(), _own.end());
+            _own = std::move(owned);
+            _frozenSize -= k;
+            dropHidden();
+        }
+
+        return {_own.data() + _own.size() - n, n};
+    }
+
+    // A segment's elements can reach past what the segment above sits on,
+    // after pops and pushes between two forks; limit cuts them off there.
+    template<typename T, typename Container>
+    vector<span<const T>> CowStorage<T, Container>::runs() const {
+        vector<span<const T>> r;
+        auto limit = _frozenSize;
+
+        if (!_own.empty())
+            r.emplace_back(_own.data(), _own.size());
+
+        for (auto segment = _frozen.get(); segment; segment = segment->below.get()) {
+            if (limit > segment->base)
+                r.emplace_back(segment->items.data(), std::min(limit - segment->base, segment->items.size()));
+
+            limit = std::min(limit, segment->base);
+        }
+
+        std::ranges::reverse(r);
+        return r;
+    }
+
+    template<typename T, typename Container>
+    CowStorage<T, Container> CowStorage<T, Container>::fork() {
+        if (!_own.empty()) {
+            const auto n = _own.size();
+
+            _frozen = std::make_shared<const Segment>(Segment{std::move(_frozen), _frozenSize, std::move(_own)});
+            _frozenSize += n;
+            _own = Container{};
+        }
+
+        return *this;
+    }
+
+    template<typename T, typename Container>
+    T CowStorage<T, Container>::frozenAt(size_t i) const {
+        auto segment = _frozen.get();
+
+        while (i < segment->base)
+            segment = segment->below.get();
+
+        return segment->items[i - segment->base];
+    }
+
+    // Releases segments this stack has popped below.
+    template<typename T, typename Container>
+    void CowStorage<T, Container>::dropHidden() {
+        while (_frozen && _frozenSize <= _frozen->base)
+            _frozen = _frozen->below;
+    }
+
+    // Container a BasicStack<T> keeps its elements in. Values are stored
+    // structure-of-arrays; every other type in a plain contiguous vector.
+    template<typename T>
+    struct StackStorage {
+        using type = CowStorage<T>;
+    };
+
+    template<>
+    struct StackStorage<Value> {
+        using type = CowStorage<Value, ValueStorage>;
+    };
+
+    // Stack of numbers of type T, one per thread (or per StackScope). The
+    // calculator runs on BasicStack<double> unless a session selects one of the
+    // extended precision NumberModes.
+    export template<typename T>
+    class BasicStack : private Publisher {
     public:
-        static Stack& Instance();
-        void Push(double, bool suppressChangeEvent = false);
-        double Pop(bool suppressChangeEvent = false);
+        using value_type = T;
+
+        static BasicStack& Instance();
+        void Push(T, bool suppressChangeEvent = false);
+        T Pop(bool suppressChangeEvent = false);
         void SwapTop();
-        vector<double> GetElements(size_t n) const;
-        void GetElements(size_t n, vector<double> &) const;
+        vector<T> GetElements(size_t n) const;
+        void GetElements(size_t n, vector<T> &) const;
+        // The element depth places below the top, read in place. The stack
+        // must hold more than depth elements.
+        T Peek(size_t depth = 0) const { return _stack[_stack.size() - 1 - depth]; }
+        // The n topmost elements as one contiguous span, bottom to top. Not
+        // available for SoA stored types. Elements still shared with a fork
+        // are copied first.
+        span<const T> Top(size_t n);
+        // Every element as the contiguous runs it is stored in, bottom to
+        // top. Unlike Top, nothing shared with a fork is copied. Not
+        // available for SoA stored types.
+        vector<span<const T>> Runs() const { return _stack.runs(); }
+        // Hands the n topmost elements to f as a mutable span, bottom to top,
+        // and raises a single change event afterwards.
+        template<typename F>
+        void Transform(size_t n, F &&f);
         using Publisher::Attach;
         using Publisher::Detach;
         size_t Size() const { return _stack.size(); }
         void Clear();
-        static string StackChanged();
-        static string StackError();
+        // Copy-on-write state of the stack. Taking and restoring one is O(1)
+        // however deep the stack is; the stacks share elements until either
+        // side modifies them.
+        using Contents = typename StackStorage<T>::type;
+        Contents Fork() { return _stack.fork(); }
+        void Restore(Contents contents);
+        // Whether the stack is still exactly contents, untouched since it was
+        // forked or restored. O(1).
+        bool Holds(const Contents &contents) const { return _stack.holds(contents); }
+        // Values other threads push for this stack, which the owning thread
+        // takes in at its own safe points; commands never see a push in
+        // progress. Created on first use by the owning thread, before it is
+        // handed to the pushing threads.
+        PushBuffer<T> &Feed(size_t capacity = size_t{1} << 16);
+        PushBuffer<T> *FeedIfAny() const { return _feed.get(); }
+        static string StackChanged() { return "Stack changed!"; }
+        static string StackError() { return "Error"; }
 
     private:
-        Stack();
-        ~Stack() = default;
-        Stack(const Stack &) = delete;
-        Stack(Stack &&) = delete;
-        Stack &operator=(Stack &) = delete;
-        Stack &operator=(Stack &&) = delete;
-        deque<double> _stack;
+        BasicStack();
+        ~BasicStack() = default;
+        BasicStack(const BasicStack &) = delete;
+        BasicStack(BasicStack &&) = delete;
+        BasicStack &operator=(BasicStack &) = delete;
+        BasicStack &operator=(BasicStack &&) = delete;
+        typename StackStorage<T>::type _stack;
+        std::unique_ptr<PushBuffer<T>> _feed;
+
+        inline static thread_local BasicStack *_bound = nullptr;
+
+        friend class BasicStackScope<T>;
     };
 
-    string Stack::StackChanged() {
-        return "Stack changed!";
-    }
+    // Binds a private stack to the calling thread for the lifetime of the scope,
+    // so that BasicStack<T>::Instance() (and therefore every command) runs
+    // against it.
+    export template<typename T>
+    class BasicStackScope {
+    public:
+        BasicStackScope();
+        ~BasicStackScope();
 
-    string Stack::StackError() {
-        return "Error";
-    }
+        BasicStack<T> &Get() { return _stack; }
+
+    private:
+        BasicStackScope(const BasicStackScope &) = delete;
+        BasicStackScope(BasicStackScope &&) = delete;
+        BasicStackScope &operator=(const BasicStackScope &) = delete;
+        BasicStackScope &operator=(BasicStackScope &&) = delete;
+
+        BasicStack<T> _stack;
+        BasicStack<T> *_previous;
+    };
+
+    export using Stack = BasicStack<double>;
+    export using StackScope = BasicStackScope<double>;
 
     const char *StackErrorData::Message(StackErrorData::ErrorConditions ec) {
         switch (ec) {
@@ -81,17 +303,19 @@ namespace Calculator {
         return Message(_err);
     }
 
-    void Stack::Push(double d, bool suppressChangeEvent) {
+    template<typename T>
+    void BasicStack<T>::Push(T d, bool suppressChangeEvent) {
         _stack.push_back(d);
 
         if (!suppressChangeEvent)
-            Raise(Stack::StackChanged(), nullptr);
+            Raise(StackChanged(), nullptr);
     }
 
-    double Stack::Pop(bool suppressChangeEvent) {
+    template<typename T>
+    T BasicStack<T>::Pop(bool suppressChangeEvent) {
         if (_stack.empty()) {
             Raise(
-                    Stack::StackError(),
+                    StackError(),
                     StackErrorData{StackErrorData::ErrorConditions::Empty}
             );
             throw Exception{
@@ -102,16 +326,17 @@ namespace Calculator {
             _stack.pop_back();
 
             if (!suppressChangeEvent)
-                Raise(Stack::StackChanged(), nullptr);
+                Raise(StackChanged(), nullptr);
 
             return value;
         }
     }
 
-    void Stack::SwapTop() {
+    template<typename T>
+    void BasicStack<T>::SwapTop() {
         if (_stack.size() < 2) {
             Raise(
-                    Stack::StackError(),
+                    StackError(),
                     StackErrorData{StackErrorData::ErrorConditions::TooFewArguments}
             );
             throw Exception{
@@ -125,36 +350,84 @@ namespace Calculator {
             _stack.push_back(first);
             _stack.push_back(second);
 
-            Raise(Stack::StackChanged(), nullptr);
+            Raise(StackChanged(), nullptr);
         }
     }
 
-    void Stack::GetElements(size_t n, vector<double> &vec) const {
+    template<typename T>
+    void BasicStack<T>::GetElements(size_t n, vector<T> &vec) const {
         if (n > _stack.size())
             n = _stack.size();
 
-        vec.insert(vec.end(), _stack.rbegin(), _stack.rbegin() + n);
+        vec.reserve(vec.size() + n);
+
+        for (auto i = _stack.size(); i > _stack.size() - n; --i)
+            vec.push_back(_stack[i - 1]);
+    }
+
+    template<typename T>
+    span<const T> BasicStack<T>::Top(size_t n) {
+        return _stack.top(n);
+    }
+
+    template<typename T>
+    template<typename F>
+    void BasicStack<T>::Transform(size_t n, F &&f) {
+        f(_stack.top(n));
+
+        Raise(StackChanged(), nullptr);
     }
 
-    vector<double> Stack::GetElements(size_t n) const {
-        vector<double> vec;
+    template<typename T>
+    vector<T> BasicStack<T>::GetElements(size_t n) const {
+        vector<T> vec;
 
         GetElements(n, vec);
         return vec;
     }
 
-    void Stack::Clear() {
+    template<typename T>
+    void BasicStack<T>::Clear() {
         _stack.clear();
-        Raise(Stack::StackChanged(), nullptr);
+        Raise(StackChanged(), nullptr);
     }
 
-    Stack &Stack::Instance() {
-        static Stack instance;
+    template<typename T>
+    void BasicStack<T>::Restore(Contents contents) {
+        _stack = std::move(contents);
+        Raise(StackChanged(), nullptr);
+    }
+
+    template<typename T>
+    BasicStack<T> &BasicStack<T>::Instance() {
+        if (_bound)
+            return *_bound;
+
+        static BasicStack instance;
         return instance;
     }
 
-    Stack::Stack() {
+    template<typename T>
+    PushBuffer<T> &BasicStack<T>::Feed(size_t capacity) {
+        if (!_feed)
+            _feed = std::make_unique<PushBuffer<T>>(capacity);
+
+        return *_feed;
+    }
+
+    template<typename T>
+    BasicStack<T>::BasicStack() {
         RegisterEvent(StackChanged());
         RegisterEvent(StackError());
     }
+
+    template<typename T>
+    BasicStackScope<T>::BasicStackScope() : _previous(BasicStack<T>::_bound) {
+        BasicStack<T>::_bound = &_stack;
+    }
+
+    template<typename T>
+    BasicStackScope<T>::~BasicStackScope() {
+        BasicStack<T>::_bound = _previous;
+    }
 }
@@ -0,0 +1,298 @@
+module;
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <expected>
+#include <format>
+#include <utility>
+#include "../Utilities/Exception.h"
+
+export module CalcBackend_StoredProcedure;
+
+import CalcBackend_Command;
+import CalcBackend_Stack;
+import CalcUtilities;
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+namespace Calculator {
+
+    // What undoing a stored procedure restores. Whole keeps the stack as it
+    // was before and after the procedure, copy-on-write, so a loop of any
+    // length is one history entry of the size of what it changed. None keeps
+    // nothing: the procedure cannot be undone, and redo leaves it applied.
+    export enum class ProcedureUndo : std::uint8_t {
+        Whole, None
+    };
+
+    // A file of commands run as one command. Besides commands and numbers it
+    // may contain
+    //
+    //     undo:<whole|none>         as its first token, whole by default
+    //     repeat:<n> ... end        runs the body n times
+    //     while ... end             runs the body while the top of the stack is nonzero
+    //     if ... [else ...] end     runs the first part if the top is nonzero
+    //
+    // The tests of while and if read the top without popping it. The file is
+    // compiled once into an array of instructions over commands resolved up
+    // front, so loops run without tokenizing or looking up names again. It
+    // runs on a private stack forked from the calculator's, which only sees
+    // the result, as a single change; if a command fails, the calculator's
+    // stack is left as it was.
+    export template<typename T>
+    class StoredProcedure : public Command {
+    public:
+        // Returns the command for a token that is a number or command name,
+        // or nullptr.
+        using Resolver = std::function<CommandPtr(const string &)>;
+
+        StoredProcedure(const string &name, const Tokenizer &tokens, const Resolver &resolve);
+
+        explicit StoredProcedure(const StoredProcedure &rhs);
+
+        ~StoredProcedure() = default;
+
+    private:
+        enum class Op : std::uint8_t {
+            Execute,    // the command at index operand
+            Repeat,     // operand times, or to target if zero
+            EndRepeat,  // back to target while the count lasts
+            Test,       // to target if the top is zero
+            Jump        // to target
+        };
+
+        struct Instruction {
+            Op op;
+            std::uint32_t operand;
+            std::uint32_t target;
+        };
+
+        StoredProcedure(StoredProcedure &&) = delete;
+
+        StoredProcedure &operator=(const StoredProcedure &) = delete;
+
+        StoredProcedure &operator=(StoredProcedure &&) = delete;
+
+        void compile(const string &name, const Tokenizer &tokens, const Resolver &resolve);
+
+        CommandResult run(BasicStack<T> &stack);
+
+        CommandResult tryExecuteImp() override;
+
+        // Only reached through tryExecuteImp.
+        void executeImp() noexcept override {}
+
+        void undoImp() noexcept override;
+
+        StoredProcedure *cloneImp() const override { return new StoredProcedure{*this}; }
+
+        const char *helpMessageImp() const noexcept override { return "Run a stored procedure"; }
+
+        // The program is shared between clones; the commands carry execution
+        // state, so every clone has its own.
+        std::shared_ptr<const vector<Instruction>> _program;
+        vector<CommandPtr> _commands;
+        vector<std::uint32_t> _counts;   // remaining iterations of the enclosing repeats
+        ProcedureUndo _undo;
+        std::optional<typename BasicStack<T>::Contents> _before;
+        std::optional<typename BasicStack<T>::Contents> _after;
+        bool _undone;   // since the last execution, which makes the next one a redo
+    };
+
+    template<typename T>
+    StoredProcedure<T>::StoredProcedure(const string &name, const Tokenizer &tokens, const Resolver &resolve)
+            : Command{}, _undo{ProcedureUndo::Whole}, _undone{false} {
+        compile(name, tokens, resolve);
+    }
+
+    // A clone taken to undo an executed procedure keeps the stacks it
+    // restores; both are forks, so copying them is O(1).
+    template<typename T>
+    StoredProcedure<T>::StoredProcedure(const StoredProcedure &rhs)
+            : Command{rhs}, _program{rhs._program}, _undo{rhs._undo}, _before{rhs._before}, _after{rhs._after},
+              _undone{rhs._undone} {
+        _commands.reserve(rhs._commands.size());
+
+        for (const auto &c: rhs._commands)
+            _commands.push_back(MakeCommandPtr(c->clone()));
+    }
+
+    // Each open block remembers where its first instruction is; end patches
+    // the forward jumps to point past it.
+    template<typename T>
+    void StoredProcedure<T>::compile(const string &name, const Tokenizer &tokens, const Resolver &resolve) {
+        enum class Block { Repeat, While, If, Else };
+
+        struct Open {
+            Block block;
+            std::uint32_t start;
+        };
+
+        vector<Instruction> program;
+        vector<Open> open;
+        size_t first{0};
+
+        auto here = [&program] { return static_cast<std::uint32_t>(program.size()); };
+
+        if (tokens.NumberTokens() > 0 && string_view{tokens[0]}.starts_with("undo:")) {
+            if (tokens[0] == "undo:whole")
+                _undo = ProcedureUndo::Whole;
+            else if (tokens[0] == "undo:none")
+                _undo = ProcedureUndo::None;
+            else
+                throw Exception{std::format("Procedure {}: unknown {}", name, tokens[0])};
+
+            first = 1;
+        }
+
+        for (auto i = first; i < tokens.NumberTokens(); ++i) {
+            const auto &token = tokens[i];
+            string_view t{token};
+
+            if (t.starts_with("repeat:")) {
+                std::uint32_t n{0};
+                auto count = t.substr(7);
+                auto [end, ec] = std::from_chars(count.data(), count.data() + count.size(), n);
+
+                if (count.empty() || ec != std::errc{} || end != count.data() + count.size())
+                    throw Exception{std::format("Procedure {}: {} needs a count", name, token)};
+
+                open.push_back({Block::Repeat, here()});
+                program.push_back({Op::Repeat, n, 0});
+            } else if (t == "while") {
+                open.push_back({Block::While, here()});
+                program.push_back({Op::Test, 0, 0});
+            } else if (t == "if") {
+                open.push_back({Block::If, here()});
+                program.push_back({Op::Test, 0, 0});
+            } else if (t == "else") {
+                if (open.empty() || open.back().block != Block::If)
+                    throw Exception{std::format("Procedure {}: else without if", name)};
+
+                program.push_back({Op::Jump, 0, 0});
+                program[open.back().start].target = here();
+                open.back() = {Block::Else, here() - 1};
+            } else if (t == "end") {
+                if (open.empty())
+                    throw Exception{std::format("Procedure {}: end without a block to end", name)};
+
+                auto [block, start] = open.back();
+                open.pop_back();
+
+                if (block == Block::Repeat)
+                    program.push_back({Op::EndRepeat, 0, start + 1});
+                else if (block == Block::While)
+                    program.push_back({Op::Jump, 0, start});
+
+                program[start].target = here();
+            } else if (auto c = resolve(token)) {
+                program.push_back({Op::Execute, static_cast<std::uint32_t>(_commands.size()), 0});
+                _commands.push_back(std::move(c));
+            } else
+                throw Exception{std::format("Procedure {}: {} is not a known command", name, token)};
+        }
+
+        if (!open.empty())
+            throw Exception{std::format("Procedure {}: a block is missing its end", name)};
+
+        _program = std::make_shared<const vector<Instruction>>(std::move(program));
+    }
+
+    template<typename T>
+    CommandResult StoredProcedure<T>::run(BasicStack<T> &stack) {
+        const auto &program = *_program;
+
+        _counts.clear();
+
+        for (size_t pc = 0; pc < program.size();) {
+            const auto &in = program[pc];
+
+            switch (in.op) {
+                case Op::Execute:
+                    if (auto r = _commands[in.operand]->tryExecute(); !r)
+                        return r;
+
+                    ++pc;
+                    break;
+                case Op::Repeat:
+                    if (in.operand == 0)
+                        pc = in.target;
+                    else {
+                        _counts.push_back(in.operand);
+                        ++pc;
+                    }
+                    break;
+                case Op::EndRepeat:
+                    if (--_counts.back() > 0)
+                        pc = in.target;
+                    else {
+                        _counts.pop_back();
+                        ++pc;
+                    }
+                    break;
+                case Op::Test:
+                    if (stack.Size() < 1)
+                        return std::unexpected{"Stack must have 1 element"};
+
+                    pc = stack.Peek() == T{} ? in.target : pc + 1;
+                    break;
+                case Op::Jump:
+                    pc = in.target;
+                    break;
+            }
+        }
+        return {};
+    }
+
+    // A redo follows an undo and finds the stack as the undo left it, so the
+    // result is restored instead of running the procedure again. Running the
+    // same object again otherwise, as a macro step or in a loop of another
+    // procedure, starts from scratch on whatever the stack is then.
+    template<typename T>
+    CommandResult StoredProcedure<T>::tryExecuteImp() {
+        auto &stack = BasicStack<T>::Instance();
+
+        if (std::exchange(_undone, false)) {
+            if (_undo == ProcedureUndo::None)
+                return {};
+
+            if (_before && stack.Holds(*_before)) {
+                stack.Restore(*_after);
+                return {};
+            }
+        }
+
+        auto before = stack.Fork();
+        BasicStackScope<T> scope;
+
+        scope.Get().Restore(before);
+
+        if (auto r = run(scope.Get()); !r)
+            return r;
+
+        auto after = scope.Get().Fork();
+        stack.Restore(after);
+
+        if (_undo == ProcedureUndo::Whole) {
+            _before.emplace(std::move(before));
+            _after.emplace(std::move(after));
+        }
+        return {};
+    }
+
+    template<typename T>
+    void StoredProcedure<T>::undoImp() noexcept {
+        if (_before)
+            BasicStack<T>::Instance().Restore(*_before);
+
+        _undone = true;
+    }
+}
@@ -0,0 +1,400 @@
+module;
+
+#include <cmath>
+#include <complex>
+#include <vector>
+#include <string>
+#include <span>
+#include <format>
+#include <compare>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <type_traits>
+#include "../Utilities/Exception.h"
+
+export module CalcBackend_Value;
+
+using std::string;
+using std::vector;
+using std::span;
+using std::complex;
+
+namespace Calculator {
+
+    // A stack value that is a real number, a complex number or a fixed-length
+    // real vector. Arithmetic broadcasts reals over vectors and promotes reals to
+    // complex; vector operations run element-wise over contiguous storage.
+    export class Value {
+    public:
+        enum class Kind : std::uint8_t {
+            Real, Complex, Vector
+        };
+
+        Value() : _kind{Kind::Real}, _z{} {}
+
+        Value(double d) : _kind{Kind::Real}, _z{d} {}
+
+        Value(complex<double> z) : _kind{Kind::Complex}, _z{z} {}
+
+        explicit Value(vector<double> v) : _kind{Kind::Vector}, _z{}, _v{std::move(v)} {}
+
+        Kind GetKind() const { return _kind; }
+
+        bool IsReal() const { return _kind == Kind::Real; }
+
+        bool IsComplex() const { return _kind == Kind::Complex; }
+
+        bool IsVector() const { return _kind == Kind::Vector; }
+
+        double Real() const { return _z.real(); }
+
+        complex<double> Complex() const { return _z; }
+
+        span<const double> Components() const { return _v; }
+
+        // Real and complex literals are plain numbers and "(re,im)"; vectors
+        // are written "[x,y,...]".
+        static Value Parse(const string &s);
+
+        static bool IsLiteral(const string &s) { return s.starts_with('(') || s.starts_with('['); }
+
+        string ToString() const;
+
+        friend Value operator+(const Value &a, const Value &b) { return Combine(a, b, std::plus<>{}); }
+
+        friend Value operator-(const Value &a, const Value &b) { return Combine(a, b, std::minus<>{}); }
+
+        friend Value operator*(const Value &a, const Value &b) { return Combine(a, b, std::multiplies<>{}); }
+
+        friend Value operator/(const Value &a, const Value &b) { return Combine(a, b, std::divides<>{}); }
+
+        friend Value operator-(const Value &a) { return Apply(a, std::negate<>{}); }
+
+        friend bool operator==(const Value &a, const Value &b);
+
+        // Only reals are ordered; any comparison involving a complex or vector
+        // value is unordered and so false.
+        friend std::partial_ordering operator<=>(const Value &a, const Value &b);
+
+        // Applies f element-wise to vectors, to the complex number or to the
+        // real. A complex number is rejected by functions that only take
+        // doubles rather than losing its imaginary part.
+        template<typename F>
+        static Value Apply(const Value &a, F &&f);
+
+        template<typename F>
+        static Value Combine(const Value &a, const Value &b, F &&f);
+
+    private:
+        Kind _kind;
+        complex<double> _z;
+        vector<double> _v;
+    };
+
+    template<typename F>
+    Value Value::Apply(const Value &a, F &&f) {
+        switch (a._kind) {
+            case Kind::Vector: {
+                vector<double> r(a._v.size());
+                std::transform(a._v.begin(), a._v.end(), r.begin(), [&f](double x) { return f(x); });
+                return Value{std::move(r)};
+            }
+            case Kind::Complex:
+                if constexpr (std::is_invocable_v<F &, complex<double>>)
+                    return f(a._z);
+                else
+                    throw Exception{std::format("{} is not a real value", a.ToString())};
+            default:
+                return f(a._z.real());
+        }
+    }
+
+    template<typename F>
+    Value Value::Combine(const Value &a, const Value &b, F &&f) {
+        if (a.IsVector() && b.IsVector()) {
+            vector<double> r(a._v.size());
+            std::transform(a._v.begin(), a._v.end(), b._v.begin(), r.begin(), f);
+            return Value{std::move(r)};
+        }
+
+        if (a.IsVector()) {
+            const double s = b.Real();
+            return Apply(a, [s, &f](double x) { return f(x, s); });
+        }
+
+        if (b.IsVector()) {
+            const double s = a.Real();
+            return Apply(b, [s, &f](double x) { return f(s, x); });
+        }
+
+        if (a.IsComplex() || b.IsComplex())
+            return f(a._z, b._z);
+
+        return f(a._z.real(), b._z.real());
+    }
+
+    // Reason two operands cannot be combined, or nullptr. Commands check this
+    // before executing, since the operations themselves cannot fail.
+    export const char *CheckOperands(const Value &a, const Value &b) {
+        if (a.IsVector() && b.IsVector() && a.Components().size() != b.Components().size())
+            return "Vectors must have the same length";
+
+        if ((a.IsVector() && b.IsComplex()) || (a.IsComplex() && b.IsVector()))
+            return "Cannot combine complex and vector values";
+
+        return nullptr;
+    }
+
+    bool operator==(const Value &a, const Value &b) {
+        if (a.IsVector() && b.IsVector())
+            return std::ranges::equal(a._v, b._v);
+
+        if (a.IsVector() || b.IsVector()) {
+            const auto &v = a.IsVector() ? a : b;
+            const auto s = a.IsVector() ? b._z : a._z;
+            return std::ranges::all_of(v._v, [s](double x) { return complex<double>{x} == s; });
+        }
+
+        return a._z == b._z;
+    }
+
+    std::partial_ordering operator<=>(const Value &a, const Value &b) {
+        if (!a.IsReal() || !b.IsReal())
+            return std::partial_ordering::unordered;
+
+        return a._z.real() <=> b._z.real();
+    }
+
+    export Value fabs(const Value &a) {
+        if (a.IsComplex())
+            return std::abs(a.Complex());
+
+        return Value::Apply(a, [](double x) { return std::fabs(x); });
+    }
+
+    export Value floor(const Value &a) {
+        if (a.IsComplex())
+            return complex<double>{std::floor(a.Complex().real()), std::floor(a.Complex().imag())};
+
+        return Value::Apply(a, [](double x) { return std::floor(x); });
+    }
+
+    export Value sin(const Value &a) {
+        return Value::Apply(a, [](auto x) { return std::sin(x); });
+    }
+
+    export Value cos(const Value &a) {
+        return Value::Apply(a, [](auto x) { return std::cos(x); });
+    }
+
+    export Value tan(const Value &a) {
+        return Value::Apply(a, [](auto x) { return std::tan(x); });
+    }
+
+    export Value atan(const Value &a) {
+        return Value::Apply(a, [](auto x) { return std::atan(x); });
+    }
+
+    // Reals outside [-1, 1] have complex inverse sines and cosines; vectors
+    // stay real and yield NaN there, as they do in double mode.
+    export Value asin(const Value &a) {
+        if (a.IsReal() && std::fabs(a.Real()) > 1.)
+            return std::asin(a.Complex());
+
+        return Value::Apply(a, [](auto x) { return std::asin(x); });
+    }
+
+    export Value acos(const Value &a) {
+        if (a.IsReal() && std::fabs(a.Real()) > 1.)
+            return std::acos(a.Complex());
+
+        return Value::Apply(a, [](auto x) { return std::acos(x); });
+    }
+
+    export Value pow(const Value &a, const Value &b) {
+        return Value::Combine(a, b, [](auto x, auto y) { return std::pow(x, y); });
+    }
+
+    namespace {
+        double ParseReal(const string &s) {
+            size_t n{0};
+            double d{0.};
+
+            try {
+                d = std::stod(s, &n);
+            }
+            catch (...) {
+                n = 0;
+            }
+
+            if (n == 0 || n != s.size())
+                throw Exception{std::format("{} is not a number", s)};
+
+            return d;
+        }
+
+        vector<double> ParseList(const string &s, char open, char close) {
+            if (s.size() < 2 || s.front() != open || s.back() != close)
+                throw Exception{std::format("{} is not a number", s)};
+
+            vector<double> values;
+            size_t begin{1};
+
+            for (auto end = s.find(',', begin); ; end = s.find(',', begin)) {
+                auto last = end == string::npos ? s.size() - 1 : end;
+                values.push_back(ParseReal(s.substr(begin, last - begin)));
+
+                if (end == string::npos)
+                    break;
+
+                begin = end + 1;
+            }
+            return values;
+        }
+    }
+
+    Value Value::Parse(const string &s) {
+        if (s.starts_with('(')) {
+            auto parts = ParseList(s, '(', ')');
+
+            if (parts.size() != 2)
+                throw Exception{std::format("{} is not a complex number", s)};
+
+            return complex<double>{parts[0], parts[1]};
+        }
+
+        if (s.starts_with('['))
+            return Value{ParseList(s, '[', ']')};
+
+        return ParseReal(s);
+    }
+
+    string Value::ToString() const {
+        switch (_kind) {
+            case Kind::Complex:
+                return std::format("({},{})", _z.real(), _z.imag());
+            case Kind::Vector: {
+                string s = "[";
+
+                for (size_t i = 0; i < _v.size(); ++i)
+                    s += std::format(i == 0 ? "{}" : ",{}", _v[i]);
+
+                return s + "]";
+            }
+            default:
+                return std::format("{}", _z.real());
+        }
+    }
+
+    // Structure-of-arrays storage for a stack of Values. Real parts live in a
+    // dense array of doubles; the kind tags, imaginary parts and vector extents
+    // are separate lanes that are only allocated once a value needing them is
+    // pushed, so a stack holding nothing but reals is a plain vector<double>;
+    // emptying the stack drops them again. Vector components are kept in a
+    // pool that grows and shrinks with the top of the stack.
+    export class ValueStorage {
+    public:
+        size_t size() const { return _re.size(); }
+
+        bool empty() const { return _re.empty(); }
+
+        void clear();
+
+        void push_back(const Value &v);
+
+        void pop_back();
+
+        Value back() const { return (*this)[size() - 1]; }
+
+        Value operator[](size_t i) const;
+
+    private:
+        Value::Kind KindAt(size_t i) const { return _tagged ? _kind[i] : Value::Kind::Real; }
+
+        size_t PoolBegin(size_t i) const { return i == 0 || !_vectors ? 0 : _end[i - 1]; }
+
+        vector<double> _re;
+        vector<Value::Kind> _kind;
+        vector<double> _im;
+        vector<size_t> _end;    // end of each slot's components in _pool
+        vector<double> _pool;
+        bool _tagged{false};
+        bool _imaginary{false};
+        bool _vectors{false};
+    };
+
+    void ValueStorage::clear() {
+        _re.clear();
+        _kind.clear();
+        _im.clear();
+        _end.clear();
+        _pool.clear();
+        _tagged = _imaginary = _vectors = false;
+    }
+
+    void ValueStorage::push_back(const Value &v) {
+        const auto n = size();
+        const auto kind = v.GetKind();
+
+        if (kind != Value::Kind::Real && !std::exchange(_tagged, true))
+            _kind.assign(n, Value::Kind::Real);
+
+        if (kind == Value::Kind::Complex && !std::exchange(_imaginary, true))
+            _im.assign(n, 0.);
+
+        if (kind == Value::Kind::Vector && !std::exchange(_vectors, true))
+            _end.assign(n, 0);
+
+        _re.push_back(v.Real());
+
+        if (_tagged)
+            _kind.push_back(kind);
+
+        if (_imaginary)
+            _im.push_back(v.Complex().imag());
+
+        if (_vectors) {
+            auto c = v.Components();
+            _pool.insert(_pool.end(), c.begin(), c.end());
+            _end.push_back(_pool.size());
+        }
+    }
+
+    void ValueStorage::pop_back() {
+        const auto n = size() - 1;
+
+        if (n == 0) {
+            clear();
+            return;
+        }
+
+        if (_vectors) {
+            _pool.resize(PoolBegin(n));
+            _end.pop_back();
+        }
+
+        if (_imaginary)
+            _im.pop_back();
+
+        if (_tagged)
+            _kind.pop_back();
+
+        _re.pop_back();
+    }
+
+    Value ValueStorage::operator[](size_t i) const {
+        switch (KindAt(i)) {
+            case Value::Kind::Complex:
+                return complex<double>{_re[i], _im[i]};
+            case Value::Kind::Vector: {
+                auto first = _pool.begin() + static_cast<std::ptrdiff_t>(PoolBegin(i));
+                auto last = _pool.begin() + static_cast<std::ptrdiff_t>(_end[i]);
+                return Value{vector<double>{first, last}};
+            }
+            default:
+                return _re[i];
+        }
+    }
+}
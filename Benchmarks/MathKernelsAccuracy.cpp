@@ -0,0 +1,122 @@
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <random>
+
+import CalcBackend_MathKernels;
+
+using namespace Calculator;
+
+// Sweeps each accuracy mode over the domain of every function and checks the
+// worst error, in units in the last place of the double result, against the
+// bounds documented on MathAccuracy. The reference is the C library's long
+// double function, which has 11 bits more than double where long double is
+// x87 extended precision.
+
+namespace {
+    constexpr int Samples = 1 << 21;
+
+    double UlpError(double got, long double exact) {
+        const auto rounded = static_cast<double>(exact);
+
+        if (std::isnan(got) && std::isnan(rounded))
+            return 0.;
+        if (got == rounded && std::signbit(got) == std::signbit(rounded))
+            return 0.;
+        if (std::isinf(got) || std::isinf(rounded) || std::signbit(got) != std::signbit(rounded))
+            return std::numeric_limits<double>::infinity();
+
+        const double a = std::fabs(rounded);
+        const double ulp = std::nextafter(a, std::numeric_limits<double>::infinity()) - a;
+
+        return static_cast<double>(std::fabs(static_cast<long double>(got) - exact) / ulp);
+    }
+
+    enum Function { Sine, Cosine, Tangent, Arcsine, Arccosine, Arctangent, Power, Functions };
+
+    constexpr const char *Names[] = {"sin", "cos", "tan", "asin", "acos", "atan", "pow"};
+
+    struct Mode {
+        MathAccuracy accuracy;
+        const char *name;
+        double bound[Functions];
+    };
+
+    // Fast pow is not bounded in ULP, so its bound is infinite.
+    constexpr double Unbounded = std::numeric_limits<double>::infinity();
+
+    constexpr Mode Modes[] = {
+            {MathAccuracy::Fast, "fast", {2., 2., 3.5, 3.5, 3.5, 2., Unbounded}},
+            {MathAccuracy::Balanced, "balanced", {1., 1., 2.5, 2.5, 2.5, 1., 1.}},
+            {MathAccuracy::Precise, "precise", {1., 1., 1., 1., 1., 1., 1.}}
+    };
+
+    // Signed zeros and the edges of the domains the kernels cover.
+    constexpr double Edges[] = {0., -0., 1., -1., 0.4375, 0.6875, 1.1875, 2.4375, 1e5, -1e5, 1e-300};
+}
+
+int main() {
+    if constexpr (std::numeric_limits<long double>::digits <= std::numeric_limits<double>::digits) {
+        std::puts("long double is no wider than double; no reference to compare against");
+        return 0;
+    }
+
+    std::mt19937_64 random{7};
+    std::uniform_real_distribution<double> wide{-1e5, 1e5};
+    std::uniform_real_distribution<double> narrow{-10., 10.};
+    std::uniform_real_distribution<double> unit{-1., 1.};
+    std::uniform_real_distribution<double> exponent{-30., 30.};
+    std::uniform_int_distribution<int> scale{0, 40};
+    bool passed = true;
+
+    for (const auto &mode: Modes) {
+        double worst[Functions]{};
+
+        auto check = [&worst](Function f, double got, long double exact) {
+            worst[f] = std::fmax(worst[f], UlpError(got, exact));
+        };
+
+        SetMathAccuracy(mode.accuracy);
+
+        for (double x: Edges) {
+            check(Sine, Sin(x), std::sin(static_cast<long double>(x)));
+            check(Tangent, Tan(x), std::tan(static_cast<long double>(x)));
+            check(Arctangent, Atan(x), std::atan(static_cast<long double>(x)));
+
+            if (std::fabs(x) <= 1.) {
+                check(Arcsine, Asin(x), std::asin(static_cast<long double>(x)));
+                check(Arccosine, Acos(x), std::acos(static_cast<long double>(x)));
+            }
+        }
+
+        for (int i = 0; i < Samples; ++i) {
+            // Alternately the whole reduced range, the first few quadrants and
+            // tiny arguments.
+            double x = i % 3 == 0 ? wide(random)
+                                  : i % 3 == 1 ? narrow(random) : std::ldexp(unit(random), -scale(random));
+            double y = i % 2 ? unit(random) : std::ldexp(unit(random), -scale(random));
+            double base = std::fabs(x) * 1e-3 + 1e-3, power = exponent(random);
+            const auto lx = static_cast<long double>(x), ly = static_cast<long double>(y);
+
+            check(Sine, Sin(x), std::sin(lx));
+            check(Cosine, Cos(x), std::cos(lx));
+            check(Tangent, Tan(x), std::tan(lx));
+            check(Arcsine, Asin(y), std::asin(ly));
+            check(Arccosine, Acos(y), std::acos(ly));
+            check(Arctangent, Atan(x), std::atan(lx));
+            check(Power, Pow(base, power),
+                  std::pow(static_cast<long double>(base), static_cast<long double>(power)));
+        }
+
+        std::printf("%-9s", mode.name);
+
+        for (int f = 0; f < Functions; ++f) {
+            std::printf(" %s %.3f", Names[f], worst[f]);
+            passed &= worst[f] < mode.bound[f];
+        }
+        std::puts("");
+    }
+
+    std::puts(passed ? "within bounds" : "BOUND EXCEEDED");
+    return passed ? 0 : 1;
+}
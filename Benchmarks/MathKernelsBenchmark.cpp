@@ -0,0 +1,81 @@
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <span>
+#include <vector>
+#include <algorithm>
+
+import CalcBackend_MathKernels;
+
+using namespace Calculator;
+
+// Time per element of the bulk math functions in every accuracy mode, best of
+// a few runs over a column of random arguments. Precise is the C library
+// called one element at a time, the baseline the kernels are measured against.
+
+namespace {
+    constexpr size_t Elements = 1 << 20;
+    constexpr int Runs = 5;
+
+    struct Function {
+        const char *name;
+        void (*apply)(std::span<double>);
+        double low, high;
+    };
+
+    constexpr Function Functions[] = {
+            {"sin", Sin, -1e3, 1e3},
+            {"cos", Cos, -1e3, 1e3},
+            {"tan", Tan, -1e3, 1e3},
+            {"asin", Asin, -1., 1.},
+            {"acos", Acos, -1., 1.},
+            {"atan", Atan, -1e3, 1e3}
+    };
+
+    struct Mode {
+        MathAccuracy accuracy;
+        const char *name;
+    };
+
+    constexpr Mode Modes[] = {
+            {MathAccuracy::Fast, "fast"},
+            {MathAccuracy::Balanced, "balanced"},
+            {MathAccuracy::Precise, "precise"}
+    };
+}
+
+int main() {
+    using Clock = std::chrono::steady_clock;
+
+    std::mt19937_64 random{7};
+    std::vector<double> arguments(Elements), column(Elements);
+
+    std::printf("%-6s", "ns");
+    for (const auto &mode: Modes)
+        std::printf(" %9s", mode.name);
+    std::puts("");
+
+    for (const auto &f: Functions) {
+        std::uniform_real_distribution<double> domain{f.low, f.high};
+        std::ranges::generate(arguments, [&] { return domain(random); });
+
+        std::printf("%-6s", f.name);
+
+        for (const auto &mode: Modes) {
+            auto best = Clock::duration::max();
+
+            SetMathAccuracy(mode.accuracy);
+
+            for (int run = 0; run < Runs; ++run) {
+                column = arguments;
+
+                const auto start = Clock::now();
+                f.apply(column);
+                best = std::min(best, Clock::now() - start);
+            }
+
+            std::printf(" %9.2f", std::chrono::duration<double, std::nano>(best).count() / Elements);
+        }
+        std::puts("");
+    }
+}
@@ -0,0 +1,123 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+import CalcUtilities;
+
+using namespace Calculator;
+using std::vector;
+
+// Pushes per second from 1 to 8 threads into one PushBuffer, drained by the
+// main thread as the interpreter drains a stack's feed, against the same
+// traffic through a mutex-guarded deque. Each producer pushes an increasing
+// sequence, so the drain also checks that every producer's values arrive in
+// order.
+//
+// The interesting numbers are the contended ones, which need as many cores as
+// producers plus one for the drain; with fewer, the threads mostly take turns
+// and both queues look uncontended.
+
+namespace {
+    constexpr long Pushes = 4'000'000;
+    constexpr double Stride = 1e9;      // producer p pushes p * Stride + i
+
+    using Clock = std::chrono::steady_clock;
+
+    double Seconds(Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    double LockFree(int producers, long &outOfOrder) {
+        PushBuffer<double> buffer{1 << 16};
+        vector<long> last(producers, -1);
+        const long each = Pushes / producers;
+        long taken{0};
+
+        const auto start = Clock::now();
+        {
+            vector<std::jthread> threads;
+
+            for (int p = 0; p < producers; ++p)
+                threads.emplace_back([&buffer, each, p] {
+                    for (long i = 0; i < each; ++i)
+                        buffer.Push(p * Stride + static_cast<double>(i));
+                });
+
+            while (taken < each * producers) {
+                auto n = buffer.Drain([&last, &outOfOrder](const double &v) {
+                    const auto p = static_cast<int>(v / Stride);
+                    const auto i = static_cast<long>(v - p * Stride);
+
+                    if (i <= last[p])
+                        ++outOfOrder;
+
+                    last[p] = i;
+                });
+
+                taken += static_cast<long>(n);
+
+                if (n == 0)
+                    std::this_thread::yield();
+            }
+        }
+        return static_cast<double>(taken) / Seconds(start);
+    }
+
+    double Locked(int producers) {
+        std::mutex mutex;
+        std::deque<double> queue;
+        const long each = Pushes / producers;
+        long taken{0};
+
+        const auto start = Clock::now();
+        {
+            vector<std::jthread> threads;
+
+            for (int p = 0; p < producers; ++p)
+                threads.emplace_back([&mutex, &queue, each, p] {
+                    for (long i = 0; i < each; ++i) {
+                        std::lock_guard lock{mutex};
+                        queue.push_back(p * Stride + static_cast<double>(i));
+                    }
+                });
+
+            while (taken < each * producers) {
+                size_t n;
+                {
+                    std::lock_guard lock{mutex};
+                    n = queue.size();
+                    queue.clear();
+                }
+
+                taken += static_cast<long>(n);
+
+                if (n == 0)
+                    std::this_thread::yield();
+            }
+        }
+        return static_cast<double>(taken) / Seconds(start);
+    }
+}
+
+int main() {
+    std::printf("%u hardware threads\n", std::thread::hardware_concurrency());
+    std::printf("%-9s %16s %16s\n", "threads", "PushBuffer M/s", "mutex M/s");
+
+    long outOfOrder{0};
+
+    for (int producers: {1, 2, 4, 8}) {
+        const double lockFree = LockFree(producers, outOfOrder);
+        const double locked = Locked(producers);
+
+        std::printf("%-9d %16.1f %16.1f\n", producers, lockFree / 1e6, locked / 1e6);
+    }
+
+    if (outOfOrder != 0) {
+        std::printf("%ld values out of order\n", outOfOrder);
+        return 1;
+    }
+}
@@ -0,0 +1,95 @@
+#include <cstdio>
+#include <format>
+#include <string>
+#include <vector>
+#include "../Utilities/Exception.h"
+
+import CalcBackend_Stack;
+import CalcBackend_Command;
+import CalcBackend_CoreCommands;
+import CalcBackend_StoredProcedure;
+import CalcUtilities;
+
+using namespace Calculator;
+using std::vector;
+
+// A stored procedure object can run again without an undo in between: as a
+// macro step when the macro is called in a loop, or directly in a loop of
+// another procedure. Each of those runs must start from the stack it finds;
+// only an execution after an undo is a redo that puts the stored result
+// back. Checks both undo modes of the inner procedure, then undo and redo of
+// the loop around it.
+
+namespace {
+    constexpr int Passes = 3;
+
+    CommandPtr Procedure(const string &text, const StoredProcedure<double>::Resolver &resolve) {
+        return MakeCommandPtr<StoredProcedure<double>>("test", Tokenizer{text}, resolve);
+    }
+
+    bool Expect(const char *what, double top) {
+        auto &stack = BasicStack<double>::Instance();
+
+        if (stack.Size() == 1 && stack.Peek() == top)
+            return true;
+
+        std::printf("%s: expected %g, got %s%g\n", what, top, stack.Size() == 1 ? "" : "a deeper stack, top ",
+                    stack.Size() > 0 ? stack.Peek() : 0.);
+        return false;
+    }
+
+    bool Check(const char *name, const string &mode, bool throughMacro) {
+        auto &stack = BasicStack<double>::Instance();
+
+        auto inner = Procedure(mode + " 1 +", [](const string &token) -> CommandPtr {
+            if (token == "1")
+                return MakeCommandPtr<EnterNumber<double>>(1.);
+            if (token == "+")
+                return MakeCommandPtr<Add<double>>();
+            return {nullptr, &CommandDeleter};
+        });
+
+        vector<CommandPtr> steps;
+        steps.push_back(MakeCommandPtr(inner->clone()));
+        auto macro = MakeCommandPtr<Macro>("Macro: proc:inc", std::move(steps));
+
+        auto loop = Procedure(std::format("repeat:{} inc end", Passes), [&](const string &token) -> CommandPtr {
+            if (token == "inc")
+                return MakeCommandPtr(throughMacro ? macro->clone() : inner->clone());
+            return {nullptr, &CommandDeleter};
+        });
+
+        stack.Clear();
+        stack.Push(0.);
+
+        bool passed = true;
+
+        loop->execute();
+        passed &= Expect(name, Passes);
+
+        loop->undo();
+        passed &= Expect(name, 0.);
+
+        loop->execute();
+        passed &= Expect(name, Passes);
+
+        return passed;
+    }
+}
+
+int main() {
+    bool passed = true;
+
+    try {
+        passed &= Check("whole procedure in a loop", "undo:whole", false);
+        passed &= Check("whole procedure in a macro in a loop", "undo:whole", true);
+        passed &= Check("procedure without undo in a loop", "undo:none", false);
+        passed &= Check("procedure without undo in a macro in a loop", "undo:none", true);
+    } catch (const Exception &e) {
+        std::printf("%s\n", e.What().c_str());
+        passed = false;
+    }
+
+    std::puts(passed ? "replays as expected" : "REPLAY WRONG");
+    return passed ? 0 : 1;
+}
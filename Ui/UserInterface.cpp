@@ -4,16 +4,25 @@ module;
 #include <iostream>
 #include <memory>
 #include <string_view>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <exception>
+#include <type_traits>
+#include <any>
 
 export module UserInterface;
 
 import CalcUtilities;
+import CalcBackend_Stack;
+import CalcBackend_Numeric;
 
 using std::unique_ptr;
 using std::string;
 using std::string_view;
 using std::istream;
 using std::ostream;
+using std::vector;
 
 namespace Calculator {
 
@@ -32,22 +41,325 @@ namespace Calculator {
 
     export class Cli : public UserInterface {
     public:
-        Cli(istream&, ostream&);
+        // mode selects which stack is rendered; it must match the mode of the
+        // CommandInterpreter attached to this Cli.
+        Cli(istream&, ostream&, NumberMode mode = NumberMode::Double);
         ~Cli() = default;
 
+        // Runs reading/tokenizing, command execution and output rendering as
+        // three coroutine stages, each on its own strand, connected by bounded
+        // channels. Only the engine strand ever touches the interpreter and the
+        // stack; blocking reads and writes happen on the other two.
         void Execute(bool suppressStartupMessage = false, bool echo = false);
 
+        struct BatchOptions {
+            size_t blockSize = 64 * 1024;   // bytes read from the input at a time
+            size_t flushBytes = 64 * 1024;  // output buffered before it is written
+            size_t flushLines = 0;          // if not 0, also written every flushLines lines
+        };
+
+        // For piped scripts: reads the input in blocks and writes the output
+        // in large chunks, flushing the stream only at the end. The output is
+        // the same, byte for byte, as Execute's without echo.
+        void ExecuteBatch(bool suppressStartupMessage, BatchOptions options);
+
+        void ExecuteBatch(bool suppressStartupMessage = false);
+
+        void SetNumberFormat(NumberFormat format);
+
     private:
+        using Tokens = vector<string>;
+        using Lines = vector<Tokens>;
+
         void PostMessage(std::string_view message) override;
         void StackChanged() override;
         void StartupMessage();
 
+        void Run(bool suppressStartupMessage, Task reader, Task engine, Task writer);
+
+        // Tokens of one input line, as entered; returns true if the line ends
+        // the session.
+        static bool ParseLine(const string &line, Tokens &tokens);
+
+        Task ReadInput(Channel<Lines> &commands);
+        Task ReadBlocks(Channel<Lines> &commands, size_t blockSize);
+        Task ExecuteCommands(Channel<Lines> &commands, Channel<string> &output, bool echo,
+                             size_t flushBytes, size_t flushLines);
+        Task RenderOutput(Channel<string> &output, bool flushEach);
+
+        string RenderStack();
+
+        // A displayed number's text, reused while the number stays at the
+        // same position from the bottom of the stack.
+        template<typename T>
+        struct RenderedNumber {
+            size_t position;
+            T value;
+            string text;
+        };
+
         Cli(const Cli&) = delete;
         Cli(Cli&&) = delete;
         Cli& operator=(Cli&) = delete;
         Cli& operator=(Cli&&) = delete;
 
-        istream _istream;
-        ostream _ostream;
+        static constexpr size_t ChannelCapacity = 16;
+        static constexpr size_t MaxStackDisplay = 4;
+
+        istream &_istream;
+        ostream &_ostream;
+        NumberMode _mode;
+        string _pending;
+        bool _stackChanged;
+        NumberFormat _format;
+        std::any _rendered;     // vector<RenderedNumber<T>> of the last render
     };
+
+    Cli::Cli(istream &is, ostream &os, NumberMode mode)
+            : _istream{is}, _ostream{os}, _mode{mode}, _stackChanged{false}, _format{} {}
+
+    void Cli::Execute(bool suppressStartupMessage, bool echo) {
+        Channel<Lines> commands{ChannelCapacity};
+        Channel<string> output{ChannelCapacity};
+
+        Run(suppressStartupMessage, ReadInput(commands), ExecuteCommands(commands, output, echo, 0, 1),
+            RenderOutput(output, true));
+    }
+
+    void Cli::ExecuteBatch(bool suppressStartupMessage, BatchOptions options) {
+        Channel<Lines> commands{ChannelCapacity};
+        Channel<string> output{ChannelCapacity};
+
+        Run(suppressStartupMessage, ReadBlocks(commands, options.blockSize),
+            ExecuteCommands(commands, output, false, options.flushBytes, options.flushLines),
+            RenderOutput(output, false));
+    }
+
+    void Cli::ExecuteBatch(bool suppressStartupMessage) {
+        ExecuteBatch(suppressStartupMessage, BatchOptions{});
+    }
+
+    void Cli::Run(bool suppressStartupMessage, Task reader, Task engine, Task writer) {
+        if (!suppressStartupMessage)
+            StartupMessage();
+
+        Strand inputStrand, engineStrand, outputStrand;
+
+        reader.Start(inputStrand);
+        engine.Start(engineStrand);
+        writer.Start(outputStrand);
+
+        reader.Wait();
+        engine.Wait();
+        writer.Wait();
+
+        for (const auto *t: {&reader, &engine, &writer}) {
+            if (auto e = t->Error())
+                std::rethrow_exception(e);
+        }
+    }
+
+    bool Cli::ParseLine(const string &line, Tokens &tokens) {
+        Tokenizer tokenizer{line};
+        tokens.assign(tokenizer.begin(), tokenizer.end());
+
+        auto exit = std::ranges::find_if(tokens, [](const auto &t) { return t == "exit" || t == "quit"; });
+        const bool done = exit != tokens.end();
+        tokens.erase(exit, tokens.end());
+
+        // A line entered with a trailing Tab only asks for the completions
+        // of its last word; nothing on it is executed.
+        if (!done && line.ends_with('\t')) {
+            string prefix = tokens.empty() ? string{} : std::move(tokens.back());
+
+            tokens.assign(1, "complete:" + prefix);
+        }
+        return done;
+    }
+
+    Task Cli::ReadInput(Channel<Lines> &commands) {
+        Channel<Lines>::Closer closeCommands{commands};
+
+        for (string line; std::getline(_istream, line);) {
+            Lines lines(1);
+            const bool done = ParseLine(line, lines.front());
+
+            if (!lines.front().empty() && !co_await commands.Push(std::move(lines)))
+                break;
+
+            if (done)
+                break;
+        }
+    }
+
+    // Lines are split exactly as getline splits them, so both readers see the
+    // same commands; a block's lines travel through the channel together.
+    Task Cli::ReadBlocks(Channel<Lines> &commands, size_t blockSize) {
+        Channel<Lines>::Closer closeCommands{commands};
+
+        vector<char> block(std::max<size_t>(blockSize, 1));
+        string line;
+        bool done{false};
+
+        auto parse = [&line, &done](Lines &lines) {
+            Tokens tokens;
+            done = ParseLine(line, tokens);
+            line.clear();
+
+            if (!tokens.empty())
+                lines.push_back(std::move(tokens));
+        };
+
+        while (!done) {
+            _istream.read(block.data(), static_cast<std::streamsize>(block.size()));
+
+            string_view data{block.data(), static_cast<size_t>(_istream.gcount())};
+            const bool end = data.size() < block.size();
+            Lines lines;
+
+            for (auto eol = data.find('\n'); eol != string_view::npos && !done; eol = data.find('\n')) {
+                line += data.substr(0, eol);
+                data.remove_prefix(eol + 1);
+                parse(lines);
+            }
+
+            if (!done) {
+                line += data;
+
+                // Like getline, a last line without a newline still counts.
+                if (end && !line.empty())
+                    parse(lines);
+            }
+
+            if (!lines.empty() && !co_await commands.Push(std::move(lines)))
+                break;
+
+            if (end)
+                break;
+        }
+    }
+
+    // Output is handed to the writer once flushBytes are pending or after
+    // flushLines lines, whichever comes first, and at the end.
+    Task Cli::ExecuteCommands(Channel<Lines> &commands, Channel<string> &output, bool echo,
+                              size_t flushBytes, size_t flushLines) {
+        Channel<Lines>::Closer closeCommands{commands};
+        Channel<string>::Closer closeOutput{output};
+
+        size_t lines{0};
+        bool open{true};
+
+        while (open) {
+            auto batch = co_await commands.Pop();
+
+            if (batch) {
+                for (const auto &tokens: *batch) {
+                    for (const auto &t: tokens) {
+                        if (echo)
+                            _pending += t + "\n";
+
+                        Raise(CommandEntered(), t);
+                    }
+
+                    // Stack changes are coalesced and rendered once per input line.
+                    if (std::exchange(_stackChanged, false))
+                        _pending += RenderStack();
+
+                    ++lines;
+                }
+            }
+
+            const bool flush = !batch || _pending.size() >= flushBytes || (flushLines && lines >= flushLines);
+
+            if (flush && !_pending.empty()) {
+                auto chunk = std::exchange(_pending, {});
+                _pending.reserve(flushBytes);
+                lines = 0;
+
+                if (!co_await output.Push(std::move(chunk)))
+                    break;
+            }
+            open = batch.has_value();
+        }
+    }
+
+    Task Cli::RenderOutput(Channel<string> &output, bool flushEach) {
+        Channel<string>::Closer closeOutput{output};
+
+        while (auto text = co_await output.Pop()) {
+            _ostream.write(text->data(), static_cast<std::streamsize>(text->size()));
+
+            if (flushEach)
+                _ostream.flush();
+        }
+        _ostream.flush();
+    }
+
+    void Cli::PostMessage(string_view message) {
+        _pending += message;
+        _pending += '\n';
+    }
+
+    void Cli::StackChanged() {
+        _stackChanged = true;
+    }
+
+    void Cli::SetNumberFormat(NumberFormat format) {
+        _format = format;
+        _rendered.reset();
+    }
+
+    // Only numbers that moved or changed since the last render are formatted
+    // again, so a push onto a full display formats one number.
+    string Cli::RenderStack() {
+        return VisitNumberMode(_mode, [this]<typename T>(std::type_identity<T>) {
+            using Rendered = vector<RenderedNumber<T>>;
+
+            auto &stack = BasicStack<T>::Instance();
+            auto *previous = std::any_cast<Rendered>(&_rendered);
+
+            if (!previous)
+                previous = &_rendered.emplace<Rendered>();
+
+            const auto n = std::min(stack.Size(), MaxStackDisplay);
+            Rendered current;
+            string s;
+
+            current.reserve(n);
+
+            for (auto i = MaxStackDisplay; i > n; --i) {
+                s += std::to_string(i);
+                s += ":\n";
+            }
+
+            for (auto i = n; i > 0; --i) {
+                auto value = stack.Peek(i - 1);
+                const auto position = stack.Size() - i;
+                auto hit = std::ranges::find_if(*previous, [&](const auto &r) {
+                    return r.position == position && NumberTraits<T>::Identical(r.value, value);
+                });
+                string text;
+
+                if (hit != previous->end())
+                    text = std::move(hit->text);
+                else
+                    NumberTraits<T>::Format(text, value, _format);
+
+                s += std::to_string(i);
+                s += ":\t";
+                s += text;
+                s += '\n';
+                current.push_back({position, std::move(value), std::move(text)});
+            }
+
+            *previous = std::move(current);
+            return s;
+        });
+    }
+
+    void Cli::StartupMessage() {
+        _ostream << "Practical calculator\n"
+                 << "Type 'help' for a list of commands, 'exit' to quit.\n\n"
+                 << std::flush;
+    }
 }
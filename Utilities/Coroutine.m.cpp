@@ -0,0 +1,327 @@
+module;
+
+#include <coroutine>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <stop_token>
+#include <thread>
+#include <memory>
+#include <optional>
+#include <exception>
+#include <algorithm>
+#include <utility>
+
+export module CalcUtilities:Coroutine;
+
+using std::coroutine_handle;
+using std::deque;
+using std::mutex;
+using std::condition_variable;
+using std::condition_variable_any;
+using std::lock_guard;
+using std::unique_lock;
+using std::jthread;
+using std::shared_ptr;
+using std::optional;
+
+namespace Calculator {
+
+    // A single thread that resumes posted coroutines one at a time. Coroutines
+    // suspended on a Channel are resumed on the strand they were running on, so
+    // each pipeline stage stays pinned to its own thread.
+    export class Strand {
+    public:
+        Strand();
+
+        ~Strand() = default;
+
+        void Post(coroutine_handle<> h);
+
+        static Strand *Current() { return _current; }
+
+    private:
+        void Run(std::stop_token st);
+
+        Strand(const Strand &) = delete;
+        Strand(Strand &&) = delete;
+        Strand &operator=(const Strand &) = delete;
+        Strand &operator=(Strand &&) = delete;
+
+        inline static thread_local Strand *_current = nullptr;
+
+        mutex _mutex;
+        condition_variable_any _cv;
+        deque<coroutine_handle<>> _ready;
+        jthread _thread;
+    };
+
+    Strand::Strand() : _thread{[this](std::stop_token st) { Run(st); }} {}
+
+    void Strand::Post(coroutine_handle<> h) {
+        {
+            lock_guard lock{_mutex};
+            _ready.push_back(h);
+        }
+        _cv.notify_one();
+    }
+
+    void Strand::Run(std::stop_token st) {
+        _current = this;
+
+        while (true) {
+            coroutine_handle<> h;
+            {
+                unique_lock lock{_mutex};
+                if (!_cv.wait(lock, st, [this] { return !_ready.empty(); }))
+                    return;
+
+                h = _ready.front();
+                _ready.pop_front();
+            }
+            h.resume();
+        }
+    }
+
+    // Lazily started coroutine. Start() schedules it on a strand and Wait()
+    // blocks the calling (non-strand) thread until the body has finished.
+    export class Task {
+        struct State {
+            mutex m;
+            condition_variable cv;
+            bool done{false};
+            std::exception_ptr error;
+        };
+
+    public:
+        struct promise_type;
+
+    private:
+        struct FinalAwaiter {
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(coroutine_handle<promise_type> h) noexcept;
+
+            void await_resume() const noexcept {}
+        };
+
+    public:
+        struct promise_type {
+            Task get_return_object() { return Task{coroutine_handle<promise_type>::from_promise(*this)}; }
+
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+
+            FinalAwaiter final_suspend() const noexcept { return {}; }
+
+            void return_void() const noexcept {}
+
+            void unhandled_exception() noexcept { state->error = std::current_exception(); }
+
+            shared_ptr<State> state = std::make_shared<State>();
+        };
+
+        Task(Task &&rhs) noexcept;
+
+        ~Task();
+
+        void Start(Strand &strand) { strand.Post(_handle); }
+
+        void Wait() const;
+
+        std::exception_ptr Error() const { return _state->error; }
+
+    private:
+        explicit Task(coroutine_handle<promise_type> h) : _handle{h}, _state{h.promise().state} {}
+
+        Task(const Task &) = delete;
+        Task &operator=(const Task &) = delete;
+        Task &operator=(Task &&) = delete;
+
+        coroutine_handle<promise_type> _handle;
+        shared_ptr<State> _state;
+    };
+
+    void Task::FinalAwaiter::await_suspend(coroutine_handle<promise_type> h) noexcept {
+        // Hold the state ourselves: once done is published the waiter may
+        // destroy the frame that owns the promise.
+        auto state = h.promise().state;
+        {
+            lock_guard lock{state->m};
+            state->done = true;
+        }
+        state->cv.notify_all();
+    }
+
+    Task::Task(Task &&rhs) noexcept
+            : _handle{std::exchange(rhs._handle, nullptr)}, _state{std::move(rhs._state)} {}
+
+    Task::~Task() {
+        if (_handle)
+            _handle.destroy();
+    }
+
+    void Task::Wait() const {
+        unique_lock lock{_state->m};
+        _state->cv.wait(lock, [this] { return _state->done; });
+    }
+
+    // Bounded multi-producer/multi-consumer queue whose Push and Pop suspend the
+    // awaiting coroutine instead of blocking its thread. Once closed, Push
+    // yields false and Pop drains the remaining items and then yields nullopt.
+    export template<typename T>
+    class Channel {
+        struct PushWaiter {
+            coroutine_handle<> handle;
+            Strand *strand;
+            T *value;
+            bool *accepted;
+        };
+
+        struct PopWaiter {
+            coroutine_handle<> handle;
+            Strand *strand;
+            optional<T> *slot;
+        };
+
+        class PushAwaiter {
+        public:
+            PushAwaiter(Channel &c, T value) : _channel{c}, _value{std::move(value)} {}
+
+            bool await_ready() const noexcept { return false; }
+
+            bool await_suspend(coroutine_handle<> h) { return _channel.SuspendPush(h, _value, _accepted); }
+
+            bool await_resume() const noexcept { return _accepted; }
+
+        private:
+            Channel &_channel;
+            T _value;
+            bool _accepted{false};
+        };
+
+        class PopAwaiter {
+        public:
+            explicit PopAwaiter(Channel &c) : _channel{c} {}
+
+            bool await_ready() const noexcept { return false; }
+
+            bool await_suspend(coroutine_handle<> h) { return _channel.SuspendPop(h, _slot); }
+
+            optional<T> await_resume() { return std::move(_slot); }
+
+        private:
+            Channel &_channel;
+            optional<T> _slot;
+        };
+
+    public:
+        // Closes the channel however the owning stage exits, so its peers are
+        // never left suspended on it.
+        class Closer {
+        public:
+            explicit Closer(Channel &c) : _channel{c} {}
+
+            ~Closer() { _channel.Close(); }
+
+        private:
+            Channel &_channel;
+        };
+
+        explicit Channel(size_t capacity) : _capacity{std::max(capacity, size_t{1})} {}
+
+        ~Channel() = default;
+
+        PushAwaiter Push(T value) { return PushAwaiter{*this, std::move(value)}; }
+
+        PopAwaiter Pop() { return PopAwaiter{*this}; }
+
+        void Close();
+
+    private:
+        bool SuspendPush(coroutine_handle<> h, T &value, bool &accepted);
+
+        bool SuspendPop(coroutine_handle<> h, optional<T> &slot);
+
+        Channel(const Channel &) = delete;
+        Channel(Channel &&) = delete;
+        Channel &operator=(const Channel &) = delete;
+        Channel &operator=(Channel &&) = delete;
+
+        mutex _mutex;
+        deque<T> _items;
+        deque<PushWaiter> _pushers;
+        deque<PopWaiter> _poppers;
+        size_t _capacity;
+        bool _closed{false};
+    };
+
+    template<typename T>
+    bool Channel<T>::SuspendPush(coroutine_handle<> h, T &value, bool &accepted) {
+        lock_guard lock{_mutex};
+
+        if (_closed)
+            return false;
+
+        if (!_poppers.empty()) {
+            auto waiter = _poppers.front();
+            _poppers.pop_front();
+            *waiter.slot = std::move(value);
+            accepted = true;
+            waiter.strand->Post(waiter.handle);
+            return false;
+        }
+
+        if (_items.size() < _capacity) {
+            _items.push_back(std::move(value));
+            accepted = true;
+            return false;
+        }
+
+        _pushers.push_back({h, Strand::Current(), &value, &accepted});
+        return true;
+    }
+
+    template<typename T>
+    bool Channel<T>::SuspendPop(coroutine_handle<> h, optional<T> &slot) {
+        lock_guard lock{_mutex};
+
+        if (!_items.empty()) {
+            slot = std::move(_items.front());
+            _items.pop_front();
+
+            if (!_pushers.empty()) {
+                auto waiter = _pushers.front();
+                _pushers.pop_front();
+                _items.push_back(std::move(*waiter.value));
+                *waiter.accepted = true;
+                waiter.strand->Post(waiter.handle);
+            }
+            return false;
+        }
+
+        if (_closed)
+            return false;
+
+        _poppers.push_back({h, Strand::Current(), &slot});
+        return true;
+    }
+
+    template<typename T>
+    void Channel<T>::Close() {
+        lock_guard lock{_mutex};
+
+        if (_closed)
+            return;
+
+        _closed = true;
+
+        for (const auto &w: _poppers)
+            w.strand->Post(w.handle);
+
+        for (const auto &w: _pushers)
+            w.strand->Post(w.handle);
+
+        _poppers.clear();
+        _pushers.clear();
+    }
+}
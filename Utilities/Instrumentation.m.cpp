@@ -0,0 +1,311 @@
+module;
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#define CALC_HAS_TSC
+#elif defined(__x86_64__)
+#include <x86intrin.h>
+#define CALC_HAS_TSC
+#endif
+
+export module CalcUtilities:Instrumentation;
+
+using std::string;
+using std::string_view;
+using std::unique_ptr;
+using std::shared_ptr;
+using std::vector;
+
+namespace Calculator {
+
+    // Building without CALC_INSTRUMENTATION turns every Probe and ProbeLabel
+    // into an empty object the compiler removes.
+    export inline constexpr bool InstrumentationEnabled =
+#ifdef CALC_INSTRUMENTATION
+            true;
+#else
+            false;
+#endif
+
+    export enum class ProbeSite : std::uint8_t {
+        Execute, Undo, Allocate, IsNum, Raise
+    };
+
+    inline constexpr size_t ProbeSiteCount = 5;
+
+    struct ProbeLabelData;
+
+    inline std::uint64_t ProbeTicks() noexcept {
+#ifdef CALC_HAS_TSC
+        return __rdtsc();
+#else
+        return static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+
+    void RecordProbe(ProbeSite site, std::uint64_t ticks);
+
+    // Times its own lifetime and records it under the current label of the
+    // calling thread.
+    export class Probe {
+    public:
+        explicit Probe(ProbeSite site) noexcept
+                : _site{site}, _start{InstrumentationEnabled ? ProbeTicks() : 0} {}
+
+        ~Probe() {
+            if constexpr (InstrumentationEnabled)
+                RecordProbe(_site, ProbeTicks() - _start);
+        }
+
+    private:
+        Probe(const Probe &) = delete;
+        Probe &operator=(const Probe &) = delete;
+
+        ProbeSite _site;
+        std::uint64_t _start;
+    };
+
+    // Names what the calling thread is doing, usually the command being
+    // interpreted, until it goes out of scope. Probes outside any label are
+    // reported as "(none)".
+    export class ProbeLabel {
+    public:
+        explicit ProbeLabel(string_view label);
+
+        ~ProbeLabel();
+
+    private:
+        ProbeLabel(const ProbeLabel &) = delete;
+        ProbeLabel &operator=(const ProbeLabel &) = delete;
+
+        ProbeLabelData *_previous;
+    };
+
+    // Count, p50, p99 and p99.9 of every label and site, merged over all
+    // threads that ever recorded.
+    export string InstrumentationReport();
+
+    namespace {
+        // Ticks are converted to nanoseconds against the steady clock over
+        // the whole time the process has been recording.
+        struct Calibration {
+            std::uint64_t ticks{ProbeTicks()};
+            std::chrono::steady_clock::time_point time{std::chrono::steady_clock::now()};
+
+            double NanosecondsPerTick() const {
+                const auto t = ProbeTicks();
+                const auto ns = std::chrono::duration<double, std::nano>{std::chrono::steady_clock::now() - time};
+
+                return t > ticks ? ns.count() / static_cast<double>(t - ticks) : 1.;
+            }
+        };
+
+        const Calibration &GetCalibration() {
+            static const Calibration calibration;
+            return calibration;
+        }
+    }
+
+    // Log-linear buckets in the manner of an HDR histogram: values below
+    // SubBuckets are exact, larger ones keep SubBucketBits significant
+    // bits, a relative error under 1/SubBuckets at every magnitude.
+    // Only the owning thread records, so counts need no read-modify-write.
+    class Histogram {
+    public:
+        static constexpr unsigned SubBucketBits = 5;
+        static constexpr std::uint64_t SubBuckets = 1u << SubBucketBits;
+        static constexpr size_t BucketCount = (64 - SubBucketBits + 1) * SubBuckets;
+
+        void Record(std::uint64_t v) noexcept {
+            auto &c = _counts[Bucket(v)];
+            c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        void AddTo(vector<std::uint64_t> &counts) const {
+            for (size_t i = 0; i < BucketCount; ++i)
+                counts[i] += _counts[i].load(std::memory_order_relaxed);
+        }
+
+        static size_t Bucket(std::uint64_t v) noexcept {
+            if (v < SubBuckets)
+                return v;
+
+            const auto shift = static_cast<unsigned>(std::bit_width(v)) - 1 - SubBucketBits;
+            return (shift + 1) * SubBuckets + ((v >> shift) - SubBuckets);
+        }
+
+        // Largest value that falls into bucket i.
+        static std::uint64_t Highest(size_t i) noexcept {
+            if (i < SubBuckets)
+                return i;
+
+            const auto shift = i / SubBuckets - 1;
+            return ((i % SubBuckets + SubBuckets + 1) << shift) - 1;
+        }
+
+    private:
+        std::array<std::atomic<std::uint64_t>, BucketCount> _counts{};
+    };
+
+    // A site's histogram is only allocated once it records, since most
+    // labels only ever pass a few of the sites.
+    struct ProbeLabelData {
+        std::array<std::atomic<Histogram *>, ProbeSiteCount> sites{};
+
+        ~ProbeLabelData() {
+            for (auto &s: sites)
+                delete s.load(std::memory_order_relaxed);
+        }
+
+        void Record(ProbeSite site, std::uint64_t ticks) {
+            auto &s = sites[static_cast<size_t>(site)];
+            auto h = s.load(std::memory_order_relaxed);
+
+            if (!h) {
+                h = new Histogram;
+                s.store(h, std::memory_order_release);
+            }
+            h->Record(ticks);
+        }
+    };
+
+    namespace {
+        // One per thread, kept alive by the registry after the thread exits so
+        // its measurements stay in the report.
+        struct ThreadData {
+            std::mutex mutex;   // guards labels against a concurrent report
+            std::unordered_map<string, unique_ptr<ProbeLabelData>> labels;
+
+            ProbeLabelData *Find(string_view label) {
+                std::lock_guard lock{mutex};
+                auto &l = labels[string{label}];
+
+                if (!l)
+                    l = std::make_unique<ProbeLabelData>();
+
+                return l.get();
+            }
+        };
+
+        struct Registry {
+            std::mutex mutex;
+            vector<shared_ptr<ThreadData>> threads;
+        };
+
+        Registry &GetRegistry() {
+            static Registry registry;
+            return registry;
+        }
+
+        ThreadData &CurrentThread() {
+            thread_local auto data = [] {
+                auto d = std::make_shared<ThreadData>();
+                auto &r = GetRegistry();
+
+                GetCalibration();
+
+                std::lock_guard lock{r.mutex};
+                r.threads.push_back(d);
+                return d;
+            }();
+
+            return *data;
+        }
+
+        thread_local ProbeLabelData *currentLabel{nullptr};
+
+        ProbeLabelData &CurrentLabel() {
+            if (!currentLabel)
+                currentLabel = CurrentThread().Find("(none)");
+
+            return *currentLabel;
+        }
+
+        constexpr const char *SiteNames[ProbeSiteCount] = {"execute", "undo", "allocate", "isNum", "raise"};
+    }
+
+    void RecordProbe(ProbeSite site, std::uint64_t ticks) {
+        CurrentLabel().Record(site, ticks);
+    }
+
+    ProbeLabel::ProbeLabel(string_view label) : _previous{nullptr} {
+        if constexpr (InstrumentationEnabled) {
+            _previous = currentLabel;
+            currentLabel = CurrentThread().Find(label);
+        }
+    }
+
+    ProbeLabel::~ProbeLabel() {
+        if constexpr (InstrumentationEnabled)
+            currentLabel = _previous;
+    }
+
+    string InstrumentationReport() {
+        if constexpr (!InstrumentationEnabled)
+            return "Instrumentation was compiled out\n";
+
+        // Bucket counts per label and site, summed over the threads.
+        std::map<std::pair<string, size_t>, vector<std::uint64_t>> merged;
+        auto &r = GetRegistry();
+        {
+            std::lock_guard lock{r.mutex};
+
+            for (const auto &t: r.threads) {
+                std::lock_guard threadLock{t->mutex};
+
+                for (const auto &[label, data]: t->labels) {
+                    for (size_t s = 0; s < ProbeSiteCount; ++s) {
+                        if (auto h = data->sites[s].load(std::memory_order_acquire)) {
+                            auto &counts = merged[{label, s}];
+
+                            counts.resize(Histogram::BucketCount);
+                            h->AddTo(counts);
+                        }
+                    }
+                }
+            }
+        }
+
+        const auto nsPerTick = GetCalibration().NanosecondsPerTick();
+        string report = std::format("{:<16} {:<9} {:>10} {:>12} {:>12} {:>12}\n",
+                                    "command", "probe", "count", "p50", "p99", "p99.9");
+
+        for (const auto &[key, counts]: merged) {
+            std::uint64_t total{0};
+
+            for (auto c: counts)
+                total += c;
+
+            auto percentile = [&counts, total, nsPerTick](double q) {
+                const auto rank = static_cast<std::uint64_t>(q * static_cast<double>(total - 1)) + 1;
+                std::uint64_t seen{0};
+                size_t i{0};
+
+                while ((seen += counts[i]) < rank)
+                    ++i;
+
+                return std::format("{:.0f}ns", static_cast<double>(Histogram::Highest(i)) * nsPerTick);
+            };
+
+            report += std::format("{:<16} {:<9} {:>10} {:>12} {:>12} {:>12}\n",
+                                  key.first, SiteNames[key.second], total,
+                                  percentile(.5), percentile(.99), percentile(.999));
+        }
+        return report;
+    }
+}
@@ -0,0 +1,76 @@
+module;
+
+#include <memory>
+#include <utility>
+#include <cstddef>
+
+export module CalcUtilities:PersistentStack;
+
+using std::shared_ptr;
+
+namespace Calculator {
+
+    // Singly linked stack whose nodes are immutable and shared between
+    // copies, so copying one is O(1) and the copies then evolve
+    // independently. Push and Pop only ever create or drop the head node.
+    export template<typename E>
+    class PersistentStack {
+    public:
+        PersistentStack() = default;
+
+        PersistentStack(const PersistentStack &) = default;
+
+        PersistentStack(PersistentStack &&rhs) noexcept
+                : _head{std::move(rhs._head)}, _size{std::exchange(rhs._size, 0)} {}
+
+        PersistentStack &operator=(PersistentStack rhs) noexcept {
+            std::swap(_head, rhs._head);
+            std::swap(_size, rhs._size);
+            return *this;
+        }
+
+        ~PersistentStack() { Clear(); }
+
+        bool Empty() const { return !_head; }
+
+        size_t Size() const { return _size; }
+
+        const E &Top() const { return _head->value; }
+
+        void Push(E e) {
+            _head = std::make_shared<const Node>(Node{std::move(e), std::move(_head)});
+            ++_size;
+        }
+
+        void Pop() {
+            _head = _head->next;
+            --_size;
+        }
+
+        // Drops the nodes no other copy shares one at a time; letting the
+        // shared_ptrs unwind a long list would recurse once per node.
+        void Clear() {
+            while (_head && _head.use_count() == 1)
+                _head = shared_ptr<const Node>{_head->next};
+
+            _head.reset();
+            _size = 0;
+        }
+
+        // Calls f with every element, top first.
+        template<typename F>
+        void ForEach(F &&f) const {
+            for (auto n = _head.get(); n; n = n->next.get())
+                f(n->value);
+        }
+
+    private:
+        struct Node {
+            E value;
+            shared_ptr<const Node> next;
+        };
+
+        shared_ptr<const Node> _head;
+        size_t _size{0};
+    };
+}
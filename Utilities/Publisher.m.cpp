@@ -13,6 +13,7 @@ module;
 export module CalcUtilities:Publisher;
 
 import :Observer;
+import :Instrumentation;
 
 using std::string;
 using std::vector;
@@ -115,6 +116,7 @@ namespace Calculator {
     }
 
     void Publisher::Raise(const string &eventName, any data) const {
+        Probe probe{ProbeSite::Raise};
         const auto &obsList = FindChackedEvent(eventName)->second;
         ranges::for_each(
                 views::values(obsList),
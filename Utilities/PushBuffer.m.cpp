@@ -0,0 +1,114 @@
+module;
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <bit>
+#include <algorithm>
+
+export module CalcUtilities:PushBuffer;
+
+namespace Calculator {
+
+    // Bounded queue that any number of threads push into without locks and
+    // one thread drains, in the order the pushes claimed their slots. Each
+    // slot carries a sequence number that says whose turn it is: a producer
+    // claims a slot by advancing the tail, writes it, then publishes it; the
+    // consumer takes published slots and hands them back a lap later.
+    export template<typename E>
+    class PushBuffer {
+    public:
+        // capacity is rounded up to a power of two.
+        explicit PushBuffer(size_t capacity);
+
+        ~PushBuffer() = default;
+
+        // False if the buffer is full.
+        bool TryPush(const E &e);
+
+        // Waits for the consumer to make room if the buffer is full.
+        void Push(const E &e);
+
+        // Calls f with every element published so far, oldest first. Only one
+        // thread may drain.
+        template<typename F>
+        size_t Drain(F &&f);
+
+        // Whether an element is waiting, cheap enough to ask before every
+        // command. Only the draining thread may ask.
+        bool Ready() const {
+            const auto &slot = _slots[_head & _mask];
+            return slot.sequence.load(std::memory_order_acquire) == _head + 1;
+        }
+
+    private:
+        PushBuffer(const PushBuffer &) = delete;
+        PushBuffer(PushBuffer &&) = delete;
+        PushBuffer &operator=(const PushBuffer &) = delete;
+        PushBuffer &operator=(PushBuffer &&) = delete;
+
+        struct Slot {
+            std::atomic<size_t> sequence;
+            E value;
+        };
+
+        static constexpr size_t LineSize = 64;
+
+        std::unique_ptr<Slot[]> _slots;
+        size_t _mask;
+        alignas(LineSize) std::atomic<size_t> _tail{0};     // next slot a producer claims
+        alignas(LineSize) size_t _head{0};                  // next slot the consumer takes
+    };
+
+    template<typename E>
+    PushBuffer<E>::PushBuffer(size_t capacity)
+            : _slots{std::make_unique<Slot[]>(std::bit_ceil(std::max(capacity, size_t{2})))},
+              _mask{std::bit_ceil(std::max(capacity, size_t{2})) - 1} {
+        for (size_t i = 0; i <= _mask; ++i)
+            _slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    template<typename E>
+    bool PushBuffer<E>::TryPush(const E &e) {
+        auto pos = _tail.load(std::memory_order_relaxed);
+
+        for (;;) {
+            auto &slot = _slots[pos & _mask];
+            const auto sequence = slot.sequence.load(std::memory_order_acquire);
+            const auto lap = static_cast<std::ptrdiff_t>(sequence - pos);
+
+            if (lap == 0) {
+                if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.value = e;
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (lap < 0)
+                return false;
+            else
+                pos = _tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    template<typename E>
+    void PushBuffer<E>::Push(const E &e) {
+        while (!TryPush(e))
+            std::this_thread::yield();
+    }
+
+    template<typename E>
+    template<typename F>
+    size_t PushBuffer<E>::Drain(F &&f) {
+        size_t n{0};
+
+        for (; Ready(); ++n) {
+            auto &slot = _slots[_head & _mask];
+
+            f(slot.value);
+            slot.sequence.store(_head + _mask + 1, std::memory_order_release);
+            ++_head;
+        }
+        return n;
+    }
+}
@@ -24,6 +24,49 @@ namespace views = std::views;
 namespace Calculator {
 
     export class Tokenizer {
+        using Tokens = vector<string>;
 
+    public:
+        using const_iterator = Tokens::const_iterator;
+
+        explicit Tokenizer(const string &s);
+
+        explicit Tokenizer(istream &is);
+
+        ~Tokenizer() = default;
+
+        size_t NumberTokens() const { return _tokens.size(); }
+
+        const_iterator begin() const { return _tokens.cbegin(); }
+
+        const_iterator end() const { return _tokens.cend(); }
+
+        const string &operator[](size_t i) const { return _tokens[i]; }
+
+    private:
+        void Tokenize(istream &is);
+
+        Tokenizer(const Tokenizer &) = delete;
+
+        Tokenizer(Tokenizer &&) = delete;
+
+        Tokenizer &operator=(const Tokenizer &) = delete;
+
+        Tokenizer &operator=(Tokenizer &&) = delete;
+
+        Tokens _tokens;
     };
+
+    Tokenizer::Tokenizer(const string &s) {
+        std::istringstream iss{s};
+        Tokenize(iss);
+    }
+
+    Tokenizer::Tokenizer(istream &is) {
+        Tokenize(is);
+    }
+
+    void Tokenizer::Tokenize(istream &is) {
+        std::copy(istream_iterator<string>{is}, istream_iterator<string>{}, back_inserter(_tokens));
+    }
 }
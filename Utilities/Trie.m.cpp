@@ -0,0 +1,239 @@
+module;
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+
+export module CalcUtilities:Trie;
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+namespace Calculator {
+
+    // Set of words stored as a trie whose nodes live in one vector, for
+    // prefix and nearest-word lookups that do not depend on how many words
+    // are stored. Children are kept sorted, so words come out in order.
+    export class Trie {
+    public:
+        Trie();
+
+        size_t Size() const { return _size; }
+
+        bool Contains(string_view word) const;
+
+        void Insert(string_view word);
+
+        void Erase(string_view word);
+
+        void Clear();
+
+        // The words that start with prefix, sorted, at most limit of them.
+        vector<string> WithPrefix(string_view prefix, size_t limit = std::numeric_limits<size_t>::max()) const;
+
+        // The words at most maxDistance single-character insertions,
+        // deletions or substitutions away from word, nearest first, at most
+        // limit of them. Subtrees that cannot come within maxDistance are
+        // not visited.
+        vector<string> Similar(string_view word, size_t maxDistance, size_t limit) const;
+
+    private:
+        using Index = std::uint32_t;
+
+        struct Node {
+            vector<std::pair<char, Index>> children;  // sorted by character
+            bool terminal{false};
+        };
+
+        Index Find(string_view word) const;
+
+        Index Child(Index node, char c) const;
+
+        Index AddChild(Index node, char c);
+
+        static constexpr Index None = 0;    // the root is nobody's child
+
+        vector<Node> _nodes;
+        vector<Index> _free;
+        size_t _size;
+    };
+
+    Trie::Trie() : _nodes(1), _size{0} {}
+
+    Trie::Index Trie::Child(Index node, char c) const {
+        const auto &children = _nodes[node].children;
+        auto it = std::ranges::lower_bound(children, c, {}, &std::pair<char, Index>::first);
+
+        return it != children.end() && it->first == c ? it->second : None;
+    }
+
+    Trie::Index Trie::Find(string_view word) const {
+        Index n{0};
+
+        for (auto c: word) {
+            if ((n = Child(n, c)) == None)
+                return None;
+        }
+        return n;
+    }
+
+    Trie::Index Trie::AddChild(Index node, char c) {
+        Index child;
+
+        if (_free.empty()) {
+            child = static_cast<Index>(_nodes.size());
+            _nodes.emplace_back();
+        } else {
+            child = _free.back();
+            _free.pop_back();
+        }
+
+        auto &children = _nodes[node].children;
+        auto it = std::ranges::lower_bound(children, c, {}, &std::pair<char, Index>::first);
+        children.insert(it, {c, child});
+        return child;
+    }
+
+    bool Trie::Contains(string_view word) const {
+        auto n = Find(word);
+        return (n != None || word.empty()) && _nodes[n].terminal;
+    }
+
+    void Trie::Insert(string_view word) {
+        Index n{0};
+
+        for (auto c: word) {
+            auto child = Child(n, c);
+            n = child != None ? child : AddChild(n, c);
+        }
+
+        if (!_nodes[n].terminal) {
+            _nodes[n].terminal = true;
+            ++_size;
+        }
+    }
+
+    // Nodes left without words below them are recycled.
+    void Trie::Erase(string_view word) {
+        vector<Index> path{0};
+
+        for (auto c: word) {
+            auto child = Child(path.back(), c);
+
+            if (child == None)
+                return;
+
+            path.push_back(child);
+        }
+
+        if (!_nodes[path.back()].terminal)
+            return;
+
+        _nodes[path.back()].terminal = false;
+        --_size;
+
+        for (auto i = word.size(); i > 0; --i) {
+            auto &node = _nodes[path[i]];
+
+            if (node.terminal || !node.children.empty())
+                break;
+
+            auto &siblings = _nodes[path[i - 1]].children;
+            std::erase_if(siblings, [&word, i](const auto &s) { return s.first == word[i - 1]; });
+            _free.push_back(path[i]);
+        }
+    }
+
+    void Trie::Clear() {
+        _nodes.assign(1, Node{});
+        _free.clear();
+        _size = 0;
+    }
+
+    vector<string> Trie::WithPrefix(string_view prefix, size_t limit) const {
+        vector<string> words;
+        auto start = Find(prefix);
+
+        if (start == None && !prefix.empty())
+            return words;
+
+        string word{prefix};
+
+        auto collect = [&](auto &self, Index n) -> void {
+            if (_nodes[n].terminal)
+                words.push_back(word);
+
+            for (auto [c, child]: _nodes[n].children) {
+                if (words.size() == limit)
+                    return;
+
+                word.push_back(c);
+                self(self, child);
+                word.pop_back();
+            }
+        };
+
+        if (limit > 0)
+            collect(collect, start);
+
+        return words;
+    }
+
+    // Extends one row of the edit distance table per trie edge, so a common
+    // prefix of many words is only compared once. The row for depth d is
+    // kept at rows[d * width], reused by every node at that depth.
+    vector<string> Trie::Similar(string_view word, size_t maxDistance, size_t limit) const {
+        vector<std::pair<size_t, string>> found;
+        string candidate;
+        const auto width = word.size() + 1;
+        vector<size_t> rows(width);
+
+        for (size_t j = 0; j < width; ++j)
+            rows[j] = j;
+
+        auto search = [&](auto &self, Index n, size_t depth) -> void {
+            if (rows.size() < (depth + 2) * width)
+                rows.resize((depth + 2) * width);
+
+            const auto previous = depth * width, row = previous + width;
+
+            for (auto [c, child]: _nodes[n].children) {
+                auto best = rows[row] = rows[previous] + 1;
+
+                for (size_t j = 1; j < width; ++j) {
+                    rows[row + j] = std::min({rows[previous + j] + 1, rows[row + j - 1] + 1,
+                                              rows[previous + j - 1] + (word[j - 1] != c)});
+                    best = std::min(best, rows[row + j]);
+                }
+
+                candidate.push_back(c);
+
+                if (_nodes[child].terminal && rows[row + width - 1] <= maxDistance)
+                    found.emplace_back(rows[row + width - 1], candidate);
+
+                if (best <= maxDistance)
+                    self(self, child, depth + 1);
+
+                candidate.pop_back();
+            }
+        };
+
+        search(search, 0, 0);
+        std::ranges::sort(found);
+
+        vector<string> words;
+
+        for (auto &f: found) {
+            if (words.size() == limit)
+                break;
+
+            words.push_back(std::move(f.second));
+        }
+        return words;
+    }
+}
@@ -2,3 +2,9 @@ export module CalcUtilities;
 
 export import :Publisher;
 export import :Observer;
+export import :Tokenizer;
+export import :Coroutine;
+export import :PersistentStack;
+export import :Instrumentation;
+export import :Trie;
+export import :PushBuffer;